@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define CONEV_H
 #include "conev.h"
 
@@ -5,9 +6,371 @@
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <time.h>
+
+#ifdef SPLICE_SUPPORT
+#include <fcntl.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef MEMFD_SUPPORT
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#ifdef MFD_CLOEXEC
+    #include <sys/syscall.h>
+    #define memfd_create(name, flags) syscall(__NR_memfd_create, name, flags);
+#else
+    #define memfd_create(name, flags) fileno(tmpfile())
+#endif
+#endif
+
+#define SLAB_BLOCKS 16
+
+// half-closed socket would report RDHUP on every wait
+#define rdhup(val) \
+    ((val)->flag & FLAG_RDHUP ? 0 : POLLRDHUP)
+
+#ifdef IOURING
+#include <errno.h>
+#include <sys/syscall.h>
+
+#define UTAG_NONE UINT64_MAX
+// id of eval is below 2^31, so poll tags never have it
+#define UTAG_OP (1ULL << 63)
+
+#define uev(pool, val) \
+    (&(pool)->chunks[(val)->id / EV_CHUNK]->uevs[(val)->id % EV_CHUNK])
+
+#define utag(pool, val) \
+    (((uint64_t)(val)->id << 32) | uev(pool, val)->gen)
+
+
+static int uring_init(struct uring *r, int efd, struct io_uring_params *p)
+{
+    r->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    r->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ptr = mmap(0, r->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, efd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = 0;
+        return -1;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else {
+        r->cq_ptr = mmap(0, r->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, efd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = 0;
+            return -1;
+        }
+    }
+    r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, efd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = 0;
+        return -1;
+    }
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    
+    r->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    r->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+    r->sq_entries = p->sq_entries;
+    r->tail = *r->sq_tail;
+    
+    unsigned int *array = (unsigned int *)(sq + p->sq_off.array);
+    for (unsigned int i = 0; i < p->sq_entries; i++) {
+        array[i] = i;
+    }
+    r->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    r->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+
+static void uring_free(struct uring *r)
+{
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+
+static inline int uring_enter(int efd,
+        unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, efd, submit, wait, flags, 0, 0);
+}
+
+
+static int uring_submit(struct poolhd *pool, unsigned int wait)
+{
+    struct uring *r = &pool->ring;
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    
+    unsigned int n = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (!n && !wait) {
+        return 0;
+    }
+    return uring_enter(pool->efd, n, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+
+static struct io_uring_sqe *uring_sqe(struct poolhd *pool)
+{
+    struct uring *r = &pool->ring;
+    
+    if (r->tail - __atomic_load_n(r->sq_head,
+            __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (uring_submit(pool, 0) < 0) {
+            return 0;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->tail++;
+    return sqe;
+}
+
+
+static int uring_arm(struct poolhd *pool, struct eval *val)
+{
+    struct uring_ev *uev = uev(pool, val);
+    
+    if (val->flag & FLAG_URING) {
+        return 0;
+    }
+    // RDHUP can't be masked in io_uring poll, half-closed socket 
+    // would complete at once, wait until there is interest again
+    if (!val->events && (val->flag & FLAG_RDHUP)) {
+        return 0;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(pool);
+    if (!sqe) {
+        return -1;
+    }
+    if (++pool->gen == 0) {
+        pool->gen = 1;
+    }
+    uev->gen = pool->gen;
+    uev->armed = 1;
+    uev->events = rdhup(val) | val->events;
+    
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = val->fd;
+    sqe->user_data = utag(pool, val);
+    uint32_t events = uev->events;
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = events << 16 | events >> 16;
+    #endif
+    sqe->poll32_events = events;
+    return 0;
+}
+
+
+static int uring_disarm(struct poolhd *pool, struct eval *val)
+{
+    struct uring_ev *uev = uev(pool, val);
+    if (!uev->armed) {
+        return 0;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(pool);
+    if (!sqe) {
+        return -1;
+    }
+    uev->armed = 0;
+    
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = utag(pool, val);
+    sqe->user_data = UTAG_NONE;
+    #ifdef IOSQE_CQE_SKIP_SUCCESS
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    #endif
+    return 0;
+}
+
+
+// socket is not polled anymore, all I/O goes through uring_io
+int uring_start(struct poolhd *pool, struct eval *val)
+{
+    if (!pool->ring.io) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    val->flag |= FLAG_URING;
+    if (uring_disarm(pool, val)) {
+        return -1;
+    }
+    // completed poll may be still in current batch
+    uev(pool, val)->gen = 0;
+    return 0;
+}
+
+
+// cancelled operations may outlive their items, so table isn't 
+// limited by pool size, indexes are kept by reallocation
+static int uring_ops_grow(struct uring *r)
+{
+    int n = r->ops_n ? r->ops_n * 2 : EV_CHUNK;
+    
+    struct uring_op *ops = realloc(r->ops, sizeof(*ops) * n);
+    if (!ops) {
+        return -1;
+    }
+    for (int i = r->ops_n; i < n; i++) {
+        memset(&ops[i], 0, sizeof(*ops));
+        ops[i].next = i + 1 < n ? i + 1 : r->op_free;
+    }
+    r->op_free = r->ops_n;
+    r->ops = ops;
+    r->ops_n = n;
+    return 0;
+}
+
+
+int uring_io(struct poolhd *pool, struct eval *val, 
+        int fd, int opcode, size_t off, size_t len)
+{
+    struct uring *r = &pool->ring;
+    struct uring_ev *uev = uev(pool, val);
+    
+    assert(!uev->op && val->cold->buff.data);
+    if (r->op_free < 0 && uring_ops_grow(r)) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(pool);
+    if (!sqe) {
+        return -1;
+    }
+    int i = r->op_free;
+    struct uring_op *op = &r->ops[i];
+    r->op_free = op->next;
+    
+    op->id = val->id;
+    op->buf = val->cold->buff.data;
+    uev->op = i + 1;
+    
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)(op->buf + off);
+    sqe->len = len;
+    sqe->user_data = UTAG_OP | i;
+    return 0;
+}
+
+
+static int uring_cancel_op(struct poolhd *pool, int i)
+{
+    struct io_uring_sqe *sqe = uring_sqe(pool);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UTAG_OP | i;
+    sqe->user_data = UTAG_NONE;
+    #ifdef IOSQE_CQE_SKIP_SUCCESS
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    #endif
+    pool->ring.ops[i].cancel = 0;
+    return 0;
+}
+
+
+// cancel that didn't fit in ring is queued before next wait,
+// otherwise op on closed socket may never complete
+static void uring_cancel_left(struct poolhd *pool)
+{
+    struct uring *r = &pool->ring;
+    
+    for (int i = 0; i < r->ops_n && r->cancel_n; i++) {
+        if (!r->ops[i].cancel) {
+            continue;
+        }
+        if (uring_cancel_op(pool, i)) {
+            return;
+        }
+        r->cancel_n--;
+    }
+}
+
+
+static void uring_cancel(struct poolhd *pool, struct eval *val)
+{
+    struct uring_ev *uev = uev(pool, val);
+    if (!uev->op) {
+        return;
+    }
+    int i = uev->op - 1;
+    uev->op = 0;
+    // buffer is freed with completion
+    pool->ring.ops[i].id = -1;
+    pool->ring.ops[i].cancel = 1;
+    val->cold->buff.data = 0;
+    
+    if (uring_cancel_op(pool, i)) {
+        pool->ring.cancel_n++;
+    }
+}
+
+
+static struct eval *uring_complete(struct poolhd *pool, 
+        struct io_uring_cqe *cqe)
+{
+    struct uring *r = &pool->ring;
+    int i = cqe->user_data & INT32_MAX;
+    struct uring_op *op = &r->ops[i];
+    int id = op->id;
+    
+    if (id < 0) {
+        buff_put(pool, op->buf);
+    }
+    if (op->cancel) {
+        op->cancel = 0;
+        r->cancel_n--;
+    }
+    op->next = r->op_free;
+    r->op_free = i;
+    if (id < 0) {
+        return 0;
+    }
+    struct eval *val = &pool->chunks[id / EV_CHUNK]->items[id % EV_CHUNK];
+    uev(pool, val)->op = 0;
+    r->res = cqe->res;
+    return val;
+}
+#endif
+
+
+static uint64_t clock_ms(void);
 
 
-struct poolhd *init_pool(int count)
+struct poolhd *init_pool(int count, int flags, size_t bsize)
 {
     struct poolhd *pool = calloc(sizeof(struct poolhd), 1);
     if (!pool) {
@@ -16,31 +379,350 @@ struct poolhd *init_pool(int count)
     pool->max = count;
     pool->count = 0;
     pool->iters = 0;
+    pool->tw.now = clock_ms();
+    pool->tw.tick = pool->tw.now / TW_TICK;
+    // free block keeps pointer to next
+    pool->bsize = (bsize + 15) & ~(size_t)15;
     
-    #ifndef NOEPOLL
+    #if defined(IOURING)
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CLAMP
+    };
+    int efd = syscall(__NR_io_uring_setup, count, &p);
+    if (efd < 0) {
+        free(pool);
+        return 0;
+    }
+    pool->efd = efd;
+    if (uring_init(&pool->ring, efd, &p)) {
+        destroy_pool(pool);
+        return 0;
+    }
+    // otherwise recv would block worker thread of kernel
+    pool->ring.io = (p.features & IORING_FEAT_FAST_POLL) ? 1 : 0;
+    
+    // allocated on first uring_io
+    pool->ring.op_free = -1;
+    #elif !defined(NOEPOLL)
     int efd = epoll_create(count);
     if (efd < 0) {
         free(pool);
         return 0;
     }
     pool->efd = efd;
-    #endif
-    pool->pevents = malloc(sizeof(*pool->pevents) * count);
-    pool->links = malloc(sizeof(*pool->links) * count);
-    pool->items = malloc(sizeof(*pool->items) * count);
     
-    if (!pool->pevents || !pool->links || !pool->items) {
+    if (flags & POOL_EDGE) {
+        pool->edge = 1;
+    }
+    #endif
+    // items are allocated by chunks on demand
+    pool->chunks_n = (count + EV_CHUNK - 1) / EV_CHUNK;
+    pool->chunks = calloc(sizeof(*pool->chunks), pool->chunks_n);
+    if (!pool->chunks) {
         destroy_pool(pool);
         return 0;
     }
-    for (int i = 0; i < count; i++) {
-        pool->links[i] = &(pool->items[i]);
-    }
-    memset(pool->items, 0, sizeof(*pool->items));
     return pool;
 }
 
 
+static struct eval_chunk *chunk_alloc(void)
+{
+    #ifndef _WIN32
+    // own mapping, so freed chunk is returned to system
+    void *p = mmap(0, sizeof(struct eval_chunk), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+    #else
+    return calloc(sizeof(struct eval_chunk), 1);
+    #endif
+}
+
+
+static void chunk_free(struct eval_chunk *chunk)
+{
+    #ifndef _WIN32
+    munmap(chunk, sizeof(*chunk));
+    #else
+    free(chunk);
+    #endif
+}
+
+
+static int pool_grow(struct poolhd *pool)
+{
+    int cap = pool->cap + EV_CHUNK;
+    int c = 0;
+    
+    while (c < pool->chunks_n && pool->chunks[c]) {
+        c++;
+    }
+    if (c >= pool->chunks_n) {
+        return -1;
+    }
+    struct eval **links = realloc(pool->links, sizeof(*links) * cap);
+    if (!links) {
+        return -1;
+    }
+    pool->links = links;
+    
+    void *pevents = realloc(pool->pevents, sizeof(*pool->pevents) * cap);
+    if (!pevents) {
+        return -1;
+    }
+    pool->pevents = pevents;
+    #ifdef EDGE_SUPPORT
+    if (pool->edge) {
+        struct eval **pend = realloc(pool->pend, sizeof(*pend) * cap);
+        if (!pend) {
+            return -1;
+        }
+        pool->pend = pend;
+    }
+    #endif
+    struct eval_chunk *chunk = chunk_alloc();
+    if (!chunk) {
+        return -1;
+    }
+    pool->chunks[c] = chunk;
+    
+    for (int i = 0; i < EV_CHUNK; i++) {
+        chunk->items[i].id = c * EV_CHUNK + i;
+        chunk->items[i].cold = &chunk->cold[i];
+        pool->links[pool->cap + i] = &chunk->items[i];
+    }
+    pool->cap = cap;
+    return 0;
+}
+
+
+static void pool_shrink(struct poolhd *pool)
+{
+    pool->shrink = 0;
+    
+    for (int c = 0; c < pool->chunks_n; c++) {
+        struct eval_chunk *chunk = pool->chunks[c];
+        // keep one free chunk for load spikes
+        if (!chunk || chunk->used
+                || pool->cap - pool->count < EV_CHUNK * 2) {
+            continue;
+        }
+        struct eval *first = chunk->items;
+        struct eval *end = first + EV_CHUNK;
+        
+        for (int i = pool->count; i < pool->cap; ) {
+            struct eval *val = pool->links[i];
+            if (val >= first && val < end) {
+                pool->links[i] = pool->links[--pool->cap];
+            } else {
+                i++;
+            }
+        }
+        chunk_free(chunk);
+        pool->chunks[c] = 0;
+    }
+}
+
+
+static uint64_t clock_ms(void)
+{
+    #ifdef _WIN32
+    return GetTickCount64();
+    #else
+    struct timespec ts;
+    #ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    #else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    #endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    #endif
+}
+
+
+static void tw_link(struct eval **head, struct eval *val, short slot)
+{
+    struct eval_cold *c = val->cold;
+    c->tnext = *head;
+    c->tpprev = head;
+    c->tslot = slot;
+    if (*head) {
+        (*head)->cold->tpprev = &c->tnext;
+    }
+    *head = val;
+}
+
+
+static void tw_unlink(struct poolhd *pool, struct eval *val)
+{
+    struct eval_cold *c = val->cold;
+    if (!c->tpprev) {
+        return;
+    }
+    *c->tpprev = c->tnext;
+    if (c->tnext) {
+        c->tnext->cold->tpprev = c->tpprev;
+    }
+    if (c->tslot >= 0) {
+        int k = c->tslot >> TW_BITS, s = c->tslot & (TW_SIZE - 1);
+        if (!pool->tw.slots[k][s]) {
+            pool->tw.mask[k] &= ~(1ULL << s);
+        }
+    }
+    c->tnext = 0;
+    c->tpprev = 0;
+}
+
+
+static void tw_insert(struct twheel *tw, struct eval *val)
+{
+    uint64_t expire = val->cold->expire;
+    if (expire <= tw->tick) {
+        tw_link(&tw->expired, val, -1);
+        return;
+    }
+    uint64_t delta = expire - tw->tick;
+    int k = 0;
+    
+    while (k < TW_LEVELS - 1 
+            && delta >= (1ULL << (TW_BITS * (k + 1)))) {
+        k++;
+    }
+    int s = (expire >> (TW_BITS * k)) & (TW_SIZE - 1);
+    tw_link(&tw->slots[k][s], val, (k << TW_BITS) | s);
+    tw->mask[k] |= 1ULL << s;
+}
+
+
+static void tw_move(struct twheel *tw, int k, int s, int expired)
+{
+    struct eval *val = tw->slots[k][s];
+    tw->slots[k][s] = 0;
+    tw->mask[k] &= ~(1ULL << s);
+    
+    while (val) {
+        struct eval *next = val->cold->tnext;
+        if (expired) {
+            tw_link(&tw->expired, val, -1);
+        } else {
+            tw_insert(tw, val);
+        }
+        val = next;
+    }
+}
+
+
+static void tw_advance(struct poolhd *pool)
+{
+    struct twheel *tw = &pool->tw;
+    tw->now = clock_ms();
+    uint64_t now = tw->now / TW_TICK;
+    
+    while (tw->tick < now) {
+        int k = 0;
+        while (k < TW_LEVELS && !tw->mask[k]) {
+            k++;
+        }
+        if (k == TW_LEVELS) {
+            tw->tick = now;
+            break;
+        }
+        // nothing can fire before lowest non-empty level turns
+        if (k > 0) {
+            uint64_t skip = tw->tick | ((1ULL << (TW_BITS * k)) - 1);
+            if (skip > tw->tick) {
+                tw->tick = skip < now ? skip : now;
+                continue;
+            }
+        }
+        uint64_t t = ++tw->tick;
+        
+        for (k = 1; k < TW_LEVELS; k++) {
+            if (t & ((1ULL << (TW_BITS * k)) - 1)) {
+                break;
+            }
+            tw_move(tw, k, (t >> (TW_BITS * k)) & (TW_SIZE - 1), 0);
+        }
+        tw_move(tw, 0, t & (TW_SIZE - 1), 1);
+    }
+}
+
+
+static int tw_timeout(struct poolhd *pool)
+{
+    struct twheel *tw = &pool->tw;
+    if (tw->expired) {
+        return 0;
+    }
+    uint64_t next = UINT64_MAX;
+    
+    for (int k = 0; k < TW_LEVELS; k++) {
+        uint64_t m = tw->mask[k];
+        if (!m) {
+            continue;
+        }
+        int sh = TW_BITS * k;
+        int r = ((tw->tick >> sh) + 1) & (TW_SIZE - 1);
+        if (r) {
+            m = (m >> r) | (m << (TW_SIZE - r));
+        }
+        uint64_t t = ((tw->tick >> sh) + __builtin_ctzll(m) + 1) << sh;
+        if (t < next) {
+            next = t;
+        }
+    }
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+    next *= TW_TICK;
+    if (next <= tw->now) {
+        return 0;
+    }
+    return next - tw->now > INT_MAX ? INT_MAX : (int)(next - tw->now);
+}
+
+
+static struct eval *next_timer(struct poolhd *pool, int *type)
+{
+    struct eval *val = pool->tw.expired;
+    if (!val) {
+        return 0;
+    }
+    tw_unlink(pool, val);
+    *type = POLLTIMEOUT;
+    return val;
+}
+
+
+void set_timer(struct poolhd *pool, struct eval *val, unsigned int ms)
+{
+    struct twheel *tw = &pool->tw;
+    tw_unlink(pool, val);
+    if (!ms) {
+        return;
+    }
+    uint64_t expire = (tw->now + ms + TW_TICK - 1) / TW_TICK;
+    
+    uint64_t max = tw->tick + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+    val->cold->expire = expire > max ? max : expire;
+    
+    if (val->cold->expire <= tw->tick) {
+        val->cold->expire = tw->tick + 1;
+    }
+    tw_insert(tw, val);
+}
+
+
+unsigned int idle_time(struct poolhd *pool, struct eval *val)
+{
+    uint32_t t = val->active;
+    if (val->pair && (int32_t)(val->pair->active - t) > 0) {
+        t = val->pair->active;
+    }
+    return ((uint32_t)pool->tw.tick - t) * TW_TICK;
+}
+
+
 struct eval *add_event(struct poolhd *pool, enum eid type,
         int fd, int e)
 {
@@ -48,16 +730,36 @@ struct eval *add_event(struct poolhd *pool, enum eid type,
     if (pool->count >= pool->max) {
         return 0;
     }
+    if (pool->count >= pool->cap && pool_grow(pool)) {
+        return 0;
+    }
     struct eval *val = pool->links[pool->count];
+    // pointer may still be in pending list
+    char pending = val->pending;
+    int id = val->id;
+    struct eval_cold *cold = val->cold;
     memset(val, 0, sizeof(*val));
+    memset(cold, 0, sizeof(*cold));
     
     val->mod_iter = pool->iters;
     val->fd = fd;
     val->index = pool->count;
+    val->id = id;
+    val->cold = cold;
     val->type = type;
+    val->events = e;
+    val->pending = pending;
+    val->active = pool->tw.tick;
     
-    #ifndef NOEPOLL
+    #if defined(IOURING)
+    if (uring_arm(pool, val)) {
+        return 0;
+    }
+    #elif !defined(NOEPOLL)
     struct epoll_event ev = { .events = EPOLLRDHUP | e, .data = {val} };
+    if (pool->edge) {
+        ev.events = EPOLLRDHUP | EPOLLIN | EPOLLOUT | EPOLLET;
+    }
     if (epoll_ctl(pool->efd, EPOLL_CTL_ADD, fd, &ev)) {
         return 0;
     }
@@ -69,6 +771,7 @@ struct eval *add_event(struct poolhd *pool, enum eid type,
     pfd->revents = 0;
     #endif
     
+    pool->chunks[id / EV_CHUNK]->used++;
     pool->count++;
     return val;
 }
@@ -80,21 +783,51 @@ void del_event(struct poolhd *pool, struct eval *val)
     if (val->fd == -1) {
         return;
     }
-    #ifdef NOEPOLL
+    tw_unlink(pool, val);
+    #if defined(IOURING)
+    uring_disarm(pool, val);
+    uring_cancel(pool, val);
+    uev(pool, val)->gen = 0;
+    #elif defined(NOEPOLL)
     assert(val->fd == pool->pevents[val->index].fd);
     #else
     epoll_ctl(pool->efd, EPOLL_CTL_DEL, val->fd, 0);
     #endif
-    if (val->buff.data) {
-        assert(val->buff.size);
-        free(val->buff.data);
-        val->buff.data = 0;
+    if (val->cold->buff.data) {
+        buff_put(pool, val->cold->buff.data);
+        val->cold->buff.data = 0;
+    }
+    #ifdef SPLICE_SUPPORT
+    if (val->pipe) {
+        pipe_put(pool, val->pipe);
+        val->pipe = 0;
+    }
+    #endif
+    struct desync_wait *w = &val->cold->dwait;
+    #ifdef _WIN32
+    if (w->hfile) {
+        CloseHandle(w->hfile);
+        w->hfile = 0;
     }
+    if (w->ov.hEvent) {
+        CloseHandle(w->ov.hEvent);
+        w->ov.hEvent = 0;
+    }
+    #elif defined(MEMFD_SUPPORT)
+    if (w->fake) {
+        fake_put(pool, w->fake, val->fd);
+        w->fake = 0;
+    }
+    #endif
     close(val->fd);
     val->fd = -1;
     val->mod_iter = pool->iters;
     pool->count--;
     
+    if (!--pool->chunks[val->id / EV_CHUNK]->used) {
+        pool->shrink = 1;
+    }
+    
     struct eval *ev = pool->links[pool->count];
     if (ev != val) 
     {
@@ -118,6 +851,19 @@ void del_event(struct poolhd *pool, struct eval *val)
 }
 
 
+// by id, which is kept while pointer may become invalid
+struct eval *find_event(struct poolhd *pool, int id)
+{
+    struct eval_chunk *chunk = id / EV_CHUNK < pool->chunks_n ?
+        pool->chunks[id / EV_CHUNK] : 0;
+    if (!chunk) {
+        return 0;
+    }
+    struct eval *val = &chunk->items[id % EV_CHUNK];
+    return val->fd > 0 ? val : 0;
+}
+
+
 void destroy_pool(struct poolhd *pool)
 {
     for (int x = 0; x < pool->count; x++) {
@@ -126,14 +872,55 @@ void destroy_pool(struct poolhd *pool)
             close(val->fd);
             val->fd = 0;
         }
-        if (val->buff.data) {
-            free(val->buff.data);
-            val->buff.data = 0;
+        #ifdef SPLICE_SUPPORT
+        if (val->pipe) {
+            close(val->pipe->fd[0]);
+            close(val->pipe->fd[1]);
+            free(val->pipe);
+            val->pipe = 0;
+        }
+        #endif
+    }
+    while (pool->slabs) {
+        struct slab *s = pool->slabs;
+        pool->slabs = s->next;
+        free(s);
+    }
+    #ifdef SPLICE_SUPPORT
+    while (pool->pipes) {
+        struct pipe_buf *p = pool->pipes;
+        pool->pipes = p->next;
+        close(p->fd[0]);
+        close(p->fd[1]);
+        free(p);
+    }
+    #endif
+    #ifdef MEMFD_SUPPORT
+    while (pool->fakes) {
+        struct fake_buf *f = pool->fakes;
+        pool->fakes = f->next;
+        munmap(f->map, pool->bsize);
+        close(f->fd);
+        free(f);
+    }
+    #endif
+    if (pool->chunks) {
+        for (int c = 0; c < pool->chunks_n; c++) {
+            if (pool->chunks[c]) {
+                chunk_free(pool->chunks[c]);
+            }
         }
+        free(pool->chunks);
     }
-    free(pool->items);
     free(pool->links);
     free(pool->pevents);
+    #ifdef IOURING
+    free(pool->ring.ops);
+    uring_free(&pool->ring);
+    #endif
+    #ifdef EDGE_SUPPORT
+    free(pool->pend);
+    #endif
     #ifndef NOEPOLL
     if (pool->efd)
         close(pool->efd);
@@ -143,17 +930,200 @@ void destroy_pool(struct poolhd *pool)
 }
 
 
-#ifndef NOEPOLL
+#if defined(IOURING)
+static int uring_wait(struct poolhd *pool, int timeout)
+{
+    if (pool->ring.cancel_n) {
+        uring_cancel_left(pool);
+    }
+    // completes by time or with any other event
+    if (timeout >= 0) {
+        struct io_uring_sqe *sqe = uring_sqe(pool);
+        if (!sqe) {
+            return -1;
+        }
+        pool->ring.ts.tv_sec = timeout / 1000;
+        pool->ring.ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)&pool->ring.ts;
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = UTAG_NONE;
+    }
+    if (uring_submit(pool, 1) < 0) {
+        return -1;
+    }
+    struct uring *r = &pool->ring;
+    
+    unsigned int head = *r->cq_head;
+    unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    
+    for (; head != tail && n < pool->cap; head++, n++) {
+        pool->pevents[n] = r->cqes[head & r->cq_mask];
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+
 struct eval *next_event(struct poolhd *pool, int *offs, int *type)
 {
+    // oneshot poll, rearm previous, it will be submitted with next wait
+    struct eval *last = pool->last;
+    if (last && last->fd > 0
+            && !uev(pool, last)->armed) {
+        if (uring_arm(pool, last)) {
+            return 0;
+        }
+    }
+    pool->last = 0;
+    
     while (1) {
         int i = *offs;
-        assert(i >= -1 && i < pool->max);
+        assert(i >= -1 && i < pool->cap);
         if (i < 0) {
-            i = (epoll_wait(pool->efd, pool->pevents, pool->max, -1) - 1);
+            struct eval *val = next_timer(pool, type);
+            if (val) {
+                return val;
+            }
+            if (pool->shrink) {
+                pool_shrink(pool);
+            }
+            i = uring_wait(pool, tw_timeout(pool)) - 1;
+            if (i < -1) {
+                return 0;
+            }
+            tw_advance(pool);
             if (i < 0) {
+                continue;
+            }
+            if (pool->iters == UINT_MAX) {
+                pool->iters = 0;
+            }
+            pool->iters++;
+        }
+        struct io_uring_cqe *cqe = &pool->pevents[i];
+        *offs = i - 1;
+        
+        if (cqe->user_data == UTAG_NONE) {
+            continue;
+        }
+        if (cqe->user_data & UTAG_OP) {
+            struct eval *val = uring_complete(pool, cqe);
+            if (!val) {
+                continue;
+            }
+            val->active = pool->tw.tick;
+            pool->last = val;
+            
+            *type = POLLCOMPLETE;
+            return val;
+        }
+        uint64_t id = cqe->user_data >> 32;
+        struct eval_chunk *chunk = id / EV_CHUNK < (uint64_t)pool->chunks_n ? 
+            pool->chunks[id / EV_CHUNK] : 0;
+        if (!chunk) {
+            continue;
+        }
+        struct uring_ev *uev = &chunk->uevs[id % EV_CHUNK];
+        if (!uev->gen || uev->gen != (uint32_t)cqe->user_data) {
+            continue;
+        }
+        struct eval *val = &chunk->items[id % EV_CHUNK];
+        uev->armed = 0;
+        val->active = pool->tw.tick;
+        pool->last = val;
+        
+        *type = cqe->res < 0 ? POLLERR : cqe->res;
+        return val;
+    }
+}
+
+
+int mod_etype(struct poolhd *pool, struct eval *val, int type)
+{
+    assert(val->fd > 0);
+    struct uring_ev *uev = uev(pool, val);
+    
+    val->events = type;
+    // delivered item is rearmed in next_event
+    if (val == pool->last) {
+        return 0;
+    }
+    // rearming would drop completion that may be already queued
+    if (uev->armed && uev->events == (rdhup(val) | type)) {
+        return 0;
+    }
+    if (uring_disarm(pool, val)) {
+        return -1;
+    }
+    return uring_arm(pool, val);
+}
+
+#elif !defined(NOEPOLL)
+static inline void set_pending(struct poolhd *pool, struct eval *val)
+{
+    if (!val->pending) {
+        assert(pool->pend_n < pool->cap);
+        val->pending = 1;
+        pool->pend[pool->pend_n++] = val;
+    }
+}
+
+
+static struct eval *next_pending(struct poolhd *pool, int *type)
+{
+    while (pool->pend_n > 0) {
+        struct eval *val = pool->pend[--pool->pend_n];
+        val->pending = 0;
+        
+        if (val->fd > 0 && (val->ready & val->events)) {
+            *type = val->ready & val->events;
+            return val;
+        }
+    }
+    return 0;
+}
+
+
+struct eval *next_event(struct poolhd *pool, int *offs, int *type)
+{
+    // edge-triggered: data not consumed by handler, deliver again
+    struct eval *last = pool->last;
+    if (last && last->fd > 0 && last->type != EV_IGNORE
+            && (last->ready & last->events)) {
+        set_pending(pool, last);
+    }
+    pool->last = 0;
+    
+    while (1) {
+        int i = *offs;
+        assert(i >= -1 && i < pool->cap);
+        if (i < 0) {
+            struct eval *val = next_pending(pool, type);
+            if (val) {
+                pool->last = val;
+                return val;
+            }
+            if ((val = next_timer(pool, type))) {
+                return val;
+            }
+            // no pointers to items are held here
+            if (pool->shrink) {
+                pool_shrink(pool);
+            }
+            i = (epoll_wait(pool->efd, pool->pevents, 
+                pool->cap, tw_timeout(pool)) - 1);
+            if (i < -1) {
                 return 0;
             }
+            tw_advance(pool);
+            if (i < 0) {
+                continue;
+            }
             if (pool->iters == UINT_MAX) {
                 pool->iters = 0;
             }
@@ -164,7 +1134,17 @@ struct eval *next_event(struct poolhd *pool, int *offs, int *type)
         if (val->mod_iter == pool->iters) {
             continue;
         }
-        *type = pool->pevents[i].events;
+        int e = pool->pevents[i].events;
+        val->active = pool->tw.tick;
+        if (pool->edge) {
+            val->ready |= e & (POLLIN | POLLOUT);
+            e = (e & ~(POLLIN | POLLOUT)) | (val->ready & val->events);
+            if (!e) {
+                continue;
+            }
+            pool->last = val;
+        }
+        *type = e;
         return val;
     }
 }
@@ -173,8 +1153,19 @@ struct eval *next_event(struct poolhd *pool, int *offs, int *type)
 int mod_etype(struct poolhd *pool, struct eval *val, int type)
 {
     assert(val->fd > 0);
+    if (pool->edge) {
+        val->events = type;
+        if (val->ready & type) {
+            set_pending(pool, val);
+        }
+        return 0;
+    }
+    if (val->events == type && !(val->flag & FLAG_RDHUP)) {
+        return 0;
+    }
+    val->events = type;
     struct epoll_event ev = {
-        .events = EPOLLRDHUP | type, .data = {val}
+        .events = rdhup(val) | type, .data = {val}
     };
     return epoll_ctl(pool->efd, EPOLL_CTL_MOD, val->fd, &ev);
 }
@@ -183,11 +1174,25 @@ int mod_etype(struct poolhd *pool, struct eval *val, int type)
 struct eval *next_event(struct poolhd *pool, int *offs, int *typel)
 {
     for (int i = *offs; ; i--) {
-        assert(i >= -1 && i < pool->max);
+        assert(i >= -1 && i < pool->cap);
         if (i < 0) {
-            if (poll(pool->pevents, pool->count, -1) <= 0) {
+            struct eval *val = next_timer(pool, typel);
+            if (val) {
+                *offs = -1;
+                return val;
+            }
+            if (pool->shrink) {
+                pool_shrink(pool);
+            }
+            int n = poll(pool->pevents, pool->count, tw_timeout(pool));
+            if (n < 0) {
                 return 0;
             }
+            tw_advance(pool);
+            if (!n) {
+                i = 0;
+                continue;
+            }
             i = pool->count - 1;
             if (pool->iters == UINT_MAX) {
                 pool->iters = 0;
@@ -206,6 +1211,7 @@ struct eval *next_event(struct poolhd *pool, int *offs, int *typel)
         pool->pevents[i].revents = 0;
         *offs = i - 1;
         *typel = type;
+        val->active = pool->tw.tick;
         return val;
     }
 }
@@ -214,7 +1220,139 @@ struct eval *next_event(struct poolhd *pool, int *offs, int *typel)
 int mod_etype(struct poolhd *pool, struct eval *val, int type)
 {
    assert(val->index >= 0 && val->index < pool->count);
-   pool->pevents[val->index].events = POLLRDHUP | type;
+   val->events = type;
+   pool->pevents[val->index].events = rdhup(val) | type;
    return 0;
 }
 #endif
+
+
+// readiness is taken from kernel again, its edge may be already passed
+int recheck_event(struct poolhd *pool, struct eval *val)
+{
+    #ifdef EDGE_SUPPORT
+    if (pool->edge) {
+        struct epoll_event ev = {
+            .events = EPOLLRDHUP | EPOLLIN | EPOLLOUT | EPOLLET, .data = {val}
+        };
+        return epoll_ctl(pool->efd, EPOLL_CTL_MOD, val->fd, &ev);
+    }
+    #endif
+    return 0;
+}
+
+
+char *buff_get(struct poolhd *pool)
+{
+    if (!pool->bfree) {
+        struct slab *s = malloc(sizeof(*s) + pool->bsize * SLAB_BLOCKS);
+        if (!s) {
+            return 0;
+        }
+        s->next = pool->slabs;
+        pool->slabs = s;
+        
+        char *b = (char *)(s + 1);
+        for (int i = 0; i < SLAB_BLOCKS; i++, b += pool->bsize) {
+            *(char **)b = pool->bfree;
+            pool->bfree = b;
+        }
+    }
+    char *data = pool->bfree;
+    pool->bfree = *(char **)data;
+    return data;
+}
+
+
+void buff_put(struct poolhd *pool, char *data)
+{
+    *(char **)data = pool->bfree;
+    pool->bfree = data;
+}
+
+
+#ifdef SPLICE_SUPPORT
+struct pipe_buf *pipe_get(struct poolhd *pool)
+{
+    struct pipe_buf *p = pool->pipes;
+    if (p) {
+        pool->pipes = p->next;
+        p->next = 0;
+        return p;
+    }
+    p = calloc(sizeof(*p), 1);
+    if (!p) {
+        return 0;
+    }
+    if (pipe2(p->fd, O_NONBLOCK | O_CLOEXEC)) {
+        free(p);
+        return 0;
+    }
+    return p;
+}
+
+
+void pipe_put(struct poolhd *pool, struct pipe_buf *p)
+{
+    // pipe with data can't be reused
+    if (p->size) {
+        close(p->fd[0]);
+        close(p->fd[1]);
+        free(p);
+        return;
+    }
+    p->next = pool->pipes;
+    pool->pipes = p;
+}
+#endif
+
+
+#ifdef MEMFD_SUPPORT
+struct fake_buf *fake_get(struct poolhd *pool)
+{
+    struct fake_buf *f = pool->fakes;
+    if (f) {
+        pool->fakes = f->next;
+        f->next = 0;
+        return f;
+    }
+    f = calloc(sizeof(*f), 1);
+    if (!f) {
+        return 0;
+    }
+    f->fd = memfd_create("fake", 0);
+    if (f->fd < 0) {
+        free(f);
+        return 0;
+    }
+    if (ftruncate(f->fd, pool->bsize) < 0) {
+        close(f->fd);
+        free(f);
+        return 0;
+    }
+    f->map = mmap(0, pool->bsize, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, f->fd, 0);
+    if (f->map == MAP_FAILED) {
+        close(f->fd);
+        free(f);
+        return 0;
+    }
+    return f;
+}
+
+
+void fake_put(struct poolhd *pool, struct fake_buf *f, int sfd)
+{
+    int outq = 0;
+    
+    // unacked segments still refer to these pages
+    if (ioctl(sfd, SIOCOUTQ, &outq) || outq) {
+        munmap(f->map, pool->bsize);
+        close(f->fd);
+        free(f);
+        return;
+    }
+    f->next = pool->fakes;
+    pool->fakes = f;
+}
+#endif
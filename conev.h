@@ -15,11 +15,17 @@
     
     #ifndef NOEPOLL
         #include <sys/epoll.h>
+        #ifdef IOURING
+        #include <linux/io_uring.h>
+        #endif
+        // same values, if poll.h is already included
+        #ifndef POLLIN
         #define POLLIN EPOLLIN
         #define POLLOUT EPOLLOUT
         #define POLLERR EPOLLERR
         #define POLLHUP EPOLLHUP
         #define POLLRDHUP EPOLLRDHUP
+        #endif
     #else
         #include <sys/poll.h>
     #endif
@@ -29,6 +35,30 @@
     #define POLLRDHUP 0
 #endif
 
+#if !defined(NOEPOLL) && !defined(IOURING)
+    #define EDGE_SUPPORT 1
+#endif
+
+#define POOL_EDGE 1
+
+#define EV_CHUNK 512
+
+// timer wheel: 4 levels of 64 slots, 4 ms tick, ~18 hours range
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_LEVELS 4
+#define TW_TICK 4
+
+// not a poll flag, reported for expired timer
+#define POLLTIMEOUT (1 << 30)
+// not a poll flag, reported for completed uring_io
+#define POLLCOMPLETE (1 << 29)
+
+#ifdef __linux__
+    #define SPLICE_SUPPORT 1
+    #define MEMFD_SUPPORT 1
+#endif
+
 enum eid {
     EV_ACCEPT,
     EV_REQUEST,
@@ -37,12 +67,23 @@ enum eid {
     EV_TUNNEL,
     EV_PRE_TUNNEL,
     EV_UDP_TUNNEL,
-    EV_DESYNC
+    EV_DESYNC,
+    EV_DNS,
+    EV_PROTECT,
+    EV_NFQUEUE,
+    EV_TUN,
+    EV_TUN_FLOW,
+    EV_TUN_UDP
 };
 
 #define FLAG_S4 1
 #define FLAG_S5 2
 #define FLAG_CONN 4
+#define FLAG_OFFLOAD 8
+#define FLAG_EOF 16
+#define FLAG_RDHUP 32
+#define FLAG_NOOFFLOAD 64
+#define FLAG_URING 128
 
 #ifdef EID_STR
 char *eid_name[] = {
@@ -53,7 +94,13 @@ char *eid_name[] = {
     "EV_TUNNEL",
     "EV_PRE_TUNNEL",
     "EV_UDP_TUNNEL",
-    "EV_DESYNC"
+    "EV_DESYNC",
+    "EV_DNS",
+    "EV_PROTECT",
+    "EV_NFQUEUE",
+    "EV_TUN",
+    "EV_TUN_FLOW",
+    "EV_TUN_UDP"
 };
 #endif
 
@@ -63,38 +110,222 @@ struct buffer {
     char *data;
 };
 
-struct eval {
-    int fd;    
-    int index;
-    unsigned int mod_iter;
-    enum eid type;
-    struct eval *pair;
+struct slab {
+    struct slab *next;
+};
+
+#ifdef SPLICE_SUPPORT
+struct pipe_buf {
+    int fd[2];
+    ssize_t size;
+    struct pipe_buf *next;
+};
+#endif
+
+#ifdef MEMFD_SUPPORT
+// pool block sized file, mapped once, see send_fake
+struct fake_buf {
+    int fd;
+    char *map;
+    struct fake_buf *next;
+};
+#endif
+
+// desync step, which is finished after segment has left socket
+struct desync_wait {
+    char pending;
+    char m;
+    char slept;
+    char waited;
+    char expired;
+    char lowat;
+    int oob;
+    int delay;
+    long lp;
+    long fsize;
+#ifdef _WIN32
+    HANDLE hfile;
+    OVERLAPPED ov;
+#elif defined(MEMFD_SUPPORT)
+    struct fake_buf *fake;
+    // request start for injected segments, see inject_seq
+    uint32_t seq;
+    uint32_t ack;
+    int mss;
+#endif
+};
+
+struct resolver;
+struct race;
+struct trial;
+struct protector;
+struct stock;
+struct tun;
+struct tun_flow;
+
+struct eval_cold {
     struct buffer buff;
-    int flag;
     union {
         struct sockaddr_in in;
         struct sockaddr_in6 in6;
     };
     ssize_t recv_count;
+    ssize_t offload_diff;
     int attempt;
     char cache;
+    // groups taken in adaptive order, see auto_next
+    uint64_t tried;
+    // request is sent by group, ms
+    uint64_t sent;
+    // slot of parked query + 1, see dns_resolve
+    short dns;
+    // requested domain, see dns_prefer
+    uint32_t host;
+    // connection attempts in flight, see create_conn
+    struct race *race;
+    // desync groups raced for response, see trial_start
+    struct trial *trial;
+    // ticket of queued protect requests, see protect_queue
+    uint32_t prot;
+    // flow of tun device, see tun_close
+    struct tun_flow *tun;
+    struct desync_wait dwait;
+    
+    struct eval *tnext;
+    struct eval **tpprev;
+    uint64_t expire;
+    short tslot;
+};
+
+// read on every event, fits in one cache line
+struct eval {
+    struct eval *pair;
+    struct eval_cold *cold;
+#ifdef SPLICE_SUPPORT
+    struct pipe_buf *pipe;
+#endif
+    int fd;
+    int index;
+    int id;
+    unsigned int mod_iter;
+    enum eid type;
+    int events;
+    int ready;
+    int flag;
+    char pending;
+    uint32_t active;
+};
+
+#ifdef IOURING
+struct uring_ev {
+    uint32_t gen;
+    uint32_t events;
+    char armed;
+    // index of operation in flight + 1, see uring_io
+    int op;
+};
+
+// owns buffer until completion, as kernel may still use it
+struct uring_op {
+    // -1 after del_event
+    int id;
+    int next;
+    char *buf;
+    // cancel is not queued yet, see uring_cancel_left
+    char cancel;
+};
+
+struct uring {
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int tail;
+    struct io_uring_sqe *sqes;
+    
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    
+    struct __kernel_timespec ts;
+    
+    // sockets are polled by kernel itself on recv/send
+    char io;
+    struct uring_op *ops;
+    int ops_n;
+    int op_free;
+    int cancel_n;
+    // of last POLLCOMPLETE
+    int res;
+};
+#endif
+
+struct eval_chunk {
+    struct eval items[EV_CHUNK];
+    struct eval_cold cold[EV_CHUNK];
+#ifdef IOURING
+    struct uring_ev uevs[EV_CHUNK];
+#endif
+    int used;
+};
+
+struct twheel {
+    uint64_t now;
+    uint64_t tick;
+    uint64_t mask[TW_LEVELS];
+    struct eval *slots[TW_LEVELS][TW_SIZE];
+    struct eval *expired;
 };
 
 struct poolhd {
     int max;
     int count;
+    int cap;
     int efd;
     struct eval **links;
-    struct eval *items;
-#ifndef NOEPOLL
+    struct eval_chunk **chunks;
+    int chunks_n;
+    char shrink;
+#if defined(IOURING)
+    struct io_uring_cqe *pevents;
+#elif !defined(NOEPOLL)
     struct epoll_event *pevents;
 #else
     struct pollfd *pevents;
 #endif
     unsigned int iters;
+    struct eval *last;
+    struct twheel tw;
+    
+    size_t bsize;
+    struct slab *slabs;
+    char *bfree;
+#ifdef SPLICE_SUPPORT
+    struct pipe_buf *pipes;
+#endif
+#ifdef MEMFD_SUPPORT
+    struct fake_buf *fakes;
+#endif
+#ifdef EDGE_SUPPORT
+    char edge;
+    int pend_n;
+    struct eval **pend;
+#endif
+#ifdef IOURING
+    struct uring ring;
+    uint32_t gen;
+#endif
+    struct resolver *dns;
+    struct protector *prot;
+    struct stock *stock;
+    struct tun *tun;
 };
 
-struct poolhd *init_pool(int count);
+struct poolhd *init_pool(int count, int flags, size_t bsize);
 
 struct eval *add_event(struct poolhd *pool, enum eid type, int fd, int e);
 
@@ -102,8 +333,39 @@ struct eval *add_pair(struct poolhd *pool, struct eval *val, int sfd, int e);
 
 void del_event(struct poolhd *pool, struct eval *val);
 
+struct eval *find_event(struct poolhd *pool, int id);
+
 void destroy_pool(struct poolhd *pool);
 
 struct eval *next_event(struct poolhd *pool, int *offs, int *type);
 
 int mod_etype(struct poolhd *pool, struct eval *val, int type);
+
+void set_timer(struct poolhd *pool, struct eval *val, unsigned int ms);
+
+unsigned int idle_time(struct poolhd *pool, struct eval *val);
+
+int recheck_event(struct poolhd *pool, struct eval *val);
+
+char *buff_get(struct poolhd *pool);
+
+void buff_put(struct poolhd *pool, char *data);
+
+#ifdef IOURING
+int uring_start(struct poolhd *pool, struct eval *val);
+
+int uring_io(struct poolhd *pool, struct eval *val, 
+    int fd, int opcode, size_t off, size_t len);
+#endif
+
+#ifdef SPLICE_SUPPORT
+struct pipe_buf *pipe_get(struct poolhd *pool);
+
+void pipe_put(struct poolhd *pool, struct pipe_buf *pipe);
+#endif
+
+#ifdef MEMFD_SUPPORT
+struct fake_buf *fake_get(struct poolhd *pool);
+
+void fake_put(struct poolhd *pool, struct fake_buf *fake, int sfd);
+#endif
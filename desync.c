@@ -12,18 +12,7 @@
     #include <netinet/tcp.h>
     
     #ifdef __linux__
-    #include <sys/mman.h>
     #include <sys/sendfile.h>
-    #include <fcntl.h>
-
-    #include <desync.h>
-    
-    #ifdef MFD_CLOEXEC
-        #include <sys/syscall.h>
-        #define memfd_create(name, flags) syscall(__NR_memfd_create, name, flags);
-    #else
-        #define memfd_create(name, flags) fileno(tmpfile())
-    #endif
     #endif
 #else
     #include <winsock2.h>
@@ -36,6 +25,8 @@
 #include "params.h"
 #include "packets.h"
 #include "error.h"
+#include "desync.h"
+#include "inject.h"
 
 
 static inline int get_family(struct sockaddr *dst)
@@ -70,168 +61,163 @@ int setttl(int fd, int ttl, int family) {
     return 0;
 }
 
-#ifndef _WIN32
-static inline void delay(long ms)
+#ifdef __linux__
+// params are shared by workers
+#define can_wait_send() \
+    __atomic_load_n(&params.wait_send, __ATOMIC_RELAXED)
+
+// socket is writable only when nothing is left unsent,
+// kept until all parts are sent
+static int set_lowat(int sfd, struct desync_wait *w, int on)
 {
-    struct timespec time = { 
-         .tv_nsec = ms * 1e6
-    };
-    nanosleep(&time, 0);
+    int lowat = on ? 1 : 0;
+    
+    if (w->lowat == on) {
+        return 0;
+    }
+    if (setsockopt(sfd, IPPROTO_TCP, 
+            TCP_NOTSENT_LOWAT, (char *)&lowat, sizeof(lowat)) < 0) {
+        uniperror("setsockopt TCP_NOTSENT_LOWAT");
+        __atomic_store_n(&params.wait_send, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    w->lowat = on;
+    return 0;
 }
 #else
-#define delay(ms) Sleep(ms)
+#define can_wait_send() 0
 #endif
 
-#ifdef __linux__
-void wait_send(int sfd)
+// 1 - not sent yet, wait for POLLOUT (w->delay == 0) or w->delay ms
+static int wait_send(int sfd, struct desync_wait *w)
 {
-    for (int i = 0; params.wait_send && i < 500; i++) {
-        struct tcpi tcpi = {};
-        socklen_t ts = sizeof(tcpi);
-        
-        if (getsockopt(sfd, IPPROTO_TCP,
-                TCP_INFO, (char *)&tcpi, &ts) < 0) {
-            uniperror("getsockopt TCP_INFO");
-            break;
-        }
-        if (tcpi.state != 1) {
-            LOG(LOG_E, "state: %d\n", tcpi.state);
-            return;
-        }
-        if (ts < sizeof(tcpi)) {
-            LOG(LOG_E, "tcpi_notsent_bytes not provided\n");
-            params.wait_send = 0;
-            break;
-        }
-        if (tcpi.notsent_bytes == 0) {
-            return;
+    #ifdef __linux__
+    if (can_wait_send() && w->waited) {
+        if (!w->expired) {
+            return 0;
         }
-        LOG(LOG_S, "not sent after %d ms\n", i);
-        delay(1);
+        LOG(LOG_S, "not sent after %d ms\n", WAIT_SEND_MAX);
+    }
+    else if (can_wait_send() && !set_lowat(sfd, w, 1)) {
+        w->waited = 1;
+        w->delay = 0;
+        return 1;
+    }
+    #endif
+    if (w->slept || params.sfdelay <= 0) {
+        return 0;
     }
-    delay(params.sfdelay);
+    w->slept = 1;
+    w->delay = params.sfdelay;
+    return 1;
 }
-#define wait_send_if_support(sfd) \
-    if (params.wait_send) wait_send(sfd)
-#else
-#define wait_send(sfd) delay(params.sfdelay)
-#define wait_send_if_support(sfd) // :(
-#endif
 
 #ifdef __linux__
-ssize_t send_fake(int sfd, char *buffer,
-        int cnt, long pos, int fa, struct desync_params *opt)
+static int set_md5sig(int sfd, int keylen)
 {
     struct sockaddr_in6 addr = {};
     socklen_t addr_size = sizeof(addr);
-    if (opt->md5sig) {
-        if (getpeername(sfd, 
-                (struct sockaddr *)&addr, &addr_size) < 0) {
-            uniperror("getpeername");
-            return -1;
-        }
+    
+    if (getpeername(sfd, 
+            (struct sockaddr *)&addr, &addr_size) < 0) {
+        uniperror("getpeername");
+        return -1;
     }
+    struct tcp_md5sig md5 = {
+        .tcpm_keylen = keylen
+    };
+    memcpy(&md5.tcpm_addr, &addr, addr_size);
+    
+    if (setsockopt(sfd, IPPROTO_TCP,
+            TCP_MD5SIG, (char *)&md5, sizeof(md5)) < 0) {
+        uniperror("setsockopt TCP_MD5SIG");
+        return -1;
+    }
+    return 0;
+}
+
+
+// fake goes from the file at part offset, 
+// so several fakes of one request don't overlap
+ssize_t send_fake(struct poolhd *pool, int sfd, long lp, int cnt, long pos, 
+        int fa, struct desync_params *opt, struct desync_wait *w)
+{
     struct packet pkt;
     if (opt->fake_data.data) {
         pkt = opt->fake_data;
     }
     else {
-        pkt = cnt != IS_HTTP ? fake_tls : fake_http;
+        pkt = cnt != IS_HTTP ? opt->fake_tls : fake_http;
     }
     size_t psz = pkt.size;
     
-    int ffd = memfd_create("name", O_RDWR);
-    if (ffd < 0) {
-        uniperror("memfd_create");
+    if (!w->fake && !(w->fake = fake_get(pool))) {
+        uniperror("fake_get");
         return -1;
     }
-    char *p = 0;
-    ssize_t len = -1;
+    char *p = w->fake->map + lp;
     
-    while (1) {
-        if (ftruncate(ffd, pos) < 0) {
-            uniperror("ftruncate");
-            break;
-        }
-        p = mmap(0, pos, PROT_WRITE, MAP_SHARED, ffd, 0);
-        if (p == MAP_FAILED) {
-            uniperror("mmap");
-            p = 0;
-            break;
-        }
-        memcpy(p, pkt.data, psz < pos ? psz : pos);
-        
-        if (setttl(sfd, opt->ttl ? opt->ttl : 8, fa) < 0) {
-            break;
-        }
-        if (opt->md5sig) {
-            struct tcp_md5sig md5 = {
-                .tcpm_keylen = 5
-            };
-            memcpy(&md5.tcpm_addr, &addr, addr_size);
-            
-            if (setsockopt(sfd, IPPROTO_TCP,
-                    TCP_MD5SIG, (char *)&md5, sizeof(md5)) < 0) {
-                uniperror("setsockopt TCP_MD5SIG");
-                break;
-            }
-        }
-        if (opt->ip_options && fa == AF_INET
-            && setsockopt(sfd, IPPROTO_IP, IP_OPTIONS,
-                opt->ip_options, opt->ip_options_len) < 0) {
-            uniperror("setsockopt IP_OPTIONS");
-            break;
-        }
-        
-        len = sendfile(sfd, ffd, 0, pos);
-        if (len < 0) {
-            uniperror("sendfile");
-            break;
-        }
-        wait_send(sfd);
-        memcpy(p, buffer, pos);
-        
-        if (setttl(sfd, params.def_ttl, fa) < 0) {
-            break;
-        }
-        if (opt->ip_options && fa == AF_INET
-            && setsockopt(sfd, IPPROTO_IP,
-                IP_OPTIONS, opt->ip_options, 0) < 0) {
-            uniperror("setsockopt IP_OPTIONS");
-            break;
-        }
-        if (opt->md5sig) {
-            struct tcp_md5sig md5 = {
-                .tcpm_keylen = 0
-            };
-            memcpy(&md5.tcpm_addr, &addr, addr_size);
-            
-            if (setsockopt(sfd, IPPROTO_TCP,
-                    TCP_MD5SIG, (char *)&md5, sizeof(md5)) < 0) {
-                uniperror("setsockopt TCP_MD5SIG");
-                break;
-            }
-        }
-        break;
+    memcpy(p, pkt.data, psz < pos ? psz : pos);
+    if (psz < pos) {
+        memset(p + psz, 0, pos - psz);
+    }
+    if (setttl(sfd, opt->ttl ? opt->ttl : 8, fa) < 0) {
+        return -1;
+    }
+    if (opt->md5sig && set_md5sig(sfd, 5)) {
+        return -1;
+    }
+    if (opt->ip_options && fa == AF_INET
+        && setsockopt(sfd, IPPROTO_IP, IP_OPTIONS,
+            opt->ip_options, opt->ip_options_len) < 0) {
+        uniperror("setsockopt IP_OPTIONS");
+        return -1;
+    }
+    off_t offset = lp;
+    
+    ssize_t len = sendfile(sfd, w->fake->fd, &offset, pos);
+    if (len < 0) {
+        uniperror("sendfile");
+        return -1;
     }
-    if (p) munmap(p, pos);
-    close(ffd);
+    // real data is written after fake has left socket
+    w->fsize = pos;
     return len;
 }
+
+
+static int fake_finish(int sfd, char *buffer, 
+        int fa, struct desync_params *opt, struct desync_wait *w)
+{
+    // kernel retransmits from the same pages
+    memcpy(w->fake->map + w->lp, buffer, w->fsize);
+    
+    if (setttl(sfd, params.def_ttl, fa) < 0) {
+        return -1;
+    }
+    if (opt->ip_options && fa == AF_INET
+        && setsockopt(sfd, IPPROTO_IP,
+            IP_OPTIONS, opt->ip_options, 0) < 0) {
+        uniperror("setsockopt IP_OPTIONS");
+        return -1;
+    }
+    if (opt->md5sig && set_md5sig(sfd, 0)) {
+        return -1;
+    }
+    return 0;
+}
 #endif
 
 #ifdef _WIN32
-OVERLAPPED ov = {};
-
-ssize_t send_fake(int sfd, char *buffer,
-        int cnt, long pos, int fa, struct desync_params *opt)
+ssize_t send_fake(struct poolhd *pool, int sfd, long lp, int cnt, long pos, 
+        int fa, struct desync_params *opt, struct desync_wait *w)
 {
     struct packet pkt;
     if (opt->fake_data.data) {
         pkt = opt->fake_data;
     }
     else {
-        pkt = cnt != IS_HTTP ? fake_tls : fake_http;
+        pkt = cnt != IS_HTTP ? opt->fake_tls : fake_http;
     }
     size_t psz = pkt.size;
     
@@ -257,8 +243,9 @@ ssize_t send_fake(int sfd, char *buffer,
     ssize_t len = -1;
     
     while (1) {
-        ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        if (!ov.hEvent) {
+        memset(&w->ov, 0, sizeof(w->ov));
+        w->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!w->ov.hEvent) {
             uniperror("CreateEvent");
              break;
         }
@@ -283,7 +270,7 @@ ssize_t send_fake(int sfd, char *buffer,
         if (setttl(sfd, opt->ttl ? opt->ttl : 8, fa) < 0) {
             break;
         }
-        if (!TransmitFile(sfd, hfile, pos, pos, &ov, 
+        if (!TransmitFile(sfd, hfile, pos, pos, &w->ov, 
                 NULL, TF_USE_KERNEL_APC | TF_WRITE_BEHIND)) {
             if ((GetLastError() != ERROR_IO_PENDING) 
                         && (WSAGetLastError() != WSA_IO_PENDING)) {
@@ -291,37 +278,56 @@ ssize_t send_fake(int sfd, char *buffer,
                 break;
             }
         }
-        wait_send(sfd);
-        
-        if (SetFilePointer(hfile, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
+        // real data is written after fake has left socket
+        w->hfile = hfile;
+        w->fsize = pos;
+        return pos;
+    }
+    if (!CloseHandle(hfile)
+            || (w->ov.hEvent && !CloseHandle(w->ov.hEvent))) {
+        uniperror("CloseHandle");
+        w->ov.hEvent = 0;
+        return -1;
+    }
+    w->ov.hEvent = 0;
+    return len;
+}
+
+
+static int fake_finish(int sfd, char *buffer, 
+        int fa, struct desync_params *opt, struct desync_wait *w)
+{
+    int status = -1;
+    
+    while (1) {
+        if (SetFilePointer(w->hfile, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
             uniperror("SetFilePointer");
             break;
         }
-        if (!WriteFile(hfile, buffer, pos, 0, 0)) {
+        if (!WriteFile(w->hfile, buffer, w->fsize, 0, 0)) {
             uniperror("WriteFile");
             break;
         }
         if (setttl(sfd, params.def_ttl, fa) < 0) {
             break;
         }
-        len = pos;
+        status = 0;
         break;
     }
-    if (!CloseHandle(hfile)
-            || (ov.hEvent && !CloseHandle(ov.hEvent))) {
+    if (!CloseHandle(w->hfile)
+            || (w->ov.hEvent && !CloseHandle(w->ov.hEvent))) {
         uniperror("CloseHandle");
-        return -1;
+        status = -1;
     }
-    return len;
+    w->hfile = 0;
+    w->ov.hEvent = 0;
+    return status;
 }
 #endif
 
 ssize_t send_oob(int sfd, char *buffer,
         ssize_t n, long pos)
 {
-    ssize_t size = oob_data.size - 1;
-    char *data = oob_data.data + 1;
-    
     char rchar = buffer[pos];
     buffer[pos] = oob_data.data[0];
     
@@ -332,25 +338,7 @@ ssize_t send_oob(int sfd, char *buffer,
         uniperror("send");
         return -1;
     }
-    len--;
-    if (len != pos) {
-        return len;
-    }
-    if (size) {
-        wait_send(sfd);
-    }
-    for (long i = 0; i < size; i++) {
-        if (send(sfd, data + i, 1, MSG_OOB) < 0) {
-            uniperror("send");
-            if (get_e() == EAGAIN) {
-                return len;
-            }
-        }
-        if (size != 1) {
-            wait_send(sfd);
-        }
-    }
-    return len;
+    return len - 1;
 }
 
 
@@ -365,44 +353,170 @@ ssize_t send_disorder(int sfd,
     ssize_t len = send(sfd, buffer, pos, 0);
     if (len < 0) {
         uniperror("send");
+        setttl(sfd, params.def_ttl, fa);
     }
-    wait_send_if_support(sfd);
+    return len;
+}
+
+
+// finish part after it has been sent, 1 - call again later
+#ifdef RAW_SUPPORT
+// segment is sent by raw socket ahead of the real one,
+// so socket TTL is not changed and nothing to wait for
+static int raw_inject(int sfd, char *buffer, long lp, long pos, ssize_t n,
+        int m, int cnt, struct sockaddr *dst, struct desync_params *opt, struct desync_wait *w)
+{
+    if (!w->mss) {
+        if (inject_seq(sfd, &w->seq, &w->ack, &w->mss) < 0) {
+            LOG(LOG_E, "raw inject disabled\n");
+            // params are shared by workers
+            __atomic_store_n(&params.raw_inject, 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+        w->seq -= lp;
+    }
+    struct inject_seg seg = {
+        .ack = w->ack
+    };
+    struct packet pkt;
+    size_t len;
     
-    if (setttl(sfd, params.def_ttl, fa) < 0) {
-        return -1;
+    if (m == DESYNC_FAKE) {
+        if (opt->fake_data.data) {
+            pkt = opt->fake_data;
+        }
+        else {
+            pkt = cnt != IS_HTTP ? opt->fake_tls : fake_http;
+        }
+        len = pos - lp;
+        seg.seq = w->seq + lp;
+        seg.ttl = opt->ttl ? opt->ttl : 8;
+        seg.md5sig = opt->md5sig;
+        seg.ip_options = opt->ip_options;
+        seg.ip_options_len = opt->ip_options_len;
     }
-    return len;
+    else {
+        // next data goes first, part is sent after it
+        pkt.data = buffer + pos;
+        pkt.size = n - pos;
+        len = n - pos;
+        seg.seq = w->seq + pos;
+        seg.ttl = params.def_ttl;
+    }
+    if (len > w->mss) {
+        len = w->mss;
+    }
+    if (len > INJECT_MAX) {
+        len = INJECT_MAX;
+    }
+    return inject_send(sfd, dst, &seg, pkt.data, pkt.size, len);
 }
+#endif
 
 
-ssize_t desync(int sfd, char *buffer, size_t bfsize,
-        ssize_t n, ssize_t offset, struct sockaddr *dst, int dp_c)
+static int part_finish(int sfd, char *buffer, 
+        int fa, struct desync_params *dp, struct desync_wait *w)
 {
-    struct desync_params dp = params.dp[dp_c];
+    while (1) {
+        // rest of OOB data is sent byte by byte
+        char oob_left = w->m == DESYNC_OOB 
+            && w->oob < oob_data.size - 1;
+        
+        if ((w->m == DESYNC_FAKE || oob_left || can_wait_send())
+                && wait_send(sfd, w)) {
+            return 1;
+        }
+        if (!oob_left) {
+            break;
+        }
+        if (send(sfd, oob_data.data + 1 + w->oob, 1, MSG_OOB) < 0) {
+            uniperror("send");
+            break;
+        }
+        w->oob++;
+        w->waited = 0;
+        w->expired = 0;
+        w->slept = 0;
+    }
+    w->pending = 0;
     
-    char *host = 0;
+    switch (w->m) {
+        #ifdef FAKE_SUPPORT
+        case DESYNC_FAKE:
+            return fake_finish(sfd, buffer + w->lp, fa, dp, w);
+        #endif
+        case DESYNC_DISORDER:
+            return setttl(sfd, params.def_ttl, fa);
+    }
+    return 0;
+}
+
+
+// type of request, HTTP is modified in place
+static int parse_req(char *buffer, ssize_t n, 
+        char **host, struct desync_params *dp)
+{
     int len = 0, type = 0;
-    int fa = get_family(dst);
     // parse packet
-    if ((len = parse_tls(buffer, n, &host))) {
+    if ((len = parse_tls(buffer, n, host))) {
         type = IS_HTTPS;
     }
-    else if ((len = parse_http(buffer, n, &host, 0))) {
+    else if ((len = parse_http(buffer, n, host, 0))) {
         type = IS_HTTP;
     }
-    if (len && host) {
+    if (len && *host) {
         LOG(LOG_S, "host: %.*s (%ld)\n",
-            len, host, host - buffer);
+            len, *host, *host - buffer);
     }
     // modify packet
-    if (type == IS_HTTP && dp.mod_http) {
+    if (type == IS_HTTP && dp->mod_http) {
         LOG(LOG_S, "modify HTTP: n=%ld\n", n);
-        if (mod_http(buffer, n, dp.mod_http)) {
+        if (mod_http(buffer, n, dp->mod_http)) {
             LOG(LOG_E, "mod http error\n");
             return -1;
         }
     }
-    else if (type == IS_HTTPS && dp.tlsrec_n) {
+    return type;
+}
+
+
+// 0 - part is not for this protocol
+static int part_pos(struct part *part, 
+        int type, long hpos, ssize_t n, long *pos)
+{
+    *pos = part->pos;
+    if (part->flag == OFFSET_SNI) {
+        if (type != IS_HTTPS) 
+            return 0;
+        else 
+            *pos += hpos;
+    }
+    else if (part->flag == OFFSET_HOST) {
+        if (type != IS_HTTP) 
+            return 0;
+        else 
+            *pos += hpos;
+    }
+    else if (*pos < 0) {
+        *pos += n;
+    }
+    return 1;
+}
+
+
+ssize_t desync(struct poolhd *pool, int sfd, char *buffer, size_t bfsize, 
+        ssize_t n, ssize_t offset, struct sockaddr *dst, int dp_c, struct desync_wait *w)
+{
+    struct desync_params dp = params.dp[dp_c];
+    
+    char *host = 0;
+    int fa = get_family(dst);
+    
+    int type = parse_req(buffer, n, &host, &dp);
+    if (type < 0) {
+        return -1;
+    }
+    if (type == IS_HTTPS && dp.tlsrec_n) {
         long lp = 0;
         for (int i = 0; i < dp.tlsrec_n; i++) {
             struct part part = dp.tlsrec[i];
@@ -429,11 +543,18 @@ ssize_t desync(int sfd, char *buffer, size_t bfsize,
         }
     }
     // set custom TTL
-    if (params.custom_ttl) {
+    if (params.custom_ttl && !offset) {
         if (setttl(sfd, params.def_ttl, fa) < 0) {
             return -1;
         }
     }
+    // previous part is not sent yet
+    if (w->pending) {
+        int s = part_finish(sfd, buffer, fa, &dp, w);
+        if (s) {
+            return s < 0 ? -1 : offset;
+        }
+    }
     // desync
     long lp = offset;
     
@@ -441,21 +562,9 @@ ssize_t desync(int sfd, char *buffer, size_t bfsize,
         struct part part = dp.parts[i];
         
         // change pos
-        long pos = part.pos;
-        if (part.flag == OFFSET_SNI) {
-            if (type != IS_HTTPS) 
-                continue;
-            else 
-                pos += (host - buffer);
-        }
-        else if (part.flag == OFFSET_HOST) {
-            if (type != IS_HTTP) 
-                continue;
-            else 
-                pos += (host - buffer);
-        }
-        else if (pos < 0) {
-            pos += n;
+        long pos;
+        if (!part_pos(&part, type, host ? host - buffer : 0, n, &pos)) {
+            continue;
         }
         // after EAGAIN
         if (pos <= offset) {
@@ -467,11 +576,20 @@ ssize_t desync(int sfd, char *buffer, size_t bfsize,
         }
         // send part
         ssize_t s = 0;
-        switch (part.m) {
+        int m = part.m;
+        
+        #ifdef RAW_SUPPORT
+        if (__atomic_load_n(&params.raw_inject, __ATOMIC_RELAXED)
+                && (m == DESYNC_FAKE || m == DESYNC_DISORDER)
+                && !raw_inject(sfd, buffer, lp, pos, n, m, type, dst, &dp, w)) {
+            m = DESYNC_SPLIT;
+        }
+        #endif
+        switch (m) {
             #ifdef FAKE_SUPPORT
             case DESYNC_FAKE:
-                s = send_fake(sfd, 
-                    buffer + lp, type, pos - lp, fa, &dp);
+                s = send_fake(pool, sfd, 
+                    lp, type, pos - lp, fa, &dp, w);
                 break;
             #endif
             case DESYNC_DISORDER:
@@ -482,13 +600,11 @@ ssize_t desync(int sfd, char *buffer, size_t bfsize,
             case DESYNC_OOB:
                 s = send_oob(sfd, 
                     buffer + lp, n - lp, pos - lp);
-                wait_send_if_support(sfd);
                 break;
                 
             case DESYNC_SPLIT:
             case DESYNC_NONE:
                 s = send(sfd, buffer + lp, pos - lp, 0);
-                wait_send_if_support(sfd);
                 break;
                 
             default:
@@ -501,13 +617,35 @@ ssize_t desync(int sfd, char *buffer, size_t bfsize,
                 return lp;
             }
             return -1;
-        } 
-        else if (s != (pos - lp)) {
+        }
+        // next part goes only after this one has left socket
+        w->pending = 1;
+        w->m = m;
+        w->lp = lp;
+        w->oob = 0;
+        w->waited = 0;
+        w->expired = 0;
+        w->slept = 0;
+        
+        int st = part_finish(sfd, buffer, fa, &dp, w);
+        if (st < 0) {
+            return -1;
+        }
+        if (s != (pos - lp)) {
             LOG(LOG_E, "%ld != %ld\n", s, pos - lp);
             return lp + s;
         }
         lp = pos;
+        if (st) {
+            return lp;
+        }
+    }
+    #ifdef __linux__
+    // don't cut rest and tunnel data into small segments
+    if (w->lowat && set_lowat(sfd, w, 0) < 0) {
+        return -1;
     }
+    #endif
     // send all/rest
     if (lp < n) {
         LOG((lp ? LOG_S : LOG_L), "send: pos=%ld-%ld\n", lp, n);
@@ -523,6 +661,90 @@ ssize_t desync(int sfd, char *buffer, size_t bfsize,
 }
 
 
+#ifdef RAW_SUPPORT
+// request is in one captured segment, parts are sent as its copies,
+// 0 - original must be dropped, 1 - passed as is
+int desync_pkt(struct inject_pkt *pkt, char *buffer, ssize_t n, int dp_c)
+{
+    struct desync_params *dp = &params.dp[dp_c];
+    
+    char *host = 0;
+    int type = parse_req(buffer, n, &host, dp);
+    if (type < 0) {
+        return -1;
+    }
+    int changed = (type == IS_HTTP && dp->mod_http);
+    
+    // stream length is fixed by kernel
+    if (type == IS_HTTPS && dp->tlsrec_n) {
+        LOG(LOG_S, "tlsrec skipped: n=%ld\n", n);
+    }
+    // disordered parts go after the rest
+    long later[dp->parts_n * 2 + 1];
+    int later_n = 0;
+    long lp = 0;
+    
+    for (int i = 0; i < dp->parts_n; i++) {
+        struct part part = dp->parts[i];
+        
+        long pos;
+        if (!part_pos(&part, type, host ? host - buffer : 0, n, &pos)) {
+            continue;
+        }
+        if (pos <= 0 || pos >= n || pos <= lp) {
+            LOG(LOG_E, "split cancel: pos=%ld-%ld, n=%ld\n", lp, pos, n);
+            break;
+        }
+        int s = 0;
+        
+        switch (part.m) {
+            #ifdef FAKE_SUPPORT
+            case DESYNC_FAKE:;
+                struct packet fake;
+                if (dp->fake_data.data) {
+                    fake = dp->fake_data;
+                }
+                else {
+                    fake = type != IS_HTTP ? dp->fake_tls : fake_http;
+                }
+                s = inject_clone(pkt, lp, fake.data, fake.size, 
+                        pos - lp, dp->ttl ? dp->ttl : 8)
+                    || inject_clone(pkt, lp, buffer + lp, pos - lp, pos - lp, 0);
+                break;
+            #endif
+            case DESYNC_DISORDER:
+                later[later_n++] = lp;
+                later[later_n++] = pos;
+                break;
+            
+            // OOB byte can't be added to stream
+            default:
+                s = inject_clone(pkt, lp, buffer + lp, pos - lp, pos - lp, 0);
+        }
+        LOG(LOG_S, "split: pos=%ld-%ld, m: %s\n", lp, pos, demode_str[part.m]);
+        if (s) {
+            return -1;
+        }
+        lp = pos;
+        changed = 1;
+    }
+    if (!changed) {
+        return 1;
+    }
+    if (inject_clone(pkt, lp, buffer + lp, n - lp, n - lp, 0)) {
+        return -1;
+    }
+    for (int i = 0; i < later_n; i += 2) {
+        long l = later[i], r = later[i + 1];
+        if (inject_clone(pkt, l, buffer + l, r - l, r - l, 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+
 ssize_t desync_udp(int sfd, char *buffer, size_t bfsize,
         ssize_t n, struct sockaddr *dst, int dp_c)
 {
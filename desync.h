@@ -1,12 +1,15 @@
-ssize_t desync(int sfd, char *buffer, size_t bfsize, ssize_t n, ssize_t offset, struct sockaddr *dst, int dp_c);
+#include "conev.h"
+
+ssize_t desync(struct poolhd *pool, int sfd, char *buffer, size_t bfsize, 
+    ssize_t n, ssize_t offset, struct sockaddr *dst, int dp_c, struct desync_wait *w);
+
+#ifdef __linux__
+struct inject_pkt;
+
+int desync_pkt(struct inject_pkt *pkt, char *buffer, ssize_t n, int dp_c);
+#endif
 
 ssize_t desync_udp(int sfd, char *buffer, size_t bfsize, ssize_t n, struct sockaddr *dst, int dp_c);
 
-struct tcpi {
-    uint8_t state;
-    uint8_t r[3];
-    uint32_t rr[5];
-    uint32_t unacked;
-    uint32_t rrr[29];
-    uint32_t notsent_bytes;
-};
\ No newline at end of file
+// max time to wait for POLLOUT after desync step, ms
+#define WAIT_SEND_MAX 500
\ No newline at end of file
@@ -0,0 +1,850 @@
+#define _GNU_SOURCE
+#ifdef _WIN32
+    #define _CRT_RAND_S
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+
+    #define close(fd) closesocket(fd)
+#else
+    #include <errno.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <arpa/inet.h>
+#endif
+#ifdef __linux__
+    #include <sys/syscall.h>
+#endif
+
+#include "proxy.h"
+#include "params.h"
+#include "extend.h"
+#include "dns.h"
+#include "error.h"
+
+#ifdef WORKERS_SUPPORT
+    #include <pthread.h>
+
+    static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    #define cache_lock() pthread_mutex_lock(&cache_mutex)
+    #define cache_unlock() pthread_mutex_unlock(&cache_mutex)
+#else
+    #define cache_lock()
+    #define cache_unlock()
+#endif
+
+#define QT_A 1
+#define QT_AAAA 28
+#define QT_SOA 6
+
+#define HDR_SIZE 12
+
+struct dns_entry {
+    uint32_t hash;
+    uint32_t expire;
+    uint16_t qtype;
+    uint8_t len;
+    uint8_t count;
+    union {
+        struct in_addr i4[DNS_ADDRS];
+        struct in6_addr i6[DNS_ADDRS];
+    };
+    char name[253];
+};
+
+// shared by workers, collisions replace older entry
+static struct dns_entry *cache = 0;
+
+// family of last successful connection, see dns_order
+static struct {
+    uint32_t key;
+    int family;
+} prefer[DNS_CACHE];
+
+
+static inline int qbit(int qtype)
+{
+    return qtype == QT_A ? 1 : 2;
+}
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static uint32_t name_hash(const char *name, int len, int qtype)
+{
+    uint32_t h = 2166136261u ^ qtype;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t )name[i]) * 16777619;
+    }
+    return h;
+}
+
+
+// count of addresses, 0 - no such name or record, -1 - not cached
+static int cache_get(const char *name, int len, int qtype,
+        time_t now, struct sockaddr_ina *addrs)
+{
+    uint32_t h = name_hash(name, len, qtype);
+    struct dns_entry *e = &cache[h % DNS_CACHE];
+    int r = -1;
+    
+    cache_lock();
+    if (e->hash == h && e->qtype == qtype && e->len == len
+            && e->expire > now && !memcmp(e->name, name, len)) {
+        r = e->count;
+        for (int i = 0; i < r; i++) {
+            if (qtype == QT_A) {
+                addrs[i].in.sin_family = AF_INET;
+                addrs[i].in.sin_addr = e->i4[i];
+            }
+            else {
+                addrs[i].in6.sin6_family = AF_INET6;
+                addrs[i].in6.sin6_addr = e->i6[i];
+            }
+        }
+    }
+    cache_unlock();
+    return r;
+}
+
+
+static void cache_set(const char *name, int len, int qtype,
+        time_t now, uint32_t ttl, const uint8_t **ips, int count)
+{
+    uint32_t h = name_hash(name, len, qtype);
+    struct dns_entry *e = &cache[h % DNS_CACHE];
+    
+    if (ttl < 1) {
+        ttl = 1;
+    }
+    else if (ttl > DNS_MAX_TTL) {
+        ttl = DNS_MAX_TTL;
+    }
+    cache_lock();
+    e->hash = h;
+    e->expire = now + ttl;
+    e->qtype = qtype;
+    e->len = len;
+    e->count = count;
+    for (int i = 0; i < count; i++) {
+        if (qtype == QT_A)
+            memcpy(&e->i4[i], ips[i], 4);
+        else
+            memcpy(&e->i6[i], ips[i], 16);
+    }
+    memcpy(e->name, name, len);
+    cache_unlock();
+}
+
+
+// count of cached addresses, types without answer are set in missing
+static int lookup(const char *name, int len, time_t now,
+        struct sockaddr_ina *addrs, char *missing)
+{
+    int n = 0;
+    
+    int a = cache_get(name, len, QT_A, now, addrs);
+    if (a > 0) {
+        n += a;
+    }
+    int a6 = params.ipv6 ?
+        cache_get(name, len, QT_AAAA, now, addrs + n) : 0;
+    if (a6 > 0) {
+        n += a6;
+    }
+    *missing = (a < 0 ? qbit(QT_A) : 0) | (a6 < 0 ? qbit(QT_AAAA) : 0);
+    return n;
+}
+
+
+uint32_t dns_key(const char *host, int len)
+{
+    uint32_t h = 2166136261u;
+    
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t )tolower((uint8_t )host[i])) * 16777619;
+    }
+    return h ? h : 1;
+}
+
+
+void dns_prefer(uint32_t key, int family)
+{
+    if (!key) {
+        return;
+    }
+    cache_lock();
+    prefer[key % DNS_CACHE].key = key;
+    prefer[key % DNS_CACHE].family = family;
+    cache_unlock();
+}
+
+
+void dns_order(struct sockaddr_ina *addrs, int n, uint32_t key)
+{
+    // RFC 8305: IPv6 first, unless other family has won before
+    int first = AF_INET6;
+    
+    cache_lock();
+    if (key && prefer[key % DNS_CACHE].key == key) {
+        first = prefer[key % DNS_CACHE].family;
+    }
+    cache_unlock();
+    
+    struct sockaddr_ina tmp[DST_MAX];
+    int f = 0, s = 0;
+    
+    // families alternate, order inside family is kept
+    for (int i = 0; i < n; i++) {
+        while (f < n && addrs[f].sa.sa_family != first) f++;
+        while (s < n && addrs[s].sa.sa_family == first) s++;
+        
+        if (f < n && (!(i & 1) || s >= n)) {
+            tmp[i] = addrs[f++];
+        }
+        else {
+            tmp[i] = addrs[s++];
+        }
+    }
+    memcpy(addrs, tmp, sizeof(*addrs) * n);
+}
+
+
+static int encode_name(char *buf, const char *name, int len)
+{
+    char *p = buf;
+    
+    for (int s = 0, i = 0; i <= len; i++) {
+        if (i < len && name[i] != '.') {
+            continue;
+        }
+        *p++ = i - s;
+        memcpy(p, name + s, i - s);
+        p += i - s;
+        s = i + 1;
+    }
+    *p++ = 0;
+    return p - buf;
+}
+
+
+static int send_queries(struct resolver *res,
+        struct dns_query *q, char missing)
+{
+    struct sockaddr_ina *srv = &res->servers[q->tries % params.dns_count];
+    socklen_t sl = srv->sa.sa_family == AF_INET6 ?
+        sizeof(srv->in6) : sizeof(srv->in);
+    char buf[HDR_SIZE + 255 + 4] = { 0 };
+    
+    buf[0] = q->id >> 8;
+    buf[1] = q->id & 0xff;
+    buf[2] = 0x01; // recursion desired
+    buf[5] = 1;
+    
+    int n = HDR_SIZE + encode_name(buf + HDR_SIZE, q->name, q->len);
+    
+    const int qtypes[] = { QT_A, QT_AAAA };
+    
+    for (int i = 0; i < 2; i++) {
+        int qtype = qtypes[i];
+        if (!(missing & qbit(qtype))) {
+            continue;
+        }
+        buf[n] = 0;
+        buf[n + 1] = qtype;
+        buf[n + 2] = 0;
+        buf[n + 3] = 1;
+        
+        if (sendto(q->ev->fd, buf, n + 4, 0, &srv->sa, sl) < 0) {
+            uniperror("sendto dns");
+            return -1;
+        }
+        q->sent |= qbit(qtype);
+    }
+    return 0;
+}
+
+
+static int get_random(void *buf, size_t n)
+{
+    #if defined(__linux__)
+    return syscall(__NR_getrandom, buf, n, 0) == (long )n ? 0 : -1;
+    #elif defined(_WIN32)
+    for (size_t i = 0; i < n; i += sizeof(unsigned int)) {
+        unsigned int r;
+        if (rand_s(&r)) {
+            return -1;
+        }
+        memcpy((char *)buf + i, &r, 
+            n - i < sizeof(r) ? n - i : sizeof(r));
+    }
+    return 0;
+    #else
+    arc4random_buf(buf, n);
+    return 0;
+    #endif
+}
+
+
+// off-path spoofer has to guess all 16 bits and source port
+static int query_id(struct resolver *res)
+{
+    while (1) {
+        if (res->rnd_n < 2) {
+            if (get_random(res->rnd, sizeof(res->rnd))) {
+                uniperror("getrandom");
+                return -1;
+            }
+            res->rnd_n = sizeof(res->rnd);
+        }
+        res->rnd_n -= 2;
+        int id = get16(res->rnd + res->rnd_n);
+        
+        struct dns_query *q = &res->q[res->slot[id]];
+        if (!q->len || q->id != id) {
+            return id;
+        }
+    }
+}
+
+
+static inline char query_busy(struct dns_query *q, uint64_t now)
+{
+    return q->len && (q->val || q->expire > now);
+}
+
+
+static struct dns_query *query_get(struct resolver *res, uint64_t now)
+{
+    for (int i = 0; i < DNS_SLOTS; i++) {
+        struct dns_query *q = &res->q[i];
+        if (query_busy(q, now)) {
+            continue;
+        }
+        int id = query_id(res);
+        if (id < 0) {
+            return 0;
+        }
+        memset(q, 0, sizeof(*q));
+        q->id = id;
+        q->ev = res->ev;
+        res->slot[id] = i;
+        return q;
+    }
+    return 0;
+}
+
+
+static int dns_fd(int family)
+{
+    int fd = nb_socket(family, SOCK_DGRAM);
+    if (fd < 0) {
+        return -1;
+    }
+    if (family == AF_INET6) {
+        int no = 0;
+        if (setsockopt(fd, IPPROTO_IPV6,
+                IPV6_V6ONLY, (char *)&no, sizeof(no))) {
+            uniperror("setsockopt IPV6_V6ONLY");
+        }
+    }
+    return fd;
+}
+
+
+static struct eval *dns_add(struct poolhd *pool, int fd)
+{
+    struct eval *ev = add_event(pool, EV_DNS, fd, POLLIN);
+    if (!ev) {
+        uniperror("add event");
+        close(fd);
+    }
+    return ev;
+}
+
+
+static void dns_swap(struct resolver *res, struct eval *ev)
+{
+    res->old = res->ev;
+    res->ev = ev;
+    res->sent = 0;
+}
+
+
+// new socket gets other random port on first sendto,
+// old one is kept while answers for its queries can come
+static void dns_rotate(struct poolhd *pool, struct resolver *res)
+{
+    if (res->sent < DNS_ROTATE || res->queued) {
+        return;
+    }
+    if (res->old) {
+        for (int i = 0; i < DNS_SLOTS; i++) {
+            struct dns_query *q = &res->q[i];
+            if (q->ev == res->old && query_busy(q, pool->tw.now)) {
+                return;
+            }
+        }
+        for (int i = 0; i < DNS_SLOTS; i++) {
+            if (res->q[i].ev == res->old) res->q[i].len = 0;
+        }
+        del_event(pool, res->old);
+        res->old = 0;
+    }
+    int fd = dns_fd(res->family);
+    if (fd < 0) {
+        return;
+    }
+    #ifdef __linux__
+    // current socket is used until peer answers, see dns_protected
+    if (params.protect_path) {
+        struct sockaddr_ina none = { 0 };
+        if (protect_queue(pool, res->ev, fd, &none, EV_DNS)) {
+            close(fd);
+            return;
+        }
+        res->queued = 1;
+        return;
+    }
+    #endif
+    struct eval *ev = dns_add(pool, fd);
+    if (!ev) {
+        return;
+    }
+    dns_swap(res, ev);
+}
+
+
+#ifdef __linux__
+void dns_protected(struct poolhd *pool, int fd, int ok)
+{
+    struct resolver *res = pool->dns;
+    struct eval *ev = 0;
+    
+    res->queued = 0;
+    res->ev->cold->prot = 0;
+    if (!ok) {
+        close(fd);
+        return;
+    }
+    if ((ev = dns_add(pool, fd))) {
+        dns_swap(res, ev);
+    }
+}
+#endif
+
+
+static int finish(struct poolhd *pool,
+        struct dns_query *q, struct sockaddr_ina *addrs, int n)
+{
+    struct eval *val = q->val;
+    int type = q->type;
+    
+    if (n > 0) {
+        dns_order(addrs, n, val->cold->host);
+    }
+    else {
+        LOG(LOG_E, "not resolved: %.*s\n", q->len, q->name);
+    }
+    for (int i = 0; i < n; i++) {
+        addrs[i].in.sin_port = q->port;
+    }
+    q->val = 0;
+    q->len = 0;
+    val->cold->dns = 0;
+    
+    return on_resolved(pool, val, addrs, n, type);
+}
+
+
+int dns_resolve(struct poolhd *pool, struct eval *val,
+        char *host, int len, struct sockaddr_ina *addrs, int type)
+{
+    struct resolver *res = pool->dns;
+    char name[256];
+    
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    if (len < 1 || len > 253) {
+        return -1;
+    }
+    for (int i = 0; i < len; i++) {
+        name[i] = tolower((uint8_t )host[i]);
+    }
+    name[len] = 0;
+    
+    // port is already set and stays
+    if (inet_pton(AF_INET, name, &addrs->in.sin_addr) == 1) {
+        addrs->sa.sa_family = AF_INET;
+        return 1;
+    }
+    if (inet_pton(AF_INET6, name, &addrs->in6.sin6_addr) == 1) {
+        addrs->sa.sa_family = AF_INET6;
+        return 1;
+    }
+    if (!strcmp(name, "localhost")) {
+        addrs->sa.sa_family = AF_INET;
+        addrs->in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return 1;
+    }
+    for (int s = 0, i = 0; i <= len; i++) {
+        if (i < len && name[i] != '.') {
+            continue;
+        }
+        if (i == s || i - s > 63) {
+            return -1;
+        }
+        s = i + 1;
+    }
+    time_t now = pool->tw.now / 1000;
+    char missing = 0;
+    uint16_t port = addrs->in.sin_port;
+    
+    int n = lookup(name, len, now, addrs, &missing);
+    if (!missing) {
+        if (!n) {
+            return -1;
+        }
+        dns_order(addrs, n, dns_key(name, len));
+        for (int i = 0; i < n; i++) {
+            addrs[i].in.sin_port = port;
+        }
+        return n;
+    }
+    dns_rotate(pool, res);
+    
+    struct dns_query *q = query_get(res, pool->tw.now);
+    if (!q) {
+        LOG(LOG_E, "dns: too many queries\n");
+        return -1;
+    }
+    q->type = type;
+    q->port = port;
+    q->len = len;
+    memcpy(q->name, name, len);
+    
+    if (send_queries(res, q, missing)) {
+        q->len = 0;
+        return -1;
+    }
+    res->sent++;
+    LOG(LOG_S, "dns query: %s, id=%d\n", name, q->id);
+    
+    // without request answer is only cached
+    if (!val) {
+        q->expire = pool->tw.now + DNS_RETRY * DNS_TRIES;
+        return 0;
+    }
+    if (mod_etype(pool, val, 0)) {
+        uniperror("mod_etype");
+        q->len = 0;
+        return -1;
+    }
+    q->val = val;
+    val->cold->dns = q - res->q + 1;
+    // other family is cached, wait for missing a bit
+    set_timer(pool, val, n ? DNS_RES_DELAY : DNS_RETRY);
+    return 0;
+}
+
+
+int dns_retry(struct poolhd *pool, struct eval *val)
+{
+    struct resolver *res = pool->dns;
+    struct dns_query *q = &res->q[val->cold->dns - 1];
+    struct sockaddr_ina addrs[DST_MAX] = { 0 };
+    char missing = 0;
+    
+    // same name could be cached by other query,
+    // on resolution delay expiration go without missing family
+    int n = lookup(q->name, q->len, pool->tw.now / 1000, addrs, &missing);
+    if (!missing || n) {
+        return finish(pool, q, addrs, n);
+    }
+    if (++q->tries >= DNS_TRIES) {
+        return finish(pool, q, addrs, 0);
+    }
+    LOG(LOG_S, "dns retry: %.*s\n", q->len, q->name);
+    
+    if (send_queries(res, q, missing)) {
+        return finish(pool, q, addrs, 0);
+    }
+    set_timer(pool, val, DNS_RETRY);
+    return 0;
+}
+
+
+static int skip_name(const uint8_t *buf, int n, int o)
+{
+    while (o < n) {
+        uint8_t l = buf[o];
+        if ((l & 0xc0) == 0xc0) {
+            return o + 2 <= n ? o + 2 : -1;
+        }
+        if (l & 0xc0) {
+            return -1;
+        }
+        o += l + 1;
+        if (!l) {
+            return o;
+        }
+    }
+    return -1;
+}
+
+
+static void on_answer(struct poolhd *pool, struct resolver *res,
+        struct eval *ev, const uint8_t *buf, int n)
+{
+    if (n < HDR_SIZE) {
+        return;
+    }
+    uint16_t id = get16(buf);
+    struct dns_query *q = &res->q[res->slot[id]];
+    
+    if (!q->len || q->id != id || q->ev != ev
+            || !(buf[2] & 0x80) || get16(buf + 4) != 1) {
+        return;
+    }
+    char qname[255];
+    int ql = encode_name(qname, q->name, q->len);
+    
+    int o = HDR_SIZE + ql;
+    if (n < o + 4) {
+        return;
+    }
+    for (int i = 0; i < ql; i++) {
+        if (tolower(buf[HDR_SIZE + i]) != qname[i]) return;
+    }
+    int qtype = get16(buf + o);
+    if ((qtype != QT_A && qtype != QT_AAAA) || get16(buf + o + 2) != 1
+            || !(q->sent & qbit(qtype))) {
+        return;
+    }
+    o += 4;
+    
+    int rcode = buf[3] & 0x0f;
+    int an = get16(buf + 6), ns = get16(buf + 8);
+    
+    // server failure or truncated, try next server
+    if ((rcode != 0 && rcode != 3) || ((buf[2] & 0x02) && !an)) {
+        LOG(LOG_E, "dns: rcode=%d, tc=%d: %.*s\n",
+            rcode, (buf[2] & 0x02) != 0, q->len, q->name);
+        struct eval *val = q->val;
+        if (!val) {
+            q->len = 0;
+        }
+        else if (dns_retry(pool, val)) {
+            close_conn(pool, val);
+        }
+        return;
+    }
+    const uint8_t *ips[DNS_ADDRS];
+    int count = 0;
+    uint32_t ttl = DNS_MAX_TTL, nttl = DNS_NEG_TTL;
+    
+    for (int i = 0; i < an + ns; i++) {
+        if ((o = skip_name(buf, n, o)) < 0 || o + 10 > n) {
+            return;
+        }
+        int type = get16(buf + o);
+        uint32_t rttl = get32(buf + o + 4);
+        int rdlen = get16(buf + o + 8);
+        o += 10;
+        if (o + rdlen > n) {
+            return;
+        }
+        if (i < an) {
+            if (rttl < ttl) {
+                ttl = rttl;
+            }
+            if (count < DNS_ADDRS && type == qtype
+                    && rdlen == (qtype == QT_A ? 4 : 16)) {
+                ips[count++] = buf + o;
+            }
+        }
+        else if (type == QT_SOA && rdlen >= 20) {
+            // negative answer lives min(TTL, SOA MINIMUM)
+            uint32_t min = get32(buf + o + rdlen - 4);
+            nttl = rttl < min ? rttl : min;
+        }
+        o += rdlen;
+    }
+    time_t now = pool->tw.now / 1000;
+    cache_set(q->name, q->len, qtype, now, count ? ttl : nttl, ips, count);
+    
+    q->sent &= ~qbit(qtype);
+    
+    struct eval *val = q->val;
+    if (!val) {
+        if (!q->sent) q->len = 0;
+        return;
+    }
+    struct sockaddr_ina addrs[DST_MAX] = { 0 };
+    char missing = 0;
+    
+    int na = lookup(q->name, q->len, now, addrs, &missing);
+    if (missing) {
+        // RFC 8305 resolution delay, other family is not waited long
+        if (na) {
+            set_timer(pool, val, DNS_RES_DELAY);
+        }
+        return;
+    }
+    if (finish(pool, q, addrs, na)) {
+        close_conn(pool, val);
+    }
+}
+
+
+static char from_server(struct resolver *res, struct sockaddr_ina *addr)
+{
+    for (int i = 0; i < params.dns_count; i++) {
+        struct sockaddr_ina *s = &res->servers[i];
+        
+        if (s->sa.sa_family != addr->sa.sa_family) {
+            continue;
+        }
+        if (s->sa.sa_family == AF_INET) {
+            if (s->in.sin_port == addr->in.sin_port
+                    && s->in.sin_addr.s_addr == addr->in.sin_addr.s_addr)
+                return 1;
+        }
+        else if (s->in6.sin6_port == addr->in6.sin6_port
+                && !memcmp(&s->in6.sin6_addr,
+                    &addr->in6.sin6_addr, sizeof(s->in6.sin6_addr))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void on_dns(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize)
+{
+    struct sockaddr_ina addr;
+    
+    while (1) {
+        socklen_t sl = sizeof(addr);
+        
+        ssize_t n = recvfrom(val->fd, buffer, bfsize, 0, &addr.sa, &sl);
+        if (n < 0) {
+            if (get_e() == EAGAIN) {
+                val->ready &= ~POLLIN;
+                break;
+            }
+            uniperror("recv dns");
+            break;
+        }
+        if (from_server(pool->dns, &addr)) {
+            on_answer(pool, pool->dns, val, (uint8_t *)buffer, n);
+        }
+        // closed by rotation while answer was handled
+        if (val != pool->dns->ev && val != pool->dns->old) {
+            break;
+        }
+    }
+}
+
+
+void dns_cancel(struct poolhd *pool, struct eval *val)
+{
+    struct dns_query *q = &pool->dns->q[val->cold->dns - 1];
+    
+    q->val = 0;
+    q->len = 0;
+    val->cold->dns = 0;
+}
+
+
+int dns_open(struct poolhd *pool)
+{
+    struct resolver *res = calloc(1, sizeof(*res));
+    if (!res) {
+        uniperror("calloc");
+        return -1;
+    }
+    res->servers = calloc(params.dns_count, sizeof(*res->servers));
+    if (!res->servers) {
+        uniperror("calloc");
+        free(res);
+        return -1;
+    }
+    int family = AF_INET;
+    for (int i = 0; i < params.dns_count; i++) {
+        if (params.dns[i].sin6_family == AF_INET6)
+            family = AF_INET6;
+    }
+    for (int i = 0; i < params.dns_count; i++) {
+        res->servers[i].in6 = params.dns[i];
+        map_fix(&res->servers[i], family == AF_INET6);
+    }
+    res->family = family;
+    
+    // worker loop isn't started yet, so peer is waited here
+    int fd = dns_fd(family);
+    if (fd >= 0 && params.protect_path
+            && protect(fd, params.protect_path) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0 || !(res->ev = dns_add(pool, fd))) {
+        free(res->servers);
+        free(res);
+        return -1;
+    }
+    pool->dns = res;
+    return 0;
+}
+
+
+void dns_free(struct poolhd *pool)
+{
+    struct resolver *res = pool->dns;
+    if (!res) {
+        return;
+    }
+    free(res->servers);
+    free(res);
+    pool->dns = 0;
+}
+
+
+int dns_init(void)
+{
+    cache = calloc(DNS_CACHE, sizeof(*cache));
+    if (!cache) {
+        uniperror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+
+void dns_close(void)
+{
+    free(cache);
+    cache = 0;
+}
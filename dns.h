@@ -0,0 +1,85 @@
+#include <stdint.h>
+
+#include "conev.h"
+
+struct sockaddr_ina;
+
+// queries in flight per worker, found by random id, see query_id
+#define DNS_SLOTS 256
+
+// source port changes after so many queries
+#define DNS_ROTATE 64
+
+#define DNS_CACHE 1024
+
+// addresses kept per name and type
+#define DNS_ADDRS 4
+
+// resend to next server after, ms
+#define DNS_RETRY 1000
+#define DNS_TRIES 3
+
+// wait for other family after first answer, ms
+#define DNS_RES_DELAY 50
+
+// seconds, for answers without SOA
+#define DNS_NEG_TTL 30
+#define DNS_MAX_TTL 86400
+
+struct dns_query {
+    struct eval *val;
+    // socket query is sent from, answer must come to it
+    struct eval *ev;
+    uint64_t expire;
+    uint16_t id;
+    uint16_t port;
+    char type;
+    char sent;
+    char tries;
+    uint8_t len;
+    char name[255];
+};
+
+struct resolver {
+    struct eval *ev;
+    // previous socket, closed when its queries are done
+    struct eval *old;
+    int family;
+    int sent;
+    // next socket waits for protect, see dns_protected
+    char queued;
+    struct sockaddr_ina *servers;
+    uint8_t rnd[64];
+    int rnd_n;
+    struct dns_query q[DNS_SLOTS];
+    // query id -> slot, checked against id of query
+    uint8_t slot[65536];
+};
+
+int dns_init(void);
+
+int dns_open(struct poolhd *pool);
+
+int dns_resolve(struct poolhd *pool, struct eval *val,
+        char *host, int len, struct sockaddr_ina *addrs, int type);
+
+uint32_t dns_key(const char *host, int len);
+
+void dns_order(struct sockaddr_ina *addrs, int n, uint32_t key);
+
+void dns_prefer(uint32_t key, int family);
+
+void on_dns(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize);
+
+int dns_retry(struct poolhd *pool, struct eval *val);
+
+void dns_cancel(struct poolhd *pool, struct eval *val);
+
+#ifdef __linux__
+void dns_protected(struct poolhd *pool, int fd, int ok);
+#endif
+
+void dns_free(struct poolhd *pool);
+
+void dns_close(void);
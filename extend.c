@@ -1,9 +1,5 @@
 #ifdef _WIN32
     #include <ws2tcpip.h>
-    
-    #ifndef TCP_MAXRT
-    #define TCP_MAXRT 5
-    #endif
 #else
     #include <arpa/inet.h>
     #include <netinet/tcp.h>
@@ -12,81 +8,147 @@
 #endif
 
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 
 #include "proxy.h"
+#include "extend.h"
 #include "error.h"
 #include "params.h"
 
 #include "desync.h"
 #include "packets.h"
 
+#ifdef WORKERS_SUPPORT
+    #include <pthread.h>
+    
+    static pthread_rwlock_t mempool_lock = PTHREAD_RWLOCK_INITIALIZER;
+    
+    #define cache_rdlock() pthread_rwlock_rdlock(&mempool_lock)
+    #define cache_wrlock() pthread_rwlock_wrlock(&mempool_lock)
+    #define cache_unlock() pthread_rwlock_unlock(&mempool_lock)
+    
+    static pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+    
+    #define stat_lock() pthread_mutex_lock(&stat_mutex)
+    #define stat_unlock() pthread_mutex_unlock(&stat_mutex)
+#else
+    #define cache_rdlock()
+    #define cache_wrlock()
+    #define cache_unlock()
+    
+    #define stat_lock()
+    #define stat_unlock()
+#endif
 
-int set_timeout(int fd, unsigned int s)
-{
-    #ifdef __linux__
-    if (setsockopt(fd, IPPROTO_TCP,
-            TCP_USER_TIMEOUT, (char *)&s, sizeof(s))) {
-        uniperror("setsockopt TCP_USER_TIMEOUT");
-        return -1;
-    }
-    #else
-    #ifdef _WIN32
-    if (setsockopt(fd, IPPROTO_TCP,
-            TCP_MAXRT, (char *)&s, sizeof(s))) {
-        uniperror("setsockopt TCP_MAXRT");
-        return -1;
-    }
-    #endif
-    #endif
-    return 0;
-}
+// outcomes of group are halved, so old ones fade out
+#define STAT_MAX 256
 
+// longest domain name
+#define HOST_MAX 255
 
-int mode_add_get(struct sockaddr_ina *dst, int m)
+
+static int cache_add_get(struct poolhd *pool, 
+        struct mphdr *mp, char *str, int len, int m)
 {
     // m < 0: get, m > 0: set, m == 0: delete
     assert(m >= -1 && m < params.dp_count);
     
-    time_t t = 0;
+    // monotonic seconds, same clock in all workers
+    time_t now = pool->tw.now / 1000, t = 0;
     struct elem *val = 0;
-    char *str = (char *)&dst->in;
-    int len = 0;
-    
-    if (dst->sa.sa_family == AF_INET) {
-        len = sizeof(dst->in);
-    }
-    else {
-        len = sizeof(dst->in6) - sizeof(dst->in6.sin6_scope_id);
-    }
-    len -= sizeof(dst->sa.sa_family);
-    assert(len > 0);
     
     if (m == 0) {
-        mem_delete(params.mempool, str, len);
+        cache_wrlock();
+        mem_delete(mp, str, len);
+        cache_unlock();
         return 0;
     }
     else if (m > 0) {
-        time(&t);
-        val = mem_add(params.mempool, str, len);
+        t = now;
+        cache_wrlock();
+        val = mem_add(mp, str, len);
         if (!val) {
+            cache_unlock();
             uniperror("mem_add");
             return -1;
         }
         val->m = m;
         val->time = t;
+        cache_unlock();
         return 0;
     }
-    val = mem_get(params.mempool, str, len);
+    cache_rdlock();
+    val = mem_get(mp, str, len);
     if (!val) {
+        cache_unlock();
         return -1;
     }
-    time(&t);
-    if (t > val->time + params.cache_ttl) {
-        LOG(LOG_S, "time=%ld, now=%ld, ignore\n", val->time, t);
+    m = val->m;
+    t = val->time;
+    cache_unlock();
+    
+    if (now > t + params.cache_ttl) {
+        LOG(LOG_S, "time=%ld, now=%ld, ignore\n", t, now);
+        return 0;
+    }
+    return m;
+}
+
+
+int mode_add_get(struct poolhd *pool, struct sockaddr_ina *dst, int m)
+{
+    char *str = (char *)&dst->in;
+    int len = 0;
+    
+    if (dst->sa.sa_family == AF_INET) {
+        len = sizeof(dst->in);
+    }
+    else {
+        len = sizeof(dst->in6) - sizeof(dst->in6.sin6_scope_id);
+    }
+    len -= sizeof(dst->sa.sa_family);
+    assert(len > 0);
+    
+    return cache_add_get(pool, params.mempool, str, len, m);
+}
+
+
+// port and host in lower case without final dot, 0 - request has no host
+static int host_key(char *buffer, ssize_t n, uint16_t port, char *key)
+{
+    char *host = 0;
+    int len;
+    if (!(len = parse_tls(buffer, n, &host))) {
+        len = parse_http(buffer, n, &host, 0);
+    }
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    if (len <= 0 || len > HOST_MAX) {
         return 0;
     }
-    return val->m;
+    memcpy(key, &port, sizeof(port));
+    
+    for (int i = 0; i < len; i++) {
+        key[sizeof(port) + i] = tolower((unsigned char )host[i]);
+    }
+    return sizeof(port) + len;
+}
+
+
+// same as mode_add_get, but for host of first request, 
+// CDN domains are served by many addresses
+static int host_add_get(struct poolhd *pool, struct eval *client, int m)
+{
+    char key[sizeof(uint16_t) + HOST_MAX];
+    
+    int len = host_key(client->cold->buff.data, client->cold->buff.size,
+        client->pair->cold->in6.sin6_port, key);
+    if (!len) {
+        return m < 0 ? -1 : 0;
+    }
+    return cache_add_get(pool, params.hostpool, key, len, m);
 }
 
 
@@ -98,13 +160,16 @@ static inline bool check_port(uint16_t *p, struct sockaddr_in6 *dst)
 
 
 int connect_hook(struct poolhd *pool, struct eval *val, 
-        struct sockaddr_ina *dst, int next)
+        struct sockaddr_ina *dst, int n, int next)
 {
-    int m = mode_add_get(dst, -1);
-    val->cache = (m == 0);
-    val->attempt = m < 0 ? 0 : m;
+    int m = -1;
+    for (int i = 0; i < n && m < 0; i++) {
+        m = mode_add_get(pool, &dst[i], -1);
+    }
+    val->cold->cache = (m == 0);
+    val->cold->attempt = m < 0 ? 0 : m;
     
-    return create_conn(pool, val, dst, next);
+    return create_conn(pool, val, dst, n, next);
 }
 
 
@@ -113,26 +178,26 @@ int reconnect(struct poolhd *pool, struct eval *val, int m)
     struct eval *client = val->pair;
     
     if (create_conn(pool, client, 
-            (struct sockaddr_ina *)&val->in6, EV_DESYNC)) {
+            (struct sockaddr_ina *)&val->cold->in6, 1, EV_DESYNC)) {
         return -1;
     }
     val->pair = 0;
     del_event(pool, val);
     
     client->type = EV_IGNORE;
-    client->attempt = m;
-    client->cache = 1;
-    client->buff.offset = 0;
+    client->cold->attempt = m;
+    client->cold->cache = 1;
+    client->cold->buff.offset = 0;
     return 0;
 }
 
 
-bool check_host(struct mphdr *hosts, struct eval *val)
+bool check_host(struct mphdr *hosts, char *buffer, ssize_t n)
 {
     char *host = 0;
     int len;
-    if (!(len = parse_tls(val->buff.data, val->buff.size, &host))) {
-        len = parse_http(val->buff.data, val->buff.size, &host, 0);
+    if (!(len = parse_tls(buffer, n, &host))) {
+        len = parse_http(buffer, n, &host, 0);
     }
     assert(len == 0 || host != 0);
     if (len <= 0) {
@@ -151,94 +216,427 @@ bool check_host(struct mphdr *hosts, struct eval *val)
 }
 
 
-bool check_proto_tcp(int proto, struct eval *val)
+bool check_proto_tcp(int proto, char *buffer, ssize_t n)
 {
     if (proto & IS_TCP) {
         return 1;
     }
-    else if ((proto & IS_HTTP) && 
-            is_http(val->buff.data, val->buff.size)) {
+    else if ((proto & IS_HTTP) && is_http(buffer, n)) {
         return 1;
     }
-    else if ((proto & IS_HTTPS) && 
-            is_tls_chello(val->buff.data, val->buff.size)) {
+    else if ((proto & IS_HTTPS) && is_tls_chello(buffer, n)) {
         return 1;
     }
     return 0;
 }
 
 
-int on_torst(struct poolhd *pool, struct eval *val)
+static bool check_group(struct desync_params *dp,
+        char *buffer, ssize_t n, struct sockaddr_in6 *dst)
 {
-    int m = val->pair->attempt + 1;
-    
+    return (!dp->pf[0] || check_port(dp->pf, dst)) &&
+        (!dp->proto || check_proto_tcp(dp->proto, buffer, n)) &&
+        (!dp->hosts || check_host(dp->hosts, buffer, n));
+}
+
+
+// first group without detection, which fits request
+int desync_select(char *buffer, ssize_t n, struct sockaddr_in6 *dst)
+{
+    int m = 0;
     for (; m < params.dp_count; m++) {
         struct desync_params *dp = &params.dp[m];
-        if (!dp->detect) {
-            return -1;
+        if (!dp->detect && check_group(dp, buffer, n, dst)) {
+            break;
         }
-        if (dp->detect & DETECT_TORST) {
+    }
+    return m;
+}
+
+
+// outcome of first request sent with group m, lat - time to response, ms
+static void group_stat(int m, char ok, unsigned int lat)
+{
+    if (!params.adapt) {
+        return;
+    }
+    struct desync_params *dp = &params.dp[m];
+    
+    stat_lock();
+    if (ok) {
+        dp->ok++;
+        dp->lat = dp->lat ? (dp->lat * 7 + lat) / 8 : lat;
+    }
+    else {
+        dp->fail++;
+    }
+    if (dp->ok + dp->fail >= STAT_MAX) {
+        dp->ok /= 2;
+        dp->fail /= 2;
+    }
+    stat_unlock();
+}
+
+
+// larger share of successes, unknown group counts as half successful,
+// faster response if equal
+static bool group_better(struct desync_params *a, struct desync_params *b)
+{
+    uint64_t x = (uint64_t )(a->ok + 1) * (b->ok + b->fail + 2);
+    uint64_t y = (uint64_t )(b->ok + 1) * (a->ok + a->fail + 2);
+    if (x != y) {
+        return x > y;
+    }
+    return a->lat && (!b->lat || a->lat < b->lat);
+}
+
+
+// group m without detection and detection groups after it, which fit request
+static uint64_t auto_groups(struct eval *client, int m)
+{
+    char *buffer = client->cold->buff.data;
+    ssize_t n = client->cold->buff.size;
+    struct sockaddr_in6 *dst = &client->pair->cold->in6;
+    uint64_t g = 0;
+    
+    for (int i = m; i < params.dp_count && i < 64; i++) {
+        struct desync_params *dp = &params.dp[i];
+        if (i > m && !dp->detect) {
             break;
         }
+        if (i == m || check_group(dp, buffer, n, dst)) {
+            g |= (uint64_t )1 << i;
+        }
     }
-    if (m >= params.dp_count) {
-        mode_add_get(
-            (struct sockaddr_ina *)&val->in6, 0);
-        return -1;
+    return g;
+}
+
+
+// best of groups, which handle events of detection, ev = -1 - any
+static int auto_pick(uint64_t g, int ev)
+{
+    int best = params.dp_count;
+    
+    stat_lock();
+    for (int i = 0; g; i++, g >>= 1) {
+        struct desync_params *dp = &params.dp[i];
+        if (!(g & 1) || (dp->detect && !(dp->detect & ev))) {
+            continue;
+        }
+        if (best == params.dp_count || group_better(dp, &params.dp[best])) {
+            best = i;
+        }
     }
-    return reconnect(pool, val, m);
+    stat_unlock();
+    return best;
 }
 
 
-int on_response(struct poolhd *pool, struct eval *val, 
-        char *resp, ssize_t sn)
+// group of first request, which succeeds more often than others
+static int auto_first(struct eval *client, int m)
 {
-    int m = val->pair->attempt + 1;
+    uint64_t g = auto_groups(client, m);
     
-    char *req = val->pair->buff.data;
-    ssize_t qn = val->pair->buff.size;
+    // with one group order is as usual
+    if (!(g & (g - 1))) {
+        return m;
+    }
+    int best = auto_pick(g, -1);
+    client->cold->tried = (uint64_t )1 << best;
     
-    for (; m < params.dp_count; m++) {
+    if (best != m) {
+        LOG(LOG_S, "adapt: m=%d instead of %d\n", best, m);
+        client->cold->cache = 1;
+    }
+    return best;
+}
+
+
+// next group for events of detection
+// -1 - auto mode stops at group without detection, dp_count - none left
+static int auto_next(struct eval *client, int ev)
+{
+    struct eval_cold *c = client->cold;
+    
+    if (c->tried) {
+        int m = desync_select(c->buff.data, c->buff.size, &client->pair->cold->in6);
+        m = auto_pick(auto_groups(client, m) & ~c->tried, ev);
+        if (m < params.dp_count) {
+            c->tried |= (uint64_t )1 << m;
+        }
+        return m;
+    }
+    for (int m = c->attempt + 1; m < params.dp_count; m++) {
         struct desync_params *dp = &params.dp[m];
         if (!dp->detect) {
             return -1;
         }
-        if ((dp->detect & DETECT_HTTP_LOCAT)
-                && is_http_redirect(req, qn, resp, sn)) {
+        if (dp->detect & ev) {
+            return m;
+        }
+    }
+    return params.dp_count;
+}
+
+
+// events checked in response, of groups which may go next
+static int auto_detect(struct eval *client)
+{
+    struct eval_cold *c = client->cold;
+    int m = c->attempt, mask = 0;
+    
+    // in race and adaptive order it's any group of auto mode
+    if (c->trial || c->tried) {
+        m = desync_select(c->buff.data, c->buff.size, &client->pair->cold->in6);
+    }
+    for (m++; m < params.dp_count && params.dp[m].detect; m++) {
+        mask |= params.dp[m].detect;
+    }
+    return mask;
+}
+
+
+// connections with request sent by different groups, 
+// first one is pair of client when race starts
+struct trial {
+    int last;
+    int count;
+    struct eval *att[RACE_MAX];
+};
+
+
+// val becomes pair of client, desync state of previous pair is kept in its cold
+void trial_switch(struct eval *val)
+{
+    struct eval *client = val->pair;
+    
+    if (!client || !client->cold->trial || client->pair == val) {
+        return;
+    }
+    struct eval_cold *c = client->cold, *cur = client->pair->cold;
+    cur->attempt = c->attempt;
+    cur->cache = c->cache;
+    cur->buff.offset = c->buff.offset;
+    
+    c->attempt = val->cold->attempt;
+    c->cache = val->cold->cache;
+    c->buff.offset = val->cold->buff.offset;
+    client->pair = val;
+}
+
+
+// detection groups following m are started at once, in adaptive order best of them,
+// auto mode doesn't go past first group without detection
+static int trial_start(struct poolhd *pool, struct eval *client, int m)
+{
+    struct sockaddr_ina *dst = (struct sockaddr_ina *)&client->pair->cold->in6;
+    char *buffer = client->cold->buff.data;
+    ssize_t n = client->cold->buff.size;
+    
+    int ms[RACE_MAX], k = 0;
+    
+    if (client->cold->tried) {
+        uint64_t g = auto_groups(client, m) & ~client->cold->tried;
+        
+        while (k < params.race - 1) {
+            int i = auto_pick(g, -1);
+            if (i >= params.dp_count) {
+                break;
+            }
+            g &= ~((uint64_t )1 << i);
+            ms[k++] = i;
+        }
+    }
+    else for (int i = m + 1; i < params.dp_count && k < params.race - 1; i++) {
+        struct desync_params *dp = &params.dp[i];
+        if (!dp->detect) {
             break;
         }
-        else if ((dp->detect & DETECT_TLS_INVSID)
-                && neq_tls_sid(req, qn, resp, sn)) {
+        if (check_group(dp, buffer, n, &dst->in6)) {
+            ms[k++] = i;
+        }
+    }
+    if (!k) {
+        return 0;
+    }
+    struct trial *t = calloc(1, sizeof(*t));
+    if (!t) {
+        uniperror("calloc");
+        return -1;
+    }
+    t->att[t->count++] = client->pair;
+    
+    for (int i = 0; i < k; i++) {
+        struct eval *pair = conn_extra(pool, client, dst, EV_DESYNC);
+        if (!pair) {
             break;
         }
-        else if ((dp->detect & DETECT_TLS_ALERT)
-                && is_tls_alert(resp, sn)) {
+        pair->cold->attempt = ms[i];
+        pair->cold->cache = 1;
+        t->att[t->count++] = pair;
+        t->last = ms[i];
+        
+        if (client->cold->tried) {
+            client->cold->tried |= (uint64_t )1 << ms[i];
+        }
+    }
+    if (t->count < 2) {
+        free(t);
+        return 0;
+    }
+    LOG(LOG_S, "race: m=%d..%d, fd=%d\n", client->cold->attempt, t->last, client->fd);
+    
+    client->cold->trial = t;
+    client->type = EV_IGNORE;
+    return 0;
+}
+
+
+// 0 - attempt is closed, others continue
+// otherwise it was last one, it goes on with groups after raced
+int trial_drop(struct poolhd *pool, struct eval *val)
+{
+    struct eval *client = val->pair;
+    struct trial *t = client->cold->trial;
+    
+    for (int i = 0; i < t->count; i++) {
+        if (t->att[i] == val) {
+            t->att[i] = t->att[--t->count];
             break;
         }
-        else if (dp->detect & DETECT_HTTP_CLERR) {
-            int code = get_http_code(resp, sn);
-            if (code > 400 && code < 451 && code != 429) {
-                break;
-            }
+    }
+    if (!t->count) {
+        trial_switch(val);
+        client->cold->attempt = t->last;
+        free(t);
+        client->cold->trial = 0;
+        return -1;
+    }
+    LOG(LOG_S, "race drop: fd=%d\n", val->fd);
+    
+    if (client->pair == val) {
+        trial_switch(t->att[0]);
+    }
+    val->pair = 0;
+    del_event(pool, val);
+    return 0;
+}
+
+
+// losers are closed, client keeps its pair
+void trial_end(struct poolhd *pool, struct eval *client)
+{
+    struct trial *t = client->cold->trial;
+    
+    for (int i = 0; i < t->count; i++) {
+        struct eval *att = t->att[i];
+        if (att == client->pair) {
+            continue;
+        }
+        att->pair = 0;
+        del_event(pool, att);
+    }
+    free(t);
+    client->cold->trial = 0;
+    client->pair->cold->buff.offset = 0;
+}
+
+
+int on_torst(struct poolhd *pool, struct eval *val)
+{
+    struct eval *client = val->pair;
+    group_stat(client->cold->attempt, 0, 0);
+    
+    // response of other group may still come
+    if (client->cold->trial && !trial_drop(pool, val)) {
+        return 0;
+    }
+    int m = auto_next(client, DETECT_TORST);
+    if (m < 0) {
+        return -1;
+    }
+    if (m >= params.dp_count) {
+        mode_add_get(pool,
+            (struct sockaddr_ina *)&val->cold->in6, 0);
+        host_add_get(pool, client, 0);
+        return -1;
+    }
+    return reconnect(pool, val, m);
+}
+
+
+// events of detection, only ones from mask are checked
+static int resp_detect(int mask, 
+        char *req, ssize_t qn, char *resp, ssize_t sn)
+{
+    int ev = 0;
+    
+    if ((mask & DETECT_HTTP_LOCAT)
+            && is_http_redirect(req, qn, resp, sn)) {
+        ev |= DETECT_HTTP_LOCAT;
+    }
+    if ((mask & DETECT_TLS_INVSID)
+            && neq_tls_sid(req, qn, resp, sn)) {
+        ev |= DETECT_TLS_INVSID;
+    }
+    if ((mask & DETECT_TLS_ALERT)
+            && is_tls_alert(resp, sn)) {
+        ev |= DETECT_TLS_ALERT;
+    }
+    if (mask & DETECT_HTTP_CLERR) {
+        int code = get_http_code(resp, sn);
+        if (code > 400 && code < 451 && code != 429) {
+            ev |= DETECT_HTTP_CLERR;
         }
     }
-    if (m < params.dp_count) {
-        return reconnect(pool, val, m);
+    return ev;
+}
+
+
+int on_response(struct poolhd *pool, struct eval *val, 
+        char *resp, ssize_t sn)
+{
+    struct eval *client = val->pair;
+    
+    char *req = client->cold->buff.data;
+    ssize_t qn = client->cold->buff.size;
+    
+    int ev = resp_detect(auto_detect(client), req, qn, resp, sn);
+    if (!ev) {
+        group_stat(client->cold->attempt, 1, pool->tw.now - val->cold->sent);
+        return -1;
+    }
+    group_stat(client->cold->attempt, 0, 0);
+    
+    if (client->cold->trial && !trial_drop(pool, val)) {
+        return 0;
     }
-    return -1;
+    int m = auto_next(client, ev);
+    if (m < 0 || m >= params.dp_count) {
+        return -1;
+    }
+    return reconnect(pool, val, m);
 }
 
 
-static inline void to_tunnel(struct eval *client)
+static inline void to_tunnel(struct poolhd *pool, struct eval *client)
 {
     client->pair->type = EV_TUNNEL;
     client->type = EV_TUNNEL;
+    #ifdef MEMFD_SUPPORT
+    // request is delivered, fake file can be reused
+    struct desync_wait *w = &client->pair->cold->dwait;
+    if (w->fake) {
+        fake_put(pool, w->fake, client->pair->fd);
+        w->fake = 0;
+    }
+    #endif
     
-    assert(client->buff.data);
-    free(client->buff.data);
-    client->buff.data = 0;
-    client->buff.size = 0;
-    client->buff.offset = 0;
+    assert(client->cold->buff.data);
+    buff_put(pool, client->cold->buff.data);
+    client->cold->buff.data = 0;
+    client->cold->buff.size = 0;
+    client->cold->buff.offset = 0;
 }
 
 
@@ -246,7 +644,13 @@ int on_tunnel_check(struct poolhd *pool, struct eval *val,
         char *buffer, size_t bfsize, int out)
 {
     assert(!out);
+    trial_switch(val);
+    
     ssize_t n = recv(val->fd, buffer, bfsize, 0);
+    if (n < 0 && get_e() == EAGAIN) {
+        val->ready &= ~POLLIN;
+        return 0;
+    }
     if (n < 1) {
         if (n) uniperror("recv");
         switch (get_e()) {
@@ -258,38 +662,47 @@ int on_tunnel_check(struct poolhd *pool, struct eval *val,
         }
         return on_torst(pool, val);
     }
-    //
+    if (n < bfsize) {
+        val->ready &= ~POLLIN;
+    }
     if (on_response(pool, val, buffer, n) == 0) {
         return 0;
     }
-    val->recv_count += n;
+    val->cold->recv_count += n;
     struct eval *pair = val->pair;
     
+    if (pair->cold->trial) {
+        trial_end(pool, pair);
+    }
+    
     ssize_t sn = send(pair->fd, buffer, n, 0);
     if (n != sn) {
         uniperror("send");
         return -1;
     }
-    to_tunnel(pair);
-    
-    if (params.timeout &&
-            set_timeout(val->fd, 0)) {
-        return -1;
-    }
-    int m = pair->attempt;
+    int m = pair->cold->attempt;
     
-    if (!pair->cache) {
-        return 0;
+    // before request is released, its host is saved too
+    if (pair->cold->cache) {
+        struct sockaddr_ina *addr = (struct sockaddr_ina *)&val->cold->in6;
+        
+        if (m == 0) {
+            LOG(LOG_S, "delete ip: m=%d\n", m);
+        } else {
+            INIT_ADDR_STR((*addr));
+            LOG(LOG_S, "save ip: %s, m=%d\n", ADDR_STR, m);
+        }
+        if (mode_add_get(pool, addr, m) || host_add_get(pool, pair, m)) {
+            return -1;
+        }
     }
-    struct sockaddr_ina *addr = (struct sockaddr_ina *)&val->in6;
+    to_tunnel(pool, pair);
+    set_timer(pool, val, params.idle_timeout);
     
-    if (m == 0) {
-        LOG(LOG_S, "delete ip: m=%d\n", m);
-    } else {
-        INIT_ADDR_STR((*addr));
-        LOG(LOG_S, "save ip: %s, m=%d\n", ADDR_STR, m);
+    if (n < bfsize) {
+        offload_tunnel(pool, val);
     }
-    return mode_add_get(addr, m);
+    return 0;
 }
 
 
@@ -301,34 +714,66 @@ int on_desync_again(struct poolhd *pool,
             uniperror("mod_etype");
             return -1;
         }
+        trial_switch(val);
+        // client was parked while part was pending
+        if (val->cold->dwait.pending && val->pair->type == EV_DESYNC
+                && mod_etype(pool, val->pair, POLLIN)) {
+            uniperror("mod_etype");
+            return -1;
+        }
         val = val->pair;
+        set_timer(pool, val, 0);
     }
-    int m = val->attempt;
+    int m = val->cold->attempt;
     LOG((m ? LOG_S : LOG_L), "desync params index: %d\n", m);
     
-    ssize_t n = val->buff.size;
+    ssize_t n = val->cold->buff.size;
     assert(n > 0 && n <= params.bfsize);
-    memcpy(buffer, val->buff.data, n);
+    memcpy(buffer, val->cold->buff.data, n);
     
-    if (params.timeout &&
-            set_timeout(val->pair->fd, params.timeout)) {
-        return -1;
-    }
-    ssize_t sn = desync(val->pair->fd, buffer, bfsize, n,
-        val->buff.offset, (struct sockaddr *)&val->pair->in6, m);
+    struct desync_wait *w = &val->pair->cold->dwait;
+    
+    ssize_t sn = desync(pool, val->pair->fd, buffer, bfsize, n, 
+        val->cold->buff.offset, (struct sockaddr *)&val->pair->cold->in6, m, w);
     if (sn < 0) {
         return -1;
     }
-    val->buff.offset += sn;
+    val->cold->buff.offset = sn;
+    if (w->pending) {
+        // resumed by POLLOUT or timer, when part has left socket,
+        // edge of POLLOUT is passed, if segment is already sent
+        int e = w->delay ? 0 : POLLOUT;
+        val->pair->ready &= ~POLLOUT;
+        if (mod_etype(pool, val->pair, e)
+                || (e && recheck_event(pool, val->pair))) {
+            uniperror("mod_etype");
+            return -1;
+        }
+        set_timer(pool, val->pair, w->delay ? w->delay : WAIT_SEND_MAX);
+        val->pair->type = EV_DESYNC;
+        
+        // request must not grow under desync until then
+        if (val->type == EV_DESYNC && mod_etype(pool, val, 0)) {
+            uniperror("mod_etype");
+            return -1;
+        }
+        return 0;
+    }
     if (sn < n) {
+        val->pair->ready &= ~POLLOUT;
         if (mod_etype(pool, val->pair, POLLOUT)) {
             uniperror("mod_etype");
             return -1;
         }
+        set_timer(pool, val->pair, params.idle_timeout);
         val->pair->type = EV_DESYNC;
         return 0;
     }
     val->pair->type = EV_PRE_TUNNEL;
+    val->pair->cold->sent = pool->tw.now;
+    
+    unsigned int t = params.dp[m].timeout;
+    set_timer(pool, val->pair, t ? t : params.idle_timeout);
     return 0;
 }
 
@@ -337,42 +782,76 @@ int on_desync(struct poolhd *pool, struct eval *val,
         char *buffer, size_t bfsize, int out)
 {
     if (out) {
+        if (out & POLLTIMEOUT) {
+            val->cold->dwait.expired = 1;
+        }
         return on_desync_again(pool, val, buffer, bfsize);
     }
-    if (val->buff.size == bfsize) {
-        to_tunnel(val);
+    // only RDHUP of parked client, EOF is seen by recv after wait
+    if (val->pair->cold->dwait.pending) {
+        val->flag |= FLAG_RDHUP;
+        if (mod_etype(pool, val, 0)) {
+            uniperror("mod_etype");
+            return -1;
+        }
+        return 0;
+    }
+    if (val->cold->buff.size == bfsize) {
+        to_tunnel(pool, val);
         return 0;
     }
-    ssize_t n = recv(val->fd, buffer, bfsize - val->buff.size, 0);
+    if (!val->cold->buff.data && !(val->cold->buff.data = buff_get(pool))) {
+        uniperror("buff_get");
+        return -1;
+    }
+    ssize_t n = recv(val->fd, val->cold->buff.data + val->cold->buff.size, 
+        bfsize - val->cold->buff.size, 0);
     if (n <= 0) {
+        if (n && get_e() == EAGAIN) {
+            val->ready &= ~POLLIN;
+            return 0;
+        }
         if (n) uniperror("recv data");
         return -1;
     }
-    val->buff.size += n;
-    val->recv_count += n;
-    
-    val->buff.data = realloc(val->buff.data, val->buff.size);
-    if (val->buff.data == 0) {
-        uniperror("realloc");
-        return -1;
+    if (n < bfsize - val->cold->buff.size) {
+        val->ready &= ~POLLIN;
     }
-    memcpy(val->buff.data + val->buff.size - n, buffer, n);
+    val->cold->buff.size += n;
+    val->cold->recv_count += n;
     
-    int m = val->attempt;
-    if (!m) for (; m < params.dp_count; m++) {
-        struct desync_params *dp = &params.dp[m];
-        if (!dp->detect &&
-                (!dp->pf[0] || check_port(dp->pf, &val->pair->in6)) &&
-                (!dp->proto || check_proto_tcp(dp->proto, val)) &&
-                (!dp->hosts || check_host(dp->hosts, val))) {
-            break;
-        }
+    return desync_start(pool, val, buffer, bfsize);
+}
+
+
+int desync_start(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize)
+{
+    int m = val->cold->attempt;
+    
+    // nothing is cached for IP, see connect_hook
+    char fresh = !m && !val->cold->buff.offset;
+    if (fresh && (m = host_add_get(pool, val, -1)) > 0) {
+        LOG(LOG_S, "cached host: m=%d\n", m);
+        // saved for IP as well on success
+        val->cold->cache = 1;
+        fresh = 0;
+    }
+    if (m <= 0) {
+        m = desync_select(val->cold->buff.data, 
+            val->cold->buff.size, &val->pair->cold->in6);
     }
     if (m >= params.dp_count) {
         return -1;
     }
-    val->attempt = m;
+    val->cold->attempt = m;
     
+    if (fresh && params.adapt) {
+        val->cold->attempt = auto_first(val, m);
+    }
+    if (fresh && params.race > 1 && trial_start(pool, val, m)) {
+        return -1;
+    }
     return on_desync_again(pool, val, buffer, bfsize);
 }
 
@@ -380,10 +859,10 @@ int on_desync(struct poolhd *pool, struct eval *val,
 ssize_t udp_hook(struct eval *val, 
         char *buffer, size_t bfsize, ssize_t n, struct sockaddr_ina *dst)
 {
-    if (val->recv_count) {
+    if (val->cold->recv_count) {
         return send(val->fd, buffer, n, 0);
     }
-    int m = val->attempt;
+    int m = val->cold->attempt;
     if (!m) for (; m < params.dp_count; m++) {
         struct desync_params *dp = &params.dp[m];
         if (!dp->detect && 
@@ -400,27 +879,8 @@ ssize_t udp_hook(struct eval *val,
 
 
 #ifdef __linux__
-int protect(int conn_fd, const char *path)
+static int send_fd(int fd, int conn_fd)
 {
-    struct sockaddr_un sa;
-    sa.sun_family = AF_UNIX;
-    strcpy(sa.sun_path, path);
-    
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        uniperror("socket");  
-        return -1;
-    }
-    struct timeval tv = { .tv_sec = 1 };
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-    
-    int err = connect(fd, (struct sockaddr *)&sa, sizeof(sa));
-    if (err) {
-        uniperror("connect");
-        close(fd);
-        return -1;
-    }
     char buf[CMSG_SPACE(sizeof(fd))] = {};
     struct iovec io = { .iov_base = "1", .iov_len = 1 };
     struct msghdr msg = { .msg_iov = &io };
@@ -437,12 +897,47 @@ int protect(int conn_fd, const char *path)
     *((int *)CMSG_DATA(cmsg)) = conn_fd;
     msg.msg_controllen = CMSG_SPACE(sizeof(conn_fd));
 
-    if (sendmsg(fd, &msg, 0) < 0) {
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+
+static int protect_connect(int fd, const char *path)
+{
+    struct sockaddr_un sa;
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+        uniperror("connect");
+        return -1;
+    }
+    return 0;
+}
+
+
+// blocking, for sockets created before event loop
+int protect(int conn_fd, const char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        uniperror("socket");  
+        return -1;
+    }
+    struct timeval tv = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    
+    if (protect_connect(fd, path)) {
+        close(fd);
+        return -1;
+    }
+    if (send_fd(fd, conn_fd)) {
         uniperror("sendmsg");
         close(fd);
         return -1;
     }
-    if (recv(fd, buf, 1, 0) < 1) {
+    char buf;
+    if (recv(fd, &buf, 1, 0) < 1) {
         uniperror("recv");
         close(fd);
         return -1;
@@ -450,4 +945,220 @@ int protect(int conn_fd, const char *path)
     close(fd);
     return 0;
 }
+
+
+static int protect_open(struct poolhd *pool)
+{
+    struct protector *p = pool->prot;
+    
+    int fd = nb_socket(AF_UNIX, SOCK_STREAM);
+    if (fd < 0) {
+        return -1;
+    }
+    if (protect_connect(fd, params.protect_path)) {
+        close(fd);
+        return -1;
+    }
+    if (!(p->ev = add_event(pool, EV_PROTECT, fd, POLLIN))) {
+        uniperror("add event");
+        close(fd);
+        return -1;
+    }
+    p->acked = 0;
+    return 0;
+}
+
+
+// client is gone or has finished connecting
+static inline struct eval *protect_owner(
+        struct poolhd *pool, struct protect_req *req)
+{
+    struct eval *val = find_event(pool, req->id);
+    if (!val || val->cold->prot != req->ticket) {
+        return 0;
+    }
+    return val;
+}
+
+
+static void protect_done(struct poolhd *pool, struct protect_req *req, int ok)
+{
+    struct eval *val = protect_owner(pool, req);
+    if (!val) {
+        close(req->fd);
+        return;
+    }
+    if (on_protected(pool, val, req->fd, &req->dst, req->next, ok)) {
+        close_conn(pool, val);
+    }
+}
+
+
+// 1 - channel is full
+static int protect_send(struct protector *p, struct protect_req *req)
+{
+    if (send_fd(p->ev->fd, req->fd)) {
+        if (get_e() == EAGAIN) {
+            return 1;
+        }
+        // peer has closed channel, request is sent again from protect_lost
+        shutdown(p->ev->fd, SHUT_RDWR);
+        return 0;
+    }
+    req->sent = 1;
+    return 0;
+}
+
+
+// unsent requests are at tail, rest waits for POLLOUT to keep order
+static void protect_flush(struct poolhd *pool)
+{
+    struct protector *p = pool->prot;
+    
+    while (p->unsent) {
+        struct protect_req *req = 
+            &p->q[(p->head + p->count - p->unsent) % p->size];
+        if (protect_send(p, req)) {
+            p->ev->ready &= ~POLLOUT;
+            break;
+        }
+        p->unsent--;
+    }
+    if (mod_etype(pool, p->ev, p->unsent ? (POLLIN | POLLOUT) : POLLIN)) {
+        uniperror("mod_etype");
+        shutdown(p->ev->fd, SHUT_RDWR);
+    }
+}
+
+
+// fd is owned by queue until on_protected
+int protect_queue(struct poolhd *pool, struct eval *val,
+        int fd, struct sockaddr_ina *dst, int next)
+{
+    struct protector *p = pool->prot;
+    if (!p) {
+        p = calloc(1, sizeof(*p));
+        if (!p) {
+            uniperror("calloc");
+            return -1;
+        }
+        p->size = pool->max;
+        p->q = malloc(sizeof(*p->q) * p->size);
+        if (!p->q) {
+            uniperror("malloc");
+            free(p);
+            return -1;
+        }
+        pool->prot = p;
+    }
+    if (p->count >= p->size) {
+        LOG(LOG_E, "protect queue is full\n");
+        return -1;
+    }
+    if (!p->ev && protect_open(pool)) {
+        return -1;
+    }
+    struct protect_req *req = &p->q[(p->head + p->count) % p->size];
+    req->fd = fd;
+    req->id = val->id;
+    req->next = next;
+    req->dst = *dst;
+    req->sent = 0;
+    
+    if (!val->cold->prot) {
+        if (!++p->ticket) {
+            p->ticket++;
+        }
+        val->cold->prot = p->ticket;
+    }
+    req->ticket = val->cold->prot;
+    p->count++;
+    
+    if (!p->unsent++) {
+        protect_flush(pool);
+    }
+    return 0;
+}
+
+
+// peer may serve one request per connection, then rest is sent again
+static void protect_lost(struct poolhd *pool)
+{
+    struct protector *p = pool->prot;
+    int resend = p->acked, n = p->count;
+    
+    del_event(pool, p->ev);
+    p->ev = 0;
+    p->unsent = 0;
+    
+    for (int i = 0; i < n; i++) {
+        struct protect_req req = p->q[p->head];
+        p->head = (p->head + 1) % p->size;
+        p->count--;
+        
+        if (!protect_owner(pool, &req)) {
+            close(req.fd);
+            continue;
+        }
+        if ((!resend && req.sent) || (!p->ev && protect_open(pool))) {
+            protect_done(pool, &req, 0);
+            continue;
+        }
+        req.sent = 0;
+        p->q[(p->head + p->count++) % p->size] = req;
+        p->unsent++;
+    }
+    if (p->unsent) {
+        protect_flush(pool);
+    }
+}
+
+
+void on_protect(struct poolhd *pool, struct eval *val,
+        int etype, char *buffer, size_t bfsize)
+{
+    struct protector *p = pool->prot;
+    
+    if (p->unsent && (etype & POLLOUT)) {
+        protect_flush(pool);
+    }
+    while (1) {
+        ssize_t n = recv(val->fd, buffer, bfsize, 0);
+        if (n <= 0) {
+            if (n < 0 && get_e() == EAGAIN) {
+                val->ready &= ~POLLIN;
+                return;
+            }
+            // peer has closed it with unread requests
+            if (n < 0 && get_e() != ECONNRESET) {
+                uniperror("recv protect");
+            }
+            protect_lost(pool);
+            return;
+        }
+        for (ssize_t i = 0; i < n && p->count; i++) {
+            struct protect_req req = p->q[p->head];
+            p->head = (p->head + 1) % p->size;
+            p->count--;
+            p->acked = 1;
+            
+            protect_done(pool, &req, 1);
+        }
+    }
+}
+
+
+void protect_free(struct poolhd *pool)
+{
+    struct protector *p = pool->prot;
+    if (!p) {
+        return;
+    }
+    for (int i = 0; i < p->count; i++) {
+        close(p->q[(p->head + i) % p->size].fd);
+    }
+    free(p->q);
+    free(p);
+    pool->prot = 0;
+}
 #endif
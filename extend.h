@@ -1,17 +1,62 @@
+int mode_add_get(struct poolhd *pool, struct sockaddr_ina *dst, int m);
+
 int connect_hook(struct poolhd *pool, struct eval *val, 
-        struct sockaddr_ina *dst, int next);
+        struct sockaddr_ina *dst, int n, int next);
         
+int on_torst(struct poolhd *pool, struct eval *val);
+
 int on_tunnel_check(struct poolhd *pool, struct eval *val,
         char *buffer, size_t bfsize, int out);
 
 int on_desync(struct poolhd *pool, struct eval *val,
         char *buffer, size_t bfsize, int out);
 
+int desync_start(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize);
+
+int desync_select(char *buffer, ssize_t n, struct sockaddr_in6 *dst);
+
+void trial_switch(struct eval *val);
+
+int trial_drop(struct poolhd *pool, struct eval *val);
+
+void trial_end(struct poolhd *pool, struct eval *client);
+
 ssize_t udp_hook(struct eval *val, 
         char *buffer, size_t bfsize, ssize_t n, struct sockaddr_ina *dst);
 
 #ifdef __linux__
+struct protect_req {
+    int fd;
+    int id;
+    uint32_t ticket;
+    int next;
+    char sent;
+    struct sockaddr_ina dst;
+};
+
+// one connection to protect peer, acks come in order of requests
+struct protector {
+    struct eval *ev;
+    char acked;
+    uint32_t ticket;
+    int size;
+    int head;
+    int count;
+    int unsent;
+    struct protect_req *q;
+};
+
 int protect(int conn_fd, const char *path);
+
+int protect_queue(struct poolhd *pool, struct eval *val,
+        int fd, struct sockaddr_ina *dst, int next);
+
+void on_protect(struct poolhd *pool, struct eval *val,
+        int etype, char *buffer, size_t bfsize);
+
+void protect_free(struct poolhd *pool);
 #else
 #define protect(fd, path) 0
+#define protect_free(pool)
 #endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+
+#include "inject.h"
+
+#ifdef RAW_SUPPORT
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+#include "error.h"
+
+#ifndef IPV6_HDRINCL
+    #define IPV6_HDRINCL 36
+#endif
+
+// IPv4 with options or IPv6, TCP with MD5 option
+#define HDR_MAX (60 + 40)
+
+static int raw4 = -1;
+static int raw6 = -1;
+
+
+int inject_init(void)
+{
+    raw4 = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (raw4 < 0) {
+        uniperror("raw socket");
+        return -1;
+    }
+    int on = 1;
+    
+    raw6 = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+    if (raw6 < 0 || setsockopt(raw6,
+            IPPROTO_IPV6, IPV6_HDRINCL, &on, sizeof(on))) {
+        // IPv6 connections fall back to TTL
+        uniperror("raw socket ipv6");
+        if (raw6 >= 0) {
+            close(raw6);
+            raw6 = -1;
+        }
+    }
+    return 0;
+}
+
+
+// injected segments are not captured again
+int inject_mark(int mark)
+{
+    if (setsockopt(raw4, SOL_SOCKET, SO_MARK, &mark, sizeof(mark))
+            || (raw6 >= 0 && setsockopt(raw6, 
+                SOL_SOCKET, SO_MARK, &mark, sizeof(mark)))) {
+        uniperror("setsockopt SO_MARK");
+        return -1;
+    }
+    return 0;
+}
+
+
+static int queue_seq(int sfd, int q, uint32_t *seq)
+{
+    socklen_t sl = sizeof(*seq);
+    
+    if (setsockopt(sfd, IPPROTO_TCP, TCP_REPAIR_QUEUE, &q, sizeof(q))
+            || getsockopt(sfd, IPPROTO_TCP, TCP_QUEUE_SEQ, seq, &sl)) {
+        uniperror("TCP_QUEUE_SEQ");
+        return -1;
+    }
+    return 0;
+}
+
+
+int inject_seq(int sfd, uint32_t *seq, uint32_t *ack, int *mss)
+{
+    int on = TCP_REPAIR_ON;
+    
+    if (setsockopt(sfd, IPPROTO_TCP, TCP_REPAIR, &on, sizeof(on))) {
+        uniperror("setsockopt TCP_REPAIR");
+        return -1;
+    }
+    int err = queue_seq(sfd, TCP_SEND_QUEUE, seq)
+        || queue_seq(sfd, TCP_RECV_QUEUE, ack);
+    
+    // nothing has changed, window probe is not needed
+    int off = TCP_REPAIR_OFF_NO_WP;
+    if (setsockopt(sfd, IPPROTO_TCP, TCP_REPAIR, &off, sizeof(off))) {
+        off = TCP_REPAIR_OFF;
+        if (setsockopt(sfd, IPPROTO_TCP, TCP_REPAIR, &off, sizeof(off))) {
+            uniperror("setsockopt TCP_REPAIR");
+            return -1;
+        }
+    }
+    if (err) {
+        return -1;
+    }
+    socklen_t sl = sizeof(*mss);
+    if (getsockopt(sfd, IPPROTO_TCP, TCP_MAXSEG, mss, &sl)) {
+        uniperror("getsockopt TCP_MAXSEG");
+        return -1;
+    }
+    return 0;
+}
+
+
+static uint32_t sum16(uint32_t sum, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    
+    for (; len > 1; len -= 2, p += 2) {
+        sum += (p[0] << 8) | p[1];
+    }
+    if (len) {
+        sum += p[0] << 8;
+    }
+    return sum;
+}
+
+
+static uint16_t fold16(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum);
+}
+
+
+static inline int unmap(struct sockaddr_in6 *in6, struct sockaddr_in *in)
+{
+    static const char pat[] = "\0\0\0\0\0\0\0\0\0\0\xff\xff";
+    
+    if (in6->sin6_family == AF_INET) {
+        memcpy(in, in6, sizeof(*in));
+        return AF_INET;
+    }
+    if (!memcmp(&in6->sin6_addr, pat, 12)) {
+        in->sin_family = AF_INET;
+        in->sin_port = in6->sin6_port;
+        memcpy(&in->sin_addr, (char *)&in6->sin6_addr + 12, 4);
+        return AF_INET;
+    }
+    return AF_INET6;
+}
+
+
+int inject_send(int sfd, struct sockaddr *dst,
+        struct inject_seg *seg, const char *data, size_t dsize, size_t len)
+{
+    struct sockaddr_in6 src6 = { 0 }, dst6 = { 0 };
+    struct sockaddr_in src4 = { 0 }, dst4 = { 0 };
+    socklen_t sl = sizeof(src6);
+    
+    if (getsockname(sfd, (struct sockaddr *)&src6, &sl)) {
+        uniperror("getsockname");
+        return -1;
+    }
+    memcpy(&dst6, dst, dst->sa_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    
+    int fa = unmap(&src6, &src4);
+    if (fa != unmap(&dst6, &dst4)) {
+        return -1;
+    }
+    int fd = fa == AF_INET ? raw4 : raw6;
+    if (fd < 0 || len > INJECT_MAX) {
+        return -1;
+    }
+    char pkt[HDR_MAX + INJECT_MAX];
+    memset(pkt, 0, HDR_MAX);
+    
+    size_t iplen;
+    if (fa == AF_INET) {
+        size_t ol = seg->ip_options ? (seg->ip_options_len + 3) & ~3 : 0;
+        if (ol > 40) {
+            return -1;
+        }
+        iplen = sizeof(struct iphdr) + ol;
+    }
+    else {
+        iplen = sizeof(struct ip6_hdr);
+    }
+    size_t tcplen = sizeof(struct tcphdr) + (seg->md5sig ? 20 : 0);
+    
+    struct tcphdr *tcp = (struct tcphdr *)(pkt + iplen);
+    tcp->source = fa == AF_INET ? src4.sin_port : src6.sin6_port;
+    tcp->dest = fa == AF_INET ? dst4.sin_port : dst6.sin6_port;
+    tcp->seq = htonl(seg->seq);
+    tcp->ack_seq = htonl(seg->ack);
+    tcp->doff = tcplen / 4;
+    tcp->ack = 1;
+    tcp->psh = 1;
+    tcp->window = htons(0xffff);
+    
+    if (seg->md5sig) {
+        // two NOPs and MD5 signature, which server can't verify
+        char *opt = (char *)(tcp + 1);
+        opt[0] = 1;
+        opt[1] = 1;
+        opt[2] = 19;
+        opt[3] = 18;
+    }
+    char *payload = (char *)tcp + tcplen;
+    size_t ps = dsize < len ? dsize : len;
+    
+    memcpy(payload, data, ps);
+    memset(payload + ps, 0, len - ps);
+    
+    uint32_t sum = 0;
+    if (fa == AF_INET) {
+        struct iphdr *ip = (struct iphdr *)pkt;
+        ip->version = 4;
+        ip->ihl = iplen / 4;
+        ip->tot_len = htons(iplen + tcplen + len);
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = seg->ttl;
+        ip->protocol = IPPROTO_TCP;
+        ip->saddr = src4.sin_addr.s_addr;
+        ip->daddr = dst4.sin_addr.s_addr;
+        
+        if (iplen > sizeof(*ip)) {
+            memcpy(ip + 1, seg->ip_options, seg->ip_options_len);
+        }
+        sum = sum16(sum, &ip->saddr, 8);
+    }
+    else {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)pkt;
+        ip6->ip6_flow = htonl(6 << 28);
+        ip6->ip6_plen = htons(tcplen + len);
+        ip6->ip6_nxt = IPPROTO_TCP;
+        ip6->ip6_hlim = seg->ttl;
+        ip6->ip6_src = src6.sin6_addr;
+        ip6->ip6_dst = dst6.sin6_addr;
+        
+        sum = sum16(sum, &ip6->ip6_src, 32);
+    }
+    sum += IPPROTO_TCP + tcplen + len;
+    tcp->check = fold16(sum16(sum, tcp, tcplen + len));
+    
+    ssize_t s;
+    if (fa == AF_INET) {
+        dst4.sin_port = 0;
+        s = sendto(fd, pkt, iplen + tcplen + len, 0,
+            (struct sockaddr *)&dst4, sizeof(dst4));
+    }
+    else {
+        dst6.sin6_port = 0;
+        s = sendto(fd, pkt, iplen + tcplen + len, 0,
+            (struct sockaddr *)&dst6, sizeof(dst6));
+    }
+    if (s < 0) {
+        uniperror("sendto raw");
+        return -1;
+    }
+    return 0;
+}
+
+
+// headers of captured segment with other payload at offset,
+// ttl 0 - keep original
+int inject_clone(struct inject_pkt *pkt, long off,
+        const char *data, size_t dsize, size_t len, int ttl)
+{
+    int fd = pkt->family == AF_INET ? raw4 : raw6;
+    size_t hlen = pkt->iplen + pkt->tcplen;
+    
+    if (fd < 0 || hlen + len > pkt->out_size) {
+        return -1;
+    }
+    char *out = pkt->out;
+    memcpy(out, pkt->data, hlen);
+    
+    struct tcphdr *tcp = (struct tcphdr *)(out + pkt->iplen);
+    char *payload = out + hlen;
+    size_t ps = dsize < len ? dsize : len;
+    
+    memcpy(payload, data, ps);
+    memset(payload + ps, 0, len - ps);
+    
+    tcp->seq = htonl(ntohl(tcp->seq) + off);
+    tcp->check = 0;
+    
+    struct sockaddr_in6 dst6 = { 0 };
+    struct sockaddr_in dst4 = { 0 };
+    uint32_t sum = 0;
+    
+    if (pkt->family == AF_INET) {
+        struct iphdr *ip = (struct iphdr *)out;
+        ip->tot_len = htons(hlen + len);
+        ip->check = 0;
+        if (ttl) {
+            ip->ttl = ttl;
+        }
+        sum = sum16(sum, &ip->saddr, 8);
+        
+        dst4.sin_family = AF_INET;
+        dst4.sin_addr.s_addr = ip->daddr;
+    }
+    else {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)out;
+        ip6->ip6_plen = htons(pkt->tcplen + len);
+        if (ttl) {
+            ip6->ip6_hlim = ttl;
+        }
+        sum = sum16(sum, &ip6->ip6_src, 32);
+        
+        dst6.sin6_family = AF_INET6;
+        dst6.sin6_addr = ip6->ip6_dst;
+    }
+    sum += IPPROTO_TCP + pkt->tcplen + len;
+    tcp->check = fold16(sum16(sum, tcp, pkt->tcplen + len));
+    
+    ssize_t s;
+    if (pkt->family == AF_INET) {
+        s = sendto(fd, out, hlen + len, 0,
+            (struct sockaddr *)&dst4, sizeof(dst4));
+    }
+    else {
+        s = sendto(fd, out, hlen + len, 0,
+            (struct sockaddr *)&dst6, sizeof(dst6));
+    }
+    if (s < 0) {
+        uniperror("sendto raw");
+        return -1;
+    }
+    return 0;
+}
+
+
+void inject_close(void)
+{
+    if (raw4 >= 0) {
+        close(raw4);
+        raw4 = -1;
+    }
+    if (raw6 >= 0) {
+        close(raw6);
+        raw6 = -1;
+    }
+}
+#endif
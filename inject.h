@@ -0,0 +1,44 @@
+#ifdef __linux__
+#define RAW_SUPPORT 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// payload of injected segment is cut to fit in any MTU
+#define INJECT_MAX 1200
+
+struct inject_seg {
+    uint32_t seq;
+    uint32_t ack;
+    int ttl;
+    char md5sig;
+    char *ip_options;
+    ssize_t ip_options_len;
+};
+
+// captured segment, see nfq.c
+struct inject_pkt {
+    char *data;
+    size_t iplen;
+    size_t tcplen;
+    int family;
+    // clones are built here, see inject_clone
+    char *out;
+    size_t out_size;
+};
+
+int inject_init(void);
+
+int inject_mark(int mark);
+
+int inject_seq(int sfd, uint32_t *seq, uint32_t *ack, int *mss);
+
+int inject_send(int sfd, struct sockaddr *dst,
+    struct inject_seg *seg, const char *data, size_t dsize, size_t len);
+
+int inject_clone(struct inject_pkt *pkt, long off,
+    const char *data, size_t dsize, size_t len, int ttl);
+
+void inject_close(void);
+#endif
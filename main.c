@@ -9,6 +9,9 @@
 #include "params.h"
 #include "proxy.h"
 #include "packets.h"
+#include "sockmap.h"
+#include "inject.h"
+#include "dns.h"
 #include "error.h"
 
 #ifndef _WIN32
@@ -18,6 +21,7 @@
     #include <fcntl.h>
     #include <netinet/tcp.h>
     #include <sys/mman.h>
+    #include <sys/resource.h>
 #else
     #include <ws2tcpip.h>
     #include "win_service.h"
@@ -52,7 +56,12 @@ struct params params = {
     .resolve = 1,
     .udp = 1,
     .max_open = 512,
+    .nfqueue = -1,
+    .workers = 1,
     .bfsize = 16384,
+    .bflimit = 65536,
+    .conn_timeout = 60000,
+    .defer_accept = -1,
     .baddr = {
         .sin6_family = AF_INET6
     },
@@ -67,10 +76,39 @@ const char help_text[] = {
     "    -i, --ip, <ip>            Listening IP, default 0.0.0.0\n"
     "    -p, --port <num>          Listening port, default 1080\n"
     "    -c, --max-conn <count>    Connection count limit, default 512\n"
+    "    -q, --backlog <count>     Listen queue length, default is max-conn\n"
+    #ifdef TCP_FASTOPEN
+    "        --tfo-queue <count>   Accept TCP Fast Open, queue length, default 0 (off)\n"
+    #endif
+    #ifdef __linux__
+    "        --defer-accept <sec>  Accept after first data, 0 - off, default conn-timeout\n"
+    #endif
+    #ifdef __linux__
+    "    -G, --transparent         Accept REDIRECT/TPROXY traffic instead of SOCKS\n"
+    "    -Q, --nfqueue <num>       Desync packets from NFQUEUE instead of proxying\n"
+    "    -L, --tun <name|fd>       Terminate flows of tun device, besides SOCKS\n"
+    #endif
+    #ifdef WORKERS_SUPPORT
+    "    -J, --workers <count>     Worker threads, 0 - one per CPU, default 1\n"
+    "    -C, --pin-cpu             Pin workers to CPUs, use SO_INCOMING_CPU\n"
+    #endif
+    #ifdef EDGE_SUPPORT
+    "    -E, --edge                Edge-triggered epoll mode\n"
+    #endif
+    #ifdef SPLICE_SUPPORT
+    "    -Z, --splice              Zero-copy tunnel with splice\n"
+    #endif
+    #ifdef SOCKMAP_SUPPORT
+    "    -O, --offload             Forward established tunnels in kernel (sockmap)\n"
+    #endif
     "    -N, --no-domain           Deny domain resolving\n"
+    "    -D, --dns <ip[:port]>     Resolve domains by DNS server, asynchronously\n"
     "    -U, --no-udp              Deny UDP association\n"
     "    -I  --conn-ip <ip>        Connection binded IP, default ::\n"
     "    -b, --buf-size <size>     Buffer size, default 16384\n"
+    "    -B, --buf-limit <size>    Max unsent data per direction, default 65536\n"
+    "    -Y, --conn-timeout <sec>  Timeout for request and connect, default 60\n"
+    "    -y, --idle-timeout <sec>  Close tunnels without traffic, default 0 (off)\n"
     "    -x, --debug <level>       Print logs, 0, 1 or 2\n"
     "    -g, --def-ttl <num>       TTL for all outgoing connections\n"
     // desync options
@@ -79,10 +117,10 @@ const char help_text[] = {
     #endif
     "    -A, --auto[=t,r,c,s,a,n]  Try desync params after this option\n"
     "                              Detect: torst,redirect,cl_err,sid_inv,alert,none\n"
-    "    -u, --cache-ttl <sec>     Lifetime of cached desync params for IP\n"
-    #ifdef TIMEOUT_SUPPORT
+    "    -u, --cache-ttl <sec>     Lifetime of cached desync params for IP and host\n"
+    "    -z, --race <count>        Race up to count auto groups for uncached IP, max 8\n"
+    "    -m, --adapt               Order auto groups by their success rate\n"
     "    -T, --timeout <sec>       Timeout waiting for response, after which trigger auto\n"
-    #endif
     "    -K, --proto <t,h,u>       Protocol whitelist: tls,http,udp\n"
     "    -H, --hosts <file|:str>   Hosts whitelist, filename or :string\n"
     "    -V, --pf <port[-portr]>   Ports range whitelist\n"
@@ -98,6 +136,9 @@ const char help_text[] = {
     "    -k, --ip-opt[=f|:str]     IP options of fake packets\n"
     "    -S, --md5sig              Add MD5 Signature option for fake packets\n"
     #endif
+    #ifdef RAW_SUPPORT
+    "    -R, --raw-inject          Inject fake/disorder by raw socket, keep socket TTL\n"
+    #endif
     "    -l, --fake-data <f|:str>  Set custom fake packet\n"
     "    -n, --tls-sni <str>       Change SNI in fake ClientHello\n"
     #endif
@@ -108,8 +149,14 @@ const char help_text[] = {
 };
 
 
+// have no short form, see opt in main
+#define OPT_LONG 0x100
+#define OPT_TFO_QUEUE OPT_LONG
+#define OPT_DEFER_ACCEPT (OPT_LONG + 1)
+
 const struct option options[] = {
     {"no-domain",     0, 0, 'N'},
+    {"dns",           1, 0, 'D'},
     {"no-ipv6",       0, 0, 'X'},
     {"no-udp",        0, 0, 'U'},
     {"help",          0, 0, 'h'},
@@ -118,7 +165,35 @@ const struct option options[] = {
     {"port",          1, 0, 'p'},
     {"conn-ip",       1, 0, 'I'},
     {"buf-size",      1, 0, 'b'},
+    {"buf-limit",     1, 0, 'B'},
+    {"conn-timeout",  1, 0, 'Y'},
+    {"idle-timeout",  1, 0, 'y'},
     {"max-conn",      1, 0, 'c'},
+    {"backlog",       1, 0, 'q'},
+    #ifdef TCP_FASTOPEN
+    {"tfo-queue",     1, 0, OPT_TFO_QUEUE},
+    #endif
+    #ifdef __linux__
+    {"defer-accept",  1, 0, OPT_DEFER_ACCEPT},
+    #endif
+    #ifdef __linux__
+    {"transparent",   0, 0, 'G'},
+    {"nfqueue",       1, 0, 'Q'},
+    {"tun",           1, 0, 'L'},
+    #endif
+    #ifdef WORKERS_SUPPORT
+    {"workers",       1, 0, 'J'},
+    {"pin-cpu",       0, 0, 'C'},
+    #endif
+    #ifdef EDGE_SUPPORT
+    {"edge",          0, 0, 'E'},
+    #endif
+    #ifdef SPLICE_SUPPORT
+    {"splice",        0, 0, 'Z'},
+    #endif
+    #ifdef SOCKMAP_SUPPORT
+    {"offload",       0, 0, 'O'},
+    #endif
     {"debug",         1, 0, 'x'},
     
     #ifdef TCP_FASTOPEN_CONNECT
@@ -126,9 +201,9 @@ const struct option options[] = {
     #endif
     {"auto",          2, 0, 'A'},
     {"cache-ttl",     1, 0, 'u'},
-    #ifdef TIMEOUT_SUPPORT
+    {"race",          1, 0, 'z'},
+    {"adapt",         0, 0, 'm'},
     {"timeout",       1, 0, 'T'},
-    #endif
     {"proto",         1, 0, 'K'},
     {"hosts",         1, 0, 'H'},
     {"pf",            1, 0, 'V'},
@@ -142,6 +217,9 @@ const struct option options[] = {
     {"ip-opt",        2, 0, 'k'},
     {"md5sig",        0, 0, 'S'},
     #endif
+    #ifdef RAW_SUPPORT
+    {"raw-inject",    0, 0, 'R'},
+    #endif
     {"fake-data",     1, 0, 'l'},
     {"tls-sni",       1, 0, 'n'},
     #endif
@@ -293,6 +371,54 @@ int get_addr(const char *str, struct sockaddr_ina *addr)
 }
 
 
+// ip, ip:port or [ip6]:port
+int get_addr_port(const char *str, struct sockaddr_ina *addr, int port)
+{
+    char host[INET6_ADDRSTRLEN];
+    const char *end = 0, *ps = 0;
+    
+    if (*str == '[') {
+        str++;
+        if (!(end = strchr(str, ']'))) {
+            return -1;
+        }
+        if (end[1] == ':') {
+            ps = end + 2;
+        }
+        else if (end[1]) {
+            return -1;
+        }
+    }
+    else {
+        end = strchr(str, ':');
+        if (end && !strchr(end + 1, ':')) {
+            ps = end + 1;
+        }
+        else {
+            end = str + strlen(str);
+        }
+    }
+    if (end - str >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, str, end - str);
+    host[end - str] = 0;
+    
+    if (ps) {
+        char *e = 0;
+        port = strtol(ps, &e, 0);
+        if (port <= 0 || port > 0xffff || *e) {
+            return -1;
+        }
+    }
+    if (get_addr(host, addr) < 0) {
+        return -1;
+    }
+    addr->in.sin_port = htons(port);
+    return 0;
+}
+
+
 int get_default_ttl()
 {
     int orig_ttl = -1, fd;
@@ -311,6 +437,38 @@ int get_default_ttl()
 }
 
 
+#ifndef _WIN32
+void raise_nofile(void)
+{
+    long workers = params.workers ? 
+        params.workers : sysconf(_SC_NPROCESSORS_ONLN);
+    // two sockets per connection, plus two pipes with splice,
+    // plus socketpair end with tun
+    rlim_t need = ((params.splice ? 6 : 2) + (params.tun ? 1 : 0))
+        * (rlim_t )params.max_open;
+    need = (need + 16) * (workers > 0 ? workers : 1);
+    
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl)) {
+        uniperror("getrlimit");
+        return;
+    }
+    if (rl.rlim_cur >= need) {
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max < need ? rl.rlim_max : need;
+    if (setrlimit(RLIMIT_NOFILE, &rl)) {
+        uniperror("setrlimit");
+        return;
+    }
+    if (rl.rlim_cur < need) {
+        LOG(LOG_E, "open files limit is %lu, need %lu\n",
+            (unsigned long)rl.rlim_cur, (unsigned long)need);
+    }
+}
+#endif
+
+
 int parse_offset(struct part *part, const char *str)
 {
     char *end = 0;
@@ -333,6 +491,17 @@ int parse_offset(struct part *part, const char *str)
 }
 
 
+long parse_ms(const char *str)
+{
+    char *end = 0;
+    float f = strtof(str, &end);
+    if (*end || f < 0 || f > INT_MAX / 1000) {
+        return -1;
+    }
+    return (long)(f * 1000);
+}
+
+
 void *add(void **root, int *n, size_t ss)
 {
     char *p = realloc(*root, ss * (*n + 1));
@@ -348,6 +517,31 @@ void *add(void **root, int *n, size_t ss)
 }
 
 
+// render fake once, not for every connection
+int prepare_fake(struct desync_params *dp)
+{
+    if (!dp->fake_sni) {
+        dp->fake_tls = fake_tls;
+        return 0;
+    }
+    char *data = malloc(fake_tls.size);
+    if (!data) {
+        uniperror("malloc");
+        return -1;
+    }
+    memcpy(data, fake_tls.data, fake_tls.size);
+    
+    if (change_tls_sni(dp->fake_sni, data, fake_tls.size)) {
+        fprintf(stderr, "error chsni: %s\n", dp->fake_sni);
+        free(data);
+        return -1;
+    }
+    dp->fake_tls.data = data;
+    dp->fake_tls.size = fake_tls.size;
+    return 0;
+}
+
+
 void clear_params(void)
 {
     #ifdef _WIN32
@@ -357,6 +551,22 @@ void clear_params(void)
         mem_destroy(params.mempool);
         params.mempool = 0;
     }
+    if (params.hostpool) {
+        mem_destroy(params.hostpool);
+        params.hostpool = 0;
+    }
+    #ifdef SOCKMAP_SUPPORT
+    sockmap_close();
+    #endif
+    #ifdef RAW_SUPPORT
+    inject_close();
+    #endif
+    if (params.dns) {
+        free(params.dns);
+        params.dns = 0;
+        params.dns_count = 0;
+    }
+    dns_close();
     if (params.dp) {
         for (int i = 0; i < params.dp_count; i++) {
             struct desync_params s = params.dp[i];
@@ -376,6 +586,10 @@ void clear_params(void)
                 free(s.fake_data.data);
                 s.fake_data.data = 0;
             }
+            if (s.fake_tls.data != fake_tls.data) {
+                free(s.fake_tls.data);
+                s.fake_tls.data = 0;
+            }
             if (s.file_ptr != 0) {
                 free(s.file_ptr);
                 s.file_ptr = 0;
@@ -408,18 +622,20 @@ int main(int argc, char **argv)
         return 0;
     }
     #endif
-    int optc = sizeof(options)/sizeof(*options);
-    for (int i = 0, e = optc; i < e; i++)
-        optc += options[i].has_arg;
-        
+    int optc = 0;
+    for (int i = 0; options[i].name; i++) {
+        if (options[i].val < OPT_LONG)
+            optc += 1 + options[i].has_arg;
+    }
     char opt[optc + 1];
     opt[optc] = 0;
     
-    for (int i = 0, o = 0; o < optc; i++, o++) {
-        opt[o] = options[i].val;
+    for (int i = 0, o = 0; o < optc; i++) {
+        if (options[i].val >= OPT_LONG)
+            continue;
+        opt[o++] = options[i].val;
         for (int c = options[i].has_arg; c; c--) {
-            o++;
-            opt[o] = ':';
+            opt[o++] = ':';
         }
     }
 
@@ -445,6 +661,16 @@ int main(int argc, char **argv)
         case 'N':
             params.resolve = 0;
             break;
+        case 'D':;
+            struct sockaddr_in6 *ns = add((void *)&params.dns,
+                &params.dns_count, sizeof(*ns));
+            if (!ns) {
+                clear_params();
+                return -1;
+            }
+            if (get_addr_port(optarg, (struct sockaddr_ina *)ns, 53) < 0)
+                invalid = 1;
+            break;
         case 'X':
             params.ipv6 = 0;
             break;
@@ -489,13 +715,103 @@ int main(int argc, char **argv)
                 params.bfsize = val;
             break;
             
+        case 'B':
+            val = strtol(optarg, &end, 0);
+            if (val <= 0 || val > INT_MAX/4 || *end)
+                invalid = 1;
+            else
+                params.bflimit = val;
+            break;
+            
+        case 'Y':
+            val = parse_ms(optarg);
+            if (val < 0)
+                invalid = 1;
+            else
+                params.conn_timeout = val;
+            break;
+            
+        case 'y':
+            val = parse_ms(optarg);
+            if (val < 0)
+                invalid = 1;
+            else
+                params.idle_timeout = val;
+            break;
+            
         case 'c':
             val = strtol(optarg, &end, 0);
-            if (val <= 0 || val >= (0xffff/2) || *end) 
+            if (val <= 0 || val > 0xfffff || *end) 
                 invalid = 1;
             else
                 params.max_open = val;
             break;
+            
+        case 'q':
+            val = strtol(optarg, &end, 0);
+            if (val <= 0 || val > 0xfffff || *end) 
+                invalid = 1;
+            else
+                params.backlog = val;
+            break;
+            
+        case OPT_TFO_QUEUE:
+            val = strtol(optarg, &end, 0);
+            if (val < 0 || val > 0xfffff || *end) 
+                invalid = 1;
+            else
+                params.tfo_queue = val;
+            break;
+            
+        case OPT_DEFER_ACCEPT:
+            val = strtol(optarg, &end, 0);
+            if (val < 0 || val > INT_MAX || *end) 
+                invalid = 1;
+            else
+                params.defer_accept = val;
+            break;
+            
+        case 'G':
+            params.transparent = 1;
+            break;
+            
+        case 'Q':
+            val = strtol(optarg, &end, 0);
+            if (val < 0 || val > 0xffff || *end)
+                invalid = 1;
+            else {
+                params.nfqueue = val;
+                params.raw_inject = 1;
+            }
+            break;
+            
+        case 'L':
+            params.tun = optarg;
+            break;
+           
+        case 'J':
+            val = strtol(optarg, &end, 0);
+            if (val < 0 || val > 1024 || *end)
+                invalid = 1;
+            else
+                params.workers = val;
+            break;
+            
+        case 'C':
+            params.pin_cpu = 1;
+            break;
+            
+        case 'E':
+            params.edge = 1;
+            break;
+            
+        case 'Z':
+            params.splice = 1;
+            break;
+            
+        case 'O':
+            params.offload = 1;
+            break;
            
         case 'x': //
             params.debug = strtol(optarg, 0, 0);
@@ -557,17 +873,28 @@ int main(int argc, char **argv)
                 params.cache_ttl = val;
             break;
         
-        case 'T':;
-            #ifdef __linux__
-            float f = strtof(optarg, &end);
-            val = (long)(f * 1000);
-            #else
+        case 'z':
             val = strtol(optarg, &end, 0);
-            #endif
-            if (val <= 0 || val > UINT_MAX || *end)
+            if (val < 0 || val > RACE_MAX || *end) 
                 invalid = 1;
             else
-                params.timeout = val;
+                params.race = val;
+            break;
+        
+        case 'm':
+            params.adapt = 1;
+            break;
+        
+        case 'T':
+            val = parse_ms(optarg);
+            if (val <= 0)
+                invalid = 1;
+            else {
+                dp->timeout = val;
+                // first one is default for all groups
+                if (!params.timeout)
+                    params.timeout = val;
+            }
             break;
             
         case 'K':
@@ -664,13 +991,12 @@ int main(int argc, char **argv)
             dp->md5sig = 1;
             break;
             
+        case 'R':
+            params.raw_inject = 1;
+            break;
+            
         case 'n':
-            if (change_tls_sni(optarg, fake_tls.data, fake_tls.size)) {
-                fprintf(stderr, "error chsni\n");
-                clear_params();
-                return -1;
-            }
-            printf("sni: %s\n", optarg);
+            dp->fake_sni = optarg;
             break;
             
         case 'l':
@@ -795,6 +1121,15 @@ int main(int argc, char **argv)
             return -1;
         }
     }
+    if (invalid && rez >= OPT_LONG) {
+        const struct option *o = options;
+        while (o->name && o->val != rez) {
+            o++;
+        }
+        fprintf(stderr, "invalid value: --%s %s\n", o->name, optarg);
+        clear_params();
+        return -1;
+    }
     if (invalid) {
         fprintf(stderr, "invalid value: -%c %s\n", rez, optarg);
         clear_params();
@@ -809,9 +1144,33 @@ int main(int argc, char **argv)
         }
     }
     
+    const char *sni = 0;
+    for (int i = 0; i < params.dp_count && !sni; i++) {
+        sni = params.dp[i].fake_sni;
+    }
+    for (int i = 0; i < params.dp_count; i++) {
+        dp = &params.dp[i];
+        if (!dp->timeout)
+            dp->timeout = params.timeout;
+        if (!dp->fake_sni)
+            dp->fake_sni = sni;
+        if (prepare_fake(dp)) {
+            clear_params();
+            return -1;
+        }
+    }
     if (params.baddr.sin6_family != AF_INET6) {
         params.ipv6 = 0;
     }
+    if (params.defer_accept < 0) {
+        params.defer_accept = params.conn_timeout / 1000;
+    }
+    #ifdef __linux__
+    // inherited descriptor has one queue, flows can't be split by workers
+    if (params.tun && !params.tun[strspn(params.tun, "0123456789")]) {
+        params.workers = 1;
+    }
+    #endif
     if (!params.def_ttl) {
         if ((params.def_ttl = get_default_ttl()) < 1) {
             clear_params();
@@ -819,11 +1178,35 @@ int main(int argc, char **argv)
         }
     }
     params.mempool = mem_pool(0);
-    if (!params.mempool) {
+    params.hostpool = mem_pool(0);
+    if (!params.mempool || !params.hostpool) {
         uniperror("mem_pool");
         clear_params();
         return -1;
     }
+    #ifndef _WIN32
+    raise_nofile();
+    #endif
+    #ifdef SOCKMAP_SUPPORT
+    if (params.offload) {
+        long workers = params.workers ? 
+            params.workers : sysconf(_SC_NPROCESSORS_ONLN);
+        if (sockmap_init(params.max_open * 2 * (workers > 0 ? workers : 1))) {
+            clear_params();
+            return -1;
+        }
+    }
+    #endif
+    #ifdef RAW_SUPPORT
+    if (params.raw_inject && inject_init()) {
+        clear_params();
+        return -1;
+    }
+    #endif
+    if (params.dns_count && dns_init()) {
+        clear_params();
+        return -1;
+    }
     int status = run((struct sockaddr_ina *)&params.laddr);
     clear_params();
     return status;
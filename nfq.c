@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+
+#include "nfq.h"
+
+#ifdef NFQ_SUPPORT
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+
+#include "proxy.h"
+#include "extend.h"
+#include "params.h"
+#include "packets.h"
+#include "desync.h"
+#include "inject.h"
+#include "error.h"
+
+// whole packet and netlink headers
+#define NFQ_BUFSIZE (0xffff + 4096)
+
+struct nfq_flow {
+    struct sockaddr_ina src;
+    struct sockaddr_ina dst;
+    uint64_t time;
+    int m;
+    char done;
+};
+
+static struct nfq_flow *flows;
+
+static uint16_t queue_num;
+
+
+static struct nlattr *nla_put(struct nlmsghdr *nh,
+        int type, const void *data, size_t len)
+{
+    struct nlattr *a = (struct nlattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+    a->nla_type = type;
+    a->nla_len = NLA_HDRLEN + len;
+    memcpy((char *)a + NLA_HDRLEN, data, len);
+    
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + NLA_ALIGN(a->nla_len);
+    return a;
+}
+
+
+static struct nlmsghdr *nfq_hdr(char *buf, int type, int flags)
+{
+    struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+    nh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nh->nlmsg_seq = 0;
+    nh->nlmsg_pid = 0;
+    
+    struct nfgenmsg *g = NLMSG_DATA(nh);
+    g->nfgen_family = AF_UNSPEC;
+    g->version = NFNETLINK_V0;
+    g->res_id = htons(queue_num);
+    return nh;
+}
+
+
+static int nfq_config(int fd, struct nlmsghdr *nh)
+{
+    if (send(fd, nh, nh->nlmsg_len, 0) < 0) {
+        uniperror("send nfqueue");
+        return -1;
+    }
+    char buf[256];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        uniperror("recv nfqueue");
+        return -1;
+    }
+    struct nlmsghdr *rh = (struct nlmsghdr *)buf;
+    if (n < NLMSG_LENGTH(sizeof(struct nlmsgerr))
+            || rh->nlmsg_type != NLMSG_ERROR) {
+        return 0;
+    }
+    struct nlmsgerr *e = NLMSG_DATA(rh);
+    if (e->error) {
+        errno = -e->error;
+        uniperror("nfqueue config");
+        return -1;
+    }
+    return 0;
+}
+
+
+static int nfq_open(int num)
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if (fd < 0) {
+        uniperror("socket netlink");
+        return -1;
+    }
+    queue_num = num;
+    
+    char buf[256] = { 0 };
+    struct nlmsghdr *nh = nfq_hdr(buf, NFQNL_MSG_CONFIG, NLM_F_ACK);
+    struct nfqnl_msg_config_cmd cmd = {
+        .command = NFQNL_CFG_CMD_BIND
+    };
+    nla_put(nh, NFQA_CFG_CMD, &cmd, sizeof(cmd));
+    
+    if (nfq_config(fd, nh)) {
+        close(fd);
+        return -1;
+    }
+    nh = nfq_hdr(buf, NFQNL_MSG_CONFIG, NLM_F_ACK);
+    struct nfqnl_msg_config_params cp = {
+        .copy_range = htonl(0xffff),
+        .copy_mode = NFQNL_COPY_PACKET
+    };
+    nla_put(nh, NFQA_CFG_PARAMS, &cp, sizeof(cp));
+    
+    // packets go on without desync, when queue is full
+    uint32_t flags = htonl(NFQA_CFG_F_FAIL_OPEN);
+    nla_put(nh, NFQA_CFG_FLAGS, &flags, sizeof(flags));
+    nla_put(nh, NFQA_CFG_MASK, &flags, sizeof(flags));
+    
+    if (nfq_config(fd, nh)) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_NETLINK,
+            NETLINK_NO_ENOBUFS, &one, sizeof(one))) {
+        uniperror("setsockopt NETLINK_NO_ENOBUFS");
+    }
+    return fd;
+}
+
+
+static int nfq_verdict(int fd, uint32_t id, int verdict)
+{
+    char buf[64] = { 0 };
+    struct nlmsghdr *nh = nfq_hdr(buf, NFQNL_MSG_VERDICT, 0);
+    struct nfqnl_msg_verdict_hdr vh = {
+        .verdict = htonl(verdict),
+        .id = id
+    };
+    nla_put(nh, NFQA_VERDICT_HDR, &vh, sizeof(vh));
+    
+    if (send(fd, nh, nh->nlmsg_len, 0) < 0) {
+        uniperror("send verdict");
+        return -1;
+    }
+    return 0;
+}
+
+
+static struct nfq_flow *flow_slot(
+        struct sockaddr_ina *a, struct sockaddr_ina *b)
+{
+    // same slot for both directions
+    uint32_t h = 2166136261u;
+    const uint8_t *pa = (uint8_t *)a, *pb = (uint8_t *)b;
+    
+    for (size_t i = 0; i < sizeof(*a); i++) {
+        h = (h ^ (pa[i] ^ pb[i])) * 16777619u;
+    }
+    return &flows[h % NFQ_FLOWS];
+}
+
+
+// next group, which detects failure of current one
+static int next_group(int m, char torst, char *resp, ssize_t sn)
+{
+    for (m++; m < params.dp_count; m++) {
+        struct desync_params *dp = &params.dp[m];
+        if (!dp->detect) {
+            return -1;
+        }
+        if (torst) {
+            if (dp->detect & DETECT_TORST) {
+                return m;
+            }
+            continue;
+        }
+        // redirect and session id need request, which is not kept
+        if ((dp->detect & DETECT_TLS_ALERT)
+                && is_tls_alert(resp, sn)) {
+            return m;
+        }
+        if (dp->detect & DETECT_HTTP_CLERR) {
+            int code = get_http_code(resp, sn);
+            if (code > 400 && code < 451 && code != 429) {
+                return m;
+            }
+        }
+    }
+    return torst ? params.dp_count : -1;
+}
+
+
+// response of desynced flow, result is for next connections
+static void on_reply(struct poolhd *pool, struct nfq_flow *f,
+        struct tcphdr *tcp, char *data, ssize_t n)
+{
+    char torst = tcp->rst;
+    if (!torst && !n) {
+        return;
+    }
+    f->done = 1;
+    
+    int m = next_group(f->m, torst, data, n);
+    if (m < 0) {
+        return;
+    }
+    INIT_ADDR_STR(f->dst);
+    if (m >= params.dp_count) {
+        LOG(LOG_S, "delete ip: %s\n", ADDR_STR);
+        mode_add_get(pool, &f->dst, 0);
+        return;
+    }
+    LOG(LOG_S, "save ip: %s, m=%d\n", ADDR_STR, m);
+    mode_add_get(pool, &f->dst, m);
+}
+
+
+// first payload of flow
+static int on_request_pkt(struct poolhd *pool, struct inject_pkt *p,
+        struct nfq_flow *f, struct sockaddr_ina *src, 
+        struct sockaddr_ina *dst, char *data, ssize_t n)
+{
+    memset(f, 0, sizeof(*f));
+    f->src = *src;
+    f->dst = *dst;
+    f->time = pool->tw.now;
+    
+    int m = mode_add_get(pool, &f->dst, -1);
+    if (m <= 0) {
+        m = desync_select(data, n, &f->dst.in6);
+    }
+    if (m >= params.dp_count) {
+        f->done = 1;
+        return NF_ACCEPT;
+    }
+    f->m = m;
+    
+    if (params.debug) {
+        INIT_ADDR_STR(f->dst);
+        LOG(LOG_S, "new flow: addr=%s:%d, m=%d\n",
+            ADDR_STR, ntohs(f->dst.in.sin_port), m);
+    }
+    if (!(p->out = buff_get(pool))) {
+        uniperror("buff_get");
+        return NF_ACCEPT;
+    }
+    p->out_size = pool->bsize;
+    
+    int s = desync_pkt(p, data, n, m);
+    buff_put(pool, p->out);
+    return s ? NF_ACCEPT : NF_DROP;
+}
+
+
+static int on_packet(struct poolhd *pool, char *pkt, size_t len)
+{
+    struct inject_pkt p = { .data = pkt };
+    struct sockaddr_ina src = { 0 }, dst = { 0 };
+    size_t plen;
+    
+    if (len >= sizeof(struct iphdr) && (*pkt >> 4) == 4) {
+        struct iphdr *ip = (struct iphdr *)pkt;
+        if (ip->protocol != IPPROTO_TCP
+                || (ntohs(ip->frag_off) & (IP_MF | IP_OFFMASK))) {
+            return NF_ACCEPT;
+        }
+        p.family = AF_INET;
+        p.iplen = ip->ihl * 4;
+        plen = ntohs(ip->tot_len);
+        
+        src.in.sin_addr.s_addr = ip->saddr;
+        dst.in.sin_addr.s_addr = ip->daddr;
+    }
+    else if (len >= sizeof(struct ip6_hdr) && (*pkt >> 4) == 6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)pkt;
+        // extension headers are not parsed
+        if (ip6->ip6_nxt != IPPROTO_TCP) {
+            return NF_ACCEPT;
+        }
+        p.family = AF_INET6;
+        p.iplen = sizeof(*ip6);
+        plen = p.iplen + ntohs(ip6->ip6_plen);
+        
+        src.in6.sin6_addr = ip6->ip6_src;
+        dst.in6.sin6_addr = ip6->ip6_dst;
+    }
+    else {
+        return NF_ACCEPT;
+    }
+    if (plen > len || plen < p.iplen + sizeof(struct tcphdr)) {
+        return NF_ACCEPT;
+    }
+    struct tcphdr *tcp = (struct tcphdr *)(pkt + p.iplen);
+    p.tcplen = tcp->doff * 4;
+    
+    if (p.tcplen < sizeof(*tcp) || p.iplen + p.tcplen > plen) {
+        return NF_ACCEPT;
+    }
+    char *data = pkt + p.iplen + p.tcplen;
+    ssize_t n = plen - p.iplen - p.tcplen;
+    
+    src.sa.sa_family = dst.sa.sa_family = p.family;
+    src.in.sin_port = tcp->source;
+    dst.in.sin_port = tcp->dest;
+    
+    struct nfq_flow *f = flow_slot(&src, &dst);
+    char fresh = f->time
+        && pool->tw.now - f->time < NFQ_FLOW_TTL * 1000;
+    
+    if (fresh && !memcmp(&f->src, &dst, sizeof(dst))
+            && !memcmp(&f->dst, &src, sizeof(src))) {
+        if (!f->done) {
+            on_reply(pool, f, tcp, data, n);
+        }
+        return NF_ACCEPT;
+    }
+    // retransmitted or next segments pass as is
+    if (!n || tcp->syn || tcp->rst || (fresh
+            && !memcmp(&f->src, &src, sizeof(src))
+            && !memcmp(&f->dst, &dst, sizeof(dst)))) {
+        return NF_ACCEPT;
+    }
+    return on_request_pkt(pool, &p, f, &src, &dst, data, n);
+}
+
+
+static int on_nfqueue(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize)
+{
+    while (1) {
+        ssize_t n = recv(val->fd, buffer, bfsize, 0);
+        if (n < 0) {
+            if (get_e() == EAGAIN || get_e() == ENOBUFS) {
+                val->ready &= ~POLLIN;
+                return 0;
+            }
+            uniperror("recv nfqueue");
+            return -1;
+        }
+        struct nlmsghdr *nh = (struct nlmsghdr *)buffer;
+        
+        for (; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type !=
+                    ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET)) {
+                continue;
+            }
+            struct nfqnl_msg_packet_hdr *ph = 0;
+            char *pkt = 0;
+            size_t len = 0;
+            
+            struct nlattr *a = (struct nlattr *)((char *)NLMSG_DATA(nh)
+                + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+            int left = (char *)nh + nh->nlmsg_len - (char *)a;
+            
+            for (; left >= NLA_HDRLEN && a->nla_len >= NLA_HDRLEN
+                    && a->nla_len <= left;
+                    left -= NLA_ALIGN(a->nla_len),
+                    a = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len))) {
+                switch (a->nla_type & NLA_TYPE_MASK) {
+                    case NFQA_PACKET_HDR:
+                        ph = (struct nfqnl_msg_packet_hdr *)((char *)a + NLA_HDRLEN);
+                        break;
+                    case NFQA_PAYLOAD:
+                        pkt = (char *)a + NLA_HDRLEN;
+                        len = a->nla_len - NLA_HDRLEN;
+                        break;
+                }
+            }
+            if (!ph) {
+                continue;
+            }
+            int verdict = pkt ? on_packet(pool, pkt, len) : NF_ACCEPT;
+            
+            if (nfq_verdict(val->fd, ph->packet_id, verdict)) {
+                return -1;
+            }
+        }
+    }
+}
+
+
+int nfq_run(int num)
+{
+    if (inject_mark(NFQ_MARK)) {
+        return -1;
+    }
+    flows = calloc(NFQ_FLOWS, sizeof(*flows));
+    if (!flows) {
+        uniperror("calloc");
+        return -1;
+    }
+    int fd = nfq_open(num);
+    if (fd < 0) {
+        free(flows);
+        return -1;
+    }
+    struct poolhd *pool = init_pool(1, 0, params.bfsize);
+    if (!pool) {
+        uniperror("init pool");
+        close(fd);
+        free(flows);
+        return -1;
+    }
+    char *buffer = malloc(NFQ_BUFSIZE);
+    struct eval *val = 0;
+    int ret = -1;
+    
+    if (!buffer || fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+            || !(val = add_event(pool, EV_NFQUEUE, fd, POLLIN))) {
+        uniperror("nfqueue init");
+        close(fd);
+    }
+    else {
+        LOG(LOG_S, "nfqueue: %d\n", num);
+        ret = 0;
+    }
+    int i = -1, etype;
+    
+    while (val && NOT_EXIT) {
+        struct eval *ev = next_event(pool, &i, &etype);
+        if (!ev) {
+            if (get_e() == EINTR)
+                continue;
+            uniperror("(e)poll");
+            ret = -1;
+            break;
+        }
+        if (on_nfqueue(pool, ev, buffer, NFQ_BUFSIZE)) {
+            ret = -1;
+            break;
+        }
+    }
+    free(buffer);
+    destroy_pool(pool);
+    free(flows);
+    flows = 0;
+    return ret;
+}
+#endif
@@ -0,0 +1,14 @@
+#ifdef __linux__
+#define NFQ_SUPPORT 1
+
+// set on injected packets, must be excluded from queue rules
+#define NFQ_MARK 0x40000000
+
+// flows tracked by engine, slot is chosen by hash of addresses
+#define NFQ_FLOWS 4096
+
+// seconds, after which slot can be reused
+#define NFQ_FLOW_TTL 60
+
+int nfq_run(int num);
+#endif
@@ -11,7 +11,10 @@
 
 #if defined(__linux__) || defined(_WIN32)
 #define FAKE_SUPPORT 1
-#define TIMEOUT_SUPPORT 1
+#endif
+
+#ifdef __linux__
+#define WORKERS_SUPPORT 1
 #endif
     
 #define OFFSET_SNI 1
@@ -23,6 +26,9 @@
 #define DETECT_TLS_ALERT 8
 #define DETECT_TORST 16
 
+// groups raced at once, see trial_start
+#define RACE_MAX 8
+
 enum demode {
     DESYNC_NONE,
     DESYNC_SPLIT,
@@ -58,6 +64,8 @@ struct desync_params {
     ssize_t ip_options_len;
     char md5sig;
     struct packet fake_data;
+    struct packet fake_tls;
+    const char *fake_sni;
     int udp_fake_count;
     
     int parts_n;
@@ -69,11 +77,17 @@ struct desync_params {
     
     int proto;
     int detect;
+    unsigned int timeout;
     struct mphdr *hosts;
     uint16_t pf[2];
     
     char *file_ptr;
     ssize_t file_size;
+    
+    // outcomes of first requests, see group_stat
+    unsigned int ok;
+    unsigned int fail;
+    unsigned int lat;
 };
 
 struct params {
@@ -86,16 +100,38 @@ struct params {
     
     char tfo;
     unsigned int timeout;
+    unsigned int conn_timeout;
+    unsigned int idle_timeout;
     long cache_ttl;
+    int race;
+    char adapt;
     char ipv6;
     char resolve;
+    int dns_count;
+    struct sockaddr_in6 *dns;
     char udp;
     int max_open;
+    int backlog;
+    int tfo_queue;
+    // sec, TCP_DEFER_ACCEPT
+    int defer_accept;
+    char transparent;
+    int nfqueue;
+    char *tun;
+    int workers;
+    char pin_cpu;
+    char edge;
+    char splice;
+    char offload;
+    char raw_inject;
     int debug;
     size_t bfsize;
+    size_t bflimit;
     struct sockaddr_in6 baddr;
     struct sockaddr_in6 laddr;
     struct mphdr *mempool;
+    // same for host of request, see host_add_get
+    struct mphdr *hostpool;
     
     char *protect_path;
 };
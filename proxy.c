@@ -12,6 +12,10 @@
 #include "params.h"
 #include "conev.h"
 #include "extend.h"
+#include "sockmap.h"
+#include "dns.h"
+#include "nfq.h"
+#include "tun.h"
 #include "error.h"
 
 #ifdef _WIN32
@@ -28,10 +32,64 @@
     #include <arpa/inet.h>
     #include <netinet/tcp.h>
     #include <netdb.h>
+    
+    #ifdef SPLICE_SUPPORT
+    #include <fcntl.h>
+    #endif
+    
+    #ifdef SOCKMAP_SUPPORT
+    #include <sys/ioctl.h>
+    #endif
+    
+    #ifdef WORKERS_SUPPORT
+    #include <pthread.h>
+    #include <sched.h>
+    #include <time.h>
+    #endif
+#endif
+
+
+#ifdef __linux__
+    // linux/netfilter_ipv4.h, linux/netfilter_ipv6/ip6_tables.h
+    #ifndef SO_ORIGINAL_DST
+    #define SO_ORIGINAL_DST 80
+    #endif
+    #ifndef IP6T_SO_ORIGINAL_DST
+    #define IP6T_SO_ORIGINAL_DST 80
+    #endif
 #endif
 
+// RFC 8305 connection attempt delay, ms
+#define RACE_DELAY 250
+
+// addresses left after first attempt
+struct race {
+    int n;
+    int next;
+    int pending;
+    // waiting for protect, see conn_start
+    int queued;
+    int type;
+    struct eval *att[DST_MAX];
+    struct sockaddr_ina addrs[DST_MAX];
+};
+
+// configured sockets, taken by conn_start
+#define STOCK_SIZE 32
+
+// protect requests of refill, which are ahead of connections
+#define STOCK_BATCH 4
+
+struct stock {
+    // listener, its timer starts refill
+    struct eval *ev;
+    int count;
+    int queued;
+    int fds[STOCK_SIZE];
+};
     
-int NOT_EXIT = 1;
+// set by signal handlers and main thread, polled by every worker loop
+volatile sig_atomic_t NOT_EXIT = 1;
 
 static void on_cancel(int sig) {
     NOT_EXIT = 0;
@@ -78,7 +136,7 @@ static inline char addr_equ(
 }
 
 
-static inline int nb_socket(int domain, int type)
+int nb_socket(int domain, int type)
 {
     #ifdef __linux__
     int fd = socket(domain, type | SOCK_NONBLOCK, 0);
@@ -109,10 +167,19 @@ static inline int nb_socket(int domain, int type)
 }
 
 
-int resolve(char *host, int len, 
-        struct sockaddr_ina *addr, int type) 
+// count of addresses, 0 - query is sent, request waits for on_resolved
+static int resolve(struct poolhd *pool, struct eval *val,
+        char *host, int len, struct sockaddr_ina *addrs, int type) 
 {
+    uint32_t key = dns_key(host, len);
+    if (val) {
+        val->cold->host = key;
+    }
+    if (pool->dns) {
+        return dns_resolve(pool, val, host, len, addrs, type);
+    }
     struct addrinfo hints = {0}, *res = 0;
+    uint16_t port = addrs->in.sin_port;
     
     hints.ai_socktype = type;
     hints.ai_flags = AI_ADDRCONFIG;
@@ -125,24 +192,36 @@ int resolve(char *host, int len,
         host[len] = rchar;
         return -1;
     }
-    if (res->ai_addr->sa_family == AF_INET6)
-        addr->in6 = *(struct sockaddr_in6 *)res->ai_addr;
-    else
-        addr->in = *(struct sockaddr_in *)res->ai_addr;
+    host[len] = rchar;
+    int n = 0;
+    
+    for (struct addrinfo *r = res; r && n < DST_MAX; r = r->ai_next) {
+        if (r->ai_addr->sa_family == AF_INET6)
+            addrs[n].in6 = *(struct sockaddr_in6 *)r->ai_addr;
+        else if (r->ai_addr->sa_family == AF_INET)
+            addrs[n].in = *(struct sockaddr_in *)r->ai_addr;
+        else 
+            continue;
+        addrs[n++].in.sin_port = port;
+    }
     freeaddrinfo(res);
     
-    host[len] = rchar;
-    return 0;
+    if (n) {
+        dns_order(addrs, n, key);
+    }
+    return n ? n : -1;
 }
 
 
+// size of greeting, request may follow it
 int auth_socks5(int fd, char *buffer, ssize_t n)
 {
-    if (n <= 2 || (uint8_t)buffer[1] != (n - 2)) {
+    if (n <= 2 || (uint8_t)buffer[1] > (n - 2)) {
         return -1;
     }
+    int o = (uint8_t)buffer[1] + 2;
     uint8_t c = S_AUTH_BAD;
-    for (long i = 2; i < n; i++)
+    for (long i = 2; i < o; i++)
         if (buffer[i] == S_AUTH_NONE) {
             c = S_AUTH_NONE;
             break;
@@ -152,7 +231,7 @@ int auth_socks5(int fd, char *buffer, ssize_t n)
         uniperror("send");
         return -1;
     }
-    return c != S_AUTH_BAD ? 0 : -1;
+    return c != S_AUTH_BAD ? o : -1;
 }
 
 
@@ -196,8 +275,9 @@ int resp_error(int fd, int e, int flag)
 }
 
 
-int s4_get_addr(char *buff, size_t n,
-        struct sockaddr_ina *dst)
+// size of request, cnt - 0 if query is sent
+int s4_get_addr(struct poolhd *pool, struct eval *val,
+        char *buff, size_t n, struct sockaddr_ina *dst, int *cnt)
 {
     if (n < sizeof(struct s4_req) + 1) {
         return -1;
@@ -207,34 +287,52 @@ int s4_get_addr(char *buff, size_t n,
     if (r->cmd != S_CMD_CONN) {
         return -1;
     }
+    dst->in.sin_port = r->port;
+    
+    char *id_end = memchr(buff + sizeof(*r), 0, n - sizeof(*r));
+    if (!id_end) {
+        return -1;
+    }
+    *cnt = 1;
+    
     if (ntohl(r->i4.s_addr) <= 255) {
-        if (!params.resolve || buff[n - 1] != 0) {
-            return -1;
-        }
-        char *id_end = strchr(buff + sizeof(*r), 0);
-        if (!id_end) {
+        char *host = id_end + 1;
+        char *host_end = memchr(host, 0, buff + n - host);
+        if (!params.resolve || !host_end) {
             return -1;
         }
-        int len = (buff + n - id_end) - 2;
+        int len = host_end - host;
         if (len < 3 || len > 255) {
             return -1;
         }
-        if (resolve(id_end + 1, len, dst, SOCK_STREAM)) {
-            LOG(LOG_E, "not resolved: %.*s\n", len, id_end + 1);
+        int rs = resolve(pool, val, host, len, dst, SOCK_STREAM);
+        if (rs < 0) {
+            LOG(LOG_E, "not resolved: %.*s\n", len, host);
             return -1;
         }
+        *cnt = rs;
+        return host_end + 1 - buff;
     }
     else {
         dst->in.sin_family = AF_INET;
         dst->in.sin_addr = r->i4;
     }
-    dst->in.sin_port = r->port;
-    return 0;
+    return id_end + 1 - buff;
+}
+
+
+// size of request, cnt - 0 if query is sent
+// 0 - unknown address type
+static inline size_t s5_req_size(struct s5_req *r)
+{
+    return (r->atp == S_ATP_I4 ? S_SIZE_I4 : 
+            (r->atp == S_ATP_ID ? r->id.len + S_SIZE_ID : 
+            (r->atp == S_ATP_I6 ? S_SIZE_I6 : 0)));
 }
 
 
-int s5_get_addr(char *buffer, size_t n,
-        struct sockaddr_ina *addr, int type) 
+int s5_get_addr(struct poolhd *pool, struct eval *val, char *buffer,
+        size_t n, struct sockaddr_ina *addr, int *cnt, int type) 
 {
     if (n < S_SIZE_MIN) {
         LOG(LOG_E, "ss: request to small\n");
@@ -242,13 +340,14 @@ int s5_get_addr(char *buffer, size_t n,
     }
     struct s5_req *r = (struct s5_req *)buffer;
     
-    size_t o = (r->atp == S_ATP_I4 ? S_SIZE_I4 : 
-            (r->atp == S_ATP_ID ? r->id.len + S_SIZE_ID : 
-            (r->atp == S_ATP_I6 ? S_SIZE_I6 : 0)));
+    size_t o = s5_req_size(r);
     if (n < o)  {
         LOG(LOG_E, "ss: bad request\n");
         return -S_ER_GEN;
     }
+    memcpy(&addr->in.sin_port, &buffer[o - 2], sizeof(uint16_t));
+    *cnt = 1;
+    
     switch (r->atp) {
         case S_ATP_I4:
             addr->in.sin_family = AF_INET;
@@ -259,11 +358,13 @@ int s5_get_addr(char *buffer, size_t n,
             if (!params.resolve) {
                 return -S_ER_ATP;
             }
-            if (r->id.len < 3 || 
-                    resolve(r->id.domain, r->id.len, addr, type)) {
+            int rs = r->id.len < 3 ? -1 :
+                resolve(pool, val, r->id.domain, r->id.len, addr, type);
+            if (rs < 0) {
                 LOG(LOG_E, "not resolved: %.*s\n", r->id.len, r->id.domain);
                 return -S_ER_HOST;
             }
+            *cnt = rs;
             break;
         
         case S_ATP_I6:
@@ -274,7 +375,6 @@ int s5_get_addr(char *buffer, size_t n,
                 addr->in6.sin6_addr = r->i6;
             }
     }
-    memcpy(&addr->in.sin_port, &buffer[o - 2], sizeof(uint16_t));
     return o;
 }
 
@@ -310,31 +410,32 @@ int s5_set_addr(char *buffer, size_t n,
 }
 
 
-int create_conn(struct poolhd *pool,
-        struct eval *val, struct sockaddr_ina *dst, int next)
+static int conn_addr(struct sockaddr_ina *dst, struct sockaddr_ina *addr)
 {
-    struct sockaddr_ina addr = *dst;
+    *addr = *dst;
     
     if (params.baddr.sin6_family == AF_INET6) {
-        map_fix(&addr, 6);
+        map_fix(addr, 6);
     } else {
-        map_fix(&addr, 0);
+        map_fix(addr, 0);
     }
-    if (addr.sa.sa_family != params.baddr.sin6_family) {
+    if (addr->sa.sa_family != params.baddr.sin6_family) {
         LOG(LOG_E, "different addresses family\n");
         return -1;
     }
-    int sfd = nb_socket(addr.sa.sa_family, SOCK_STREAM);
+    return 0;
+}
+
+
+// bound and configured, but not connected
+static int conn_socket(int family)
+{
+    int sfd = nb_socket(family, SOCK_STREAM);
     if (sfd < 0) {
         uniperror("socket");  
         return -1;
     }
-    if (params.protect_path 
-            && protect(sfd, params.protect_path) < 0) {
-        close(sfd);
-        return -1;
-    }
-    if (addr.sa.sa_family == AF_INET6) {
+    if (family == AF_INET6) {
         int no = 0;
         if (setsockopt(sfd, IPPROTO_IPV6,
                 IPV6_V6ONLY, (char *)&no, sizeof(no))) {
@@ -374,6 +475,20 @@ int create_conn(struct poolhd *pool,
         close(sfd);
         return -1;
     }
+    return sfd;
+}
+
+
+// socket is closed on failure
+static struct eval *conn_add(struct poolhd *pool,
+        struct eval *val, int sfd, struct sockaddr_ina *dst, int next)
+{
+    struct sockaddr_ina addr;
+    
+    if (conn_addr(dst, &addr)) {
+        close(sfd);
+        return 0;
+    }
     int status = connect(sfd, &addr.sa, sizeof(addr));
     if (status == 0 && params.tfo) {
         LOG(LOG_S, "TFO supported!\n");
@@ -382,59 +497,253 @@ int create_conn(struct poolhd *pool,
             get_e() != EINPROGRESS && get_e() != EAGAIN) {
         uniperror("connect");
         close(sfd);
-        return -1;
+        return 0;
     }
     struct eval *pair = add_event(pool, next, sfd, POLLOUT);
     if (!pair) {
         close(sfd);
-        return -1;
+        return 0;
     }
-    val->pair = pair;
     pair->pair = val;
-    pair->in6 = dst->in6;
+    pair->cold->in6 = dst->in6;
     pair->flag = FLAG_CONN;
-    val->type = EV_IGNORE;
     
     if (params.debug) {
         INIT_ADDR_STR((*dst));
         LOG(LOG_S, "new conn: fd=%d, addr=%s:%d\n", 
-            val->pair->fd, ADDR_STR, ntohs(dst->in.sin_port));
+            pair->fd, ADDR_STR, ntohs(dst->in.sin_port));
     }
-    return 0;
+    return pair;
 }
 
 
-int udp_associate(struct poolhd *pool, 
-        struct eval *val, struct sockaddr_ina *dst)
+static void stock_fill(struct poolhd *pool)
 {
-    struct sockaddr_ina addr = *dst;
+    struct stock *s = pool->stock;
+    struct sockaddr_ina none = { 0 };
     
-    int ufd = nb_socket(params.baddr.sin6_family, SOCK_DGRAM);
-    if (ufd < 0) {
-        uniperror("socket");  
-        return -1;
+    while (s->count + s->queued < STOCK_SIZE) {
+        #ifdef __linux__
+        // connections waiting for peer go first
+        if (params.protect_path && (s->queued >= STOCK_BATCH
+                || (pool->prot && pool->prot->count > s->queued))) {
+            return;
+        }
+        #endif
+        int sfd = conn_socket(params.baddr.sin6_family);
+        if (sfd < 0) {
+            return;
+        }
+        #ifdef __linux__
+        if (params.protect_path) {
+            if (protect_queue(pool, s->ev, sfd, &none, EV_ACCEPT)) {
+                close(sfd);
+                return;
+            }
+            s->queued++;
+            continue;
+        }
+        #endif
+        s->fds[s->count++] = sfd;
     }
-    if (params.protect_path 
-            && protect(ufd, params.protect_path) < 0) {
-        close(ufd);
+}
+
+
+// refill is started on first use, outside of request path
+static int stock_get(struct poolhd *pool)
+{
+    struct stock *s = pool->stock;
+    
+    if (s->count + s->queued <= STOCK_SIZE / 2) {
+        set_timer(pool, s->ev, 1);
+    }
+    return s->count ? s->fds[--s->count] : -1;
+}
+
+
+// 0 - started, 1 - socket waits for protect, see on_protected
+static int conn_start(struct poolhd *pool, struct eval *val,
+        struct sockaddr_ina *dst, int next, struct eval **pair)
+{
+    struct sockaddr_ina addr;
+    
+    if (conn_addr(dst, &addr)) {
         return -1;
     }
-    if (params.baddr.sin6_family == AF_INET6) {
-        int no = 0;
-        if (setsockopt(ufd, IPPROTO_IPV6,
-                IPV6_V6ONLY, (char *)&no, sizeof(no))) {
-            uniperror("setsockopt IPV6_V6ONLY");
-            close(ufd);
+    int sfd = stock_get(pool);
+    if (sfd < 0) {
+        sfd = conn_socket(addr.sa.sa_family);
+        if (sfd < 0) {
             return -1;
         }
-        map_fix(&addr, 6);
+        #ifdef __linux__
+        if (params.protect_path) {
+            if (protect_queue(pool, val, sfd, dst, next)) {
+                close(sfd);
+                return -1;
+            }
+            return 1;
+        }
+        #endif
     }
-    if (bind(ufd, (struct sockaddr *)&params.baddr, 
-            sizeof(params.baddr)) < 0) {
-        uniperror("bind");  
-        close(ufd);
+    *pair = conn_add(pool, val, sfd, dst, next);
+    return *pair ? 0 : -1;
+}
+
+
+// next address is tried after delay or on failure, see race_next
+int create_conn(struct poolhd *pool,
+        struct eval *val, struct sockaddr_ina *dst, int n, int next)
+{
+    struct eval *pair = 0;
+    int i = 0, st = -1;
+    
+    while (i < n && st < 0) {
+        st = conn_start(pool, val, &dst[i++], next, &pair);
+    }
+    if (st < 0) {
+        return -1;
+    }
+    val->pair = pair;
+    val->type = EV_IGNORE;
+    set_timer(pool, val, params.conn_timeout);
+    
+    if (i >= n) {
+        return 0;
+    }
+    struct race *r = malloc(sizeof(*r));
+    if (!r) {
+        uniperror("malloc");
         return -1;
     }
+    r->n = n - i;
+    r->next = 0;
+    r->type = next;
+    r->pending = pair ? 1 : 0;
+    r->queued = st;
+    r->att[0] = pair;
+    memcpy(r->addrs, dst + i, sizeof(*dst) * r->n);
+    
+    val->cold->race = r;
+    if (pair) {
+        set_timer(pool, pair, RACE_DELAY);
+    }
+    return 0;
+}
+
+
+// one more connection of val besides its pair, see trial_start
+// socket is taken only if it doesn't have to wait for protect
+struct eval *conn_extra(struct poolhd *pool,
+        struct eval *val, struct sockaddr_ina *dst, int next)
+{
+    struct sockaddr_ina addr;
+    
+    if (conn_addr(dst, &addr)) {
+        return 0;
+    }
+    int sfd = stock_get(pool);
+    if (sfd < 0) {
+        #ifdef __linux__
+        if (params.protect_path) {
+            return 0;
+        }
+        #endif
+        sfd = conn_socket(addr.sa.sa_family);
+        if (sfd < 0) {
+            return 0;
+        }
+    }
+    return conn_add(pool, val, sfd, dst, next);
+}
+
+
+static int race_next(struct poolhd *pool, struct eval *client)
+{
+    struct race *r = client->cold->race;
+    
+    while (r->next < r->n) {
+        struct eval *pair = 0;
+        int st = conn_start(pool, 
+            client, &r->addrs[r->next++], r->type, &pair);
+        if (st < 0) {
+            continue;
+        }
+        if (st) {
+            r->queued++;
+            return 0;
+        }
+        r->att[r->pending++] = pair;
+        if (r->next < r->n) {
+            set_timer(pool, pair, RACE_DELAY);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+
+// losers are closed, client keeps its pair
+static void race_end(struct poolhd *pool, struct eval *client)
+{
+    struct race *r = client->cold->race;
+    
+    for (int i = 0; i < r->pending; i++) {
+        struct eval *att = r->att[i];
+        if (att == client->pair) {
+            continue;
+        }
+        att->pair = 0;
+        del_event(pool, att);
+    }
+    free(r);
+    client->cold->race = 0;
+    // sockets still waiting for protect are dropped on ack
+    client->cold->prot = 0;
+}
+
+
+// 0 - failed attempt is closed, others continue
+static int race_drop(struct poolhd *pool, struct eval *val)
+{
+    struct eval *client = val->pair;
+    struct race *r = client->cold->race;
+    
+    if (!r) {
+        return -1;
+    }
+    for (int i = 0; i < r->pending; i++) {
+        if (r->att[i] == val) {
+            r->att[i] = r->att[--r->pending];
+            break;
+        }
+    }
+    // RFC 8305: next address is tried at once, not after delay
+    if (r->next < r->n) {
+        race_next(pool, client);
+    }
+    if (!r->pending && !r->queued) {
+        client->pair = val;
+        race_end(pool, client);
+        return -1;
+    }
+    if (client->pair == val) {
+        client->pair = r->pending ? r->att[0] : 0;
+    }
+    val->pair = 0;
+    del_event(pool, val);
+    return 0;
+}
+
+
+static int udp_start(struct poolhd *pool, 
+        struct eval *val, int ufd, struct sockaddr_ina *dst)
+{
+    struct sockaddr_ina addr = *dst;
+    
+    if (params.baddr.sin6_family == AF_INET6) {
+        map_fix(&addr, 6);
+    }
     struct eval *pair = add_event(pool, EV_UDP_TUNNEL, ufd, POLLIN);
     if (!pair) {
         close(ufd);
@@ -446,7 +755,7 @@ int udp_associate(struct poolhd *pool,
             del_event(pool, pair);
             return -1;
         }
-        pair->in6 = addr.in6;
+        pair->cold->in6 = addr.in6;
     }
     //
     socklen_t sz = sizeof(addr);
@@ -481,8 +790,8 @@ int udp_associate(struct poolhd *pool,
     pair->pair = val;
     
     client->flag = FLAG_CONN;
-    client->in6 = val->in6;
-    client->in6.sin6_port = 0;
+    client->cold->in6 = val->cold->in6;
+    client->cold->in6.sin6_port = 0;
     
     sz = sizeof(addr);
     if (getsockname(cfd, &addr.sa, &sz)) {
@@ -504,142 +813,697 @@ int udp_associate(struct poolhd *pool,
         uniperror("mod_etype");
         return -1;
     }
+    set_timer(pool, val, 0);
+    set_timer(pool, client, params.idle_timeout);
     return 0;
 }
 
 
-static inline int on_accept(struct poolhd *pool, struct eval *val)
+
+
+int udp_associate(struct poolhd *pool, 
+        struct eval *val, struct sockaddr_ina *dst)
 {
-    struct sockaddr_ina client;
-    struct eval *rval;
-    
-    while (1) {
-        socklen_t len = sizeof(client);
-        #ifdef __linux__
-        int c = accept4(val->fd, &client.sa, &len, SOCK_NONBLOCK);
-        #else
-        int c = accept(val->fd, &client.sa, &len);
-        #endif
-        if (c < 0) {
-            if (get_e() == EAGAIN ||
-                    get_e() == EINPROGRESS)
-                break;
-            uniperror("accept");
+    int ufd = nb_socket(params.baddr.sin6_family, SOCK_DGRAM);
+    if (ufd < 0) {
+        uniperror("socket");  
+        return -1;
+    }
+    if (params.baddr.sin6_family == AF_INET6) {
+        int no = 0;
+        if (setsockopt(ufd, IPPROTO_IPV6,
+                IPV6_V6ONLY, (char *)&no, sizeof(no))) {
+            uniperror("setsockopt IPV6_V6ONLY");
+            close(ufd);
             return -1;
         }
-        LOG(LOG_S, "accept: fd=%d\n", c);
-        #ifndef __linux__
-        #ifdef _WIN32
-        unsigned long mode = 1;
-        if (ioctlsocket(c, FIONBIO, &mode) < 0) {
-            uniperror("ioctlsocket");
-        #else
-        if (fcntl(c, F_SETFL, O_NONBLOCK) < 0) {
-            uniperror("fcntl");
-        #endif
-            close(c);
-            continue;
-        }
-        #endif
-        int one = 1;
-        if (setsockopt(c, IPPROTO_TCP, TCP_NODELAY,
-                (char *)&one, sizeof(one))) {
-            uniperror("setsockopt TCP_NODELAY");
-            close(c);
-            continue;
-        }
-        if (!(rval = add_event(pool, EV_REQUEST, c, POLLIN))) {
-            close(c);
-            continue;
+    }
+    if (bind(ufd, (struct sockaddr *)&params.baddr, 
+            sizeof(params.baddr)) < 0) {
+        uniperror("bind");  
+        close(ufd);
+        return -1;
+    }
+    #ifdef __linux__
+    // reply is sent after protect, client can't send before it
+    if (params.protect_path) {
+        if (protect_queue(pool, val, ufd, dst, EV_UDP_TUNNEL)) {
+            close(ufd);
+            return -1;
         }
-        rval->in6 = client.in6;
+        val->type = EV_IGNORE;
+        return 0;
     }
-    return 0;
+    #endif
+    return udp_start(pool, val, ufd, dst);
 }
 
 
-int on_tunnel(struct poolhd *pool, struct eval *val, 
-        char *buffer, size_t bfsize, int etype)
+#ifdef __linux__
+int on_protected(struct poolhd *pool, struct eval *val,
+        int fd, struct sockaddr_ina *dst, int next, int ok)
+{
+    if (next == EV_ACCEPT) {
+        struct stock *s = pool->stock;
+        s->queued--;
+        if (!ok) {
+            close(fd);
+            return 0;
+        }
+        s->fds[s->count++] = fd;
+        stock_fill(pool);
+        return 0;
+    }
+    if (next == EV_DNS) {
+        dns_protected(pool, fd, ok);
+        return 0;
+    }
+    if (next == EV_UDP_TUNNEL) {
+        val->cold->prot = 0;
+        if (!ok) {
+            close(fd);
+        }
+        else if (!udp_start(pool, val, fd, dst)) {
+            return 0;
+        }
+    }
+    else {
+        struct race *r = val->cold->race;
+        struct eval *pair = 0;
+        
+        if (ok) {
+            pair = conn_add(pool, val, fd, dst, next);
+        } else {
+            close(fd);
+        }
+        if (r) {
+            r->queued--;
+        } else {
+            val->cold->prot = 0;
+        }
+        if (pair) {
+            if (!val->pair) {
+                val->pair = pair;
+            }
+            if (r) {
+                r->att[r->pending++] = pair;
+                if (r->next < r->n) {
+                    set_timer(pool, pair, RACE_DELAY);
+                }
+            }
+            return 0;
+        }
+        // failed attempt is replaced at once, see race_drop
+        if (r && r->next < r->n) {
+            race_next(pool, val);
+        }
+        if (r && (r->queued || r->pending)) {
+            return 0;
+        }
+    }
+    // reconnect failure, client has already got reply
+    if (next != EV_DESYNC && resp_error(val->fd, -1, val->flag) < 0) {
+        uniperror("send");
+    }
+    return -1;
+}
+#endif
+
+
+static inline int on_request(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize);
+
+
+// destination is known without request, as for redirected or tun flows
+int direct_connect(struct poolhd *pool,
+        struct eval *val, struct sockaddr_ina *dst)
 {
-    ssize_t n = 0;
+    if (connect_hook(pool, val, dst, 1, EV_CONNECT)) {
+        return -1;
+    }
+    // client data waits for on_desync, see on_connect
+    if (mod_etype(pool, val, 0)) {
+        uniperror("mod_etype");
+        return -1;
+    }
+    return 0;
+}
+
+
+#ifdef __linux__
+// redirected by REDIRECT or TPROXY, there is no request
+static int on_transparent(struct poolhd *pool, struct eval *val)
+{
+    struct sockaddr_ina dst = {0};
+    socklen_t len = sizeof(dst);
+    
+    if (getsockopt(val->fd, IPPROTO_IPV6,
+                IP6T_SO_ORIGINAL_DST, &dst, &len)
+            && getsockopt(val->fd, IPPROTO_IP,
+                SO_ORIGINAL_DST, &dst, &len)) {
+        // TPROXY keeps original destination as local address
+        len = sizeof(dst);
+        if (getsockname(val->fd, &dst.sa, &len)) {
+            uniperror("getsockname");
+            return -1;
+        }
+        map_fix(&dst, 0);
+        
+        // connected to proxy itself, would loop
+        if (dst.in.sin_port == params.laddr.sin6_port) {
+            LOG(LOG_E, "not redirected: fd=%d\n", val->fd);
+            return -1;
+        }
+    }
+    return direct_connect(pool, val, &dst);
+}
+#endif
+
+
+static inline int on_accept(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize)
+{
+    struct sockaddr_ina client;
+    struct eval *rval;
+    
+    while (1) {
+        socklen_t len = sizeof(client);
+        #ifdef __linux__
+        int c = accept4(val->fd, &client.sa, &len, SOCK_NONBLOCK);
+        #else
+        int c = accept(val->fd, &client.sa, &len);
+        #endif
+        if (c < 0) {
+            if (get_e() == EAGAIN ||
+                    get_e() == EINPROGRESS) {
+                val->ready &= ~POLLIN;
+                break;
+            }
+            uniperror("accept");
+            return -1;
+        }
+        LOG(LOG_S, "accept: fd=%d\n", c);
+        #ifndef __linux__
+        #ifdef _WIN32
+        unsigned long mode = 1;
+        if (ioctlsocket(c, FIONBIO, &mode) < 0) {
+            uniperror("ioctlsocket");
+        #else
+        if (fcntl(c, F_SETFL, O_NONBLOCK) < 0) {
+            uniperror("fcntl");
+        #endif
+            close(c);
+            continue;
+        }
+        #endif
+        int one = 1;
+        if (setsockopt(c, IPPROTO_TCP, TCP_NODELAY,
+                (char *)&one, sizeof(one))) {
+            uniperror("setsockopt TCP_NODELAY");
+            close(c);
+            continue;
+        }
+        if (!(rval = add_event(pool, EV_REQUEST, c, POLLIN))) {
+            close(c);
+            continue;
+        }
+        rval->cold->in6 = client.in6;
+        set_timer(pool, rval, params.conn_timeout);
+        
+        #ifdef __linux__
+        if (params.transparent) {
+            if (on_transparent(pool, rval)) {
+                close_conn(pool, rval);
+            }
+            continue;
+        }
+        // greeting is already received, see TCP_DEFER_ACCEPT
+        if (params.defer_accept && on_request(pool, rval, buffer, bfsize)) {
+            close_conn(pool, rval);
+        }
+        #endif
+    }
+    return 0;
+}
+
+
+int offload_tunnel(struct poolhd *pool, struct eval *val)
+{
+    #ifdef SOCKMAP_SUPPORT
+    struct eval *pair = val->pair;
+    
+    if (!params.offload || (val->flag & (FLAG_OFFLOAD | FLAG_NOOFFLOAD))
+            || val->cold->buff.data || pair->cold->buff.data) {
+        return 0;
+    }
+    // queued data would be reordered with redirected
+    int qn = 0, pn = 0;
+    if (ioctl(val->fd, FIONREAD, &qn) 
+            || ioctl(pair->fd, FIONREAD, &pn) || qn || pn) {
+        return 0;
+    }
+    #ifdef SPLICE_SUPPORT
+    if ((val->pipe && val->pipe->size) 
+            || (pair->pipe && pair->pipe->size)) {
+        return 0;
+    }
+    #endif
+    if (sockmap_balance(val->fd, pair->fd, &val->cold->offload_diff)
+            || sockmap_balance(pair->fd, val->fd, &pair->cold->offload_diff)) {
+        return 0;
+    }
+    if (sockmap_add(val->fd, pair->fd)) {
+        // e.g. map is full, relayed by proxy till the end
+        val->flag |= FLAG_NOOFFLOAD;
+        pair->flag |= FLAG_NOOFFLOAD;
+        return -1;
+    }
+    val->flag |= FLAG_OFFLOAD;
+    pair->flag |= FLAG_OFFLOAD;
+    LOG(LOG_S, "offload: fds=%d,%d\n", val->fd, pair->fd);
+    #ifdef SPLICE_SUPPORT
+    if (val->pipe) {
+        pipe_put(pool, val->pipe);
+        val->pipe = 0;
+    }
+    if (pair->pipe) {
+        pipe_put(pool, pair->pipe);
+        pair->pipe = 0;
+    }
+    #endif
+    #endif
+    return 0;
+}
+
+
+static int offload_drain(struct poolhd *pool, struct eval *val)
+{
+    #ifdef SOCKMAP_SUPPORT
     struct eval *pair = val->pair;
+    ssize_t diff;
+    
+    if (!(val->flag & FLAG_OFFLOAD)) {
+        return -1;
+    }
+    // redirected data can be still queued in kernel,
+    // closing now would drop it; received FIN is counted as byte
+    if (sockmap_balance(val->fd, pair->fd, &diff)
+            || diff + 1 >= val->cold->offload_diff) {
+        return -1;
+    }
+    LOG(LOG_L, "offload drain: fd=%d, left=%ld\n", 
+        pair->fd, val->cold->offload_diff - diff - 1);
+    
+    if (!(pair->events & POLLOUT)) {
+        // wake up only when kernel queue is almost sent
+        int lowat = params.bfsize;
+        if (setsockopt(pair->fd, IPPROTO_TCP, 
+                TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat))) {
+            uniperror("setsockopt TCP_NOTSENT_LOWAT");
+        }
+    }
+    val->flag |= FLAG_EOF | FLAG_RDHUP;
+    val->ready &= ~POLLIN;
+    pair->ready &= ~POLLOUT;
+    if (mod_etype(pool, val, 0) ||
+            mod_etype(pool, pair, POLLOUT)) {
+        uniperror("mod_etype");
+        return -1;
+    }
+    return 0;
+    #else
+    return -1;
+    #endif
+}
+
+
+#ifdef SPLICE_SUPPORT
+static int on_tunnel_splice(struct poolhd *pool, 
+        struct eval *val, size_t bfsize, int etype)
+{
+    struct eval *pair = val->pair;
+    int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
     
     if (etype & POLLOUT) {
         LOG(LOG_S, "pollout (fd=%d)\n", val->fd);
         val = pair;
         pair = val->pair;
     }
-    if (val->buff.data) {
+    if (!val->pipe && !(val->pipe = pipe_get(pool))) {
+        uniperror("pipe");
+        return -1;
+    }
+    struct pipe_buf *p = val->pipe;
+    
+    if (p->size) {
         if (etype & POLLHUP) {
             return -1;
         }
-        n = val->buff.size - val->buff.offset;
+        ssize_t sn = splice(p->fd[0], 0, pair->fd, 0, p->size, flags);
+        if (sn < 0 && get_e() != EAGAIN) {
+            uniperror("splice");
+            return -1;
+        }
+        if (sn > 0) {
+            p->size -= sn;
+        }
+        if (p->size) {
+            pair->ready &= ~POLLOUT;
+            return 0;
+        }
+        // other direction is already drained and shut down
+        if ((val->flag | pair->flag) & FLAG_EOF) {
+            return -1;
+        }
+        if (mod_etype(pool, val, POLLIN) ||
+                mod_etype(pool, pair, POLLIN)) {
+            uniperror("mod_etype");
+            return -1;
+        }
+    }
+    while (!(val->flag & FLAG_EOF)) {
+        ssize_t n = splice(val->fd, 0, p->fd[1], 0, bfsize, flags);
+        if (n < 0 && get_e() == EAGAIN) {
+            val->ready &= ~POLLIN;
+            break;
+        }
+        if (!n && (val->flag & FLAG_OFFLOAD)) {
+            return offload_drain(pool, val);
+        }
+        if (!n) {
+            // pipe of this direction is empty, EOF can be passed on
+            if (shutdown(pair->fd, SHUT_WR)) {
+                uniperror("shutdown");
+                return -1;
+            }
+            val->flag |= FLAG_EOF | FLAG_RDHUP;
+            break;
+        }
+        if (n < 0) {
+            uniperror("splice");
+            return -1;
+        }
+        val->cold->recv_count += n;
+        p->size += n;
         
-        ssize_t sn = send(pair->fd, 
-            val->buff.data + val->buff.offset, n, 0);
-        if (sn != n) {
-            if (sn < 0 && get_e() != EAGAIN) {
-                uniperror("send");
+        ssize_t sn = splice(p->fd[0], 0, pair->fd, 0, p->size, flags);
+        if (sn < 0) {
+            if (get_e() != EAGAIN) {
+                uniperror("splice");
+                return -1;
+            }
+            sn = 0;
+        }
+        p->size -= sn;
+        if (p->size) {
+            LOG(LOG_S, "splice: %ld != %ld (fd: %d)\n", sn, n, pair->fd);
+            
+            pair->ready &= ~POLLOUT;
+            if (mod_etype(pool, val, 0) ||
+                    mod_etype(pool, pair, POLLOUT)) {
+                uniperror("mod_etype");
                 return -1;
             }
-            if (sn > 0)
-                val->buff.offset += sn;
             return 0;
         }
-        free(val->buff.data);
-        val->buff.data = 0;
-        val->buff.size = 0;
-        val->buff.offset = 0;
-        
-        if (mod_etype(pool, val, POLLIN) ||
-                mod_etype(pool, pair, POLLIN)) {
+    }
+    if (val->flag & FLAG_EOF) {
+        // pair is closed after data piped for this side is sent
+        if ((etype & POLLHUP) || !pair->pipe || !pair->pipe->size) {
+            return -1;
+        }
+        if (mod_etype(pool, val, POLLOUT) ||
+                mod_etype(pool, pair, 0)) {
             uniperror("mod_etype");
             return -1;
         }
+        return 0;
+    }
+    offload_tunnel(pool, val);
+    return 0;
+}
+#endif
+
+
+static int tunnel_flush(struct poolhd *pool, struct eval *val)
+{
+    struct eval *pair = val->pair;
+    struct buffer *b = &val->cold->buff;
+    
+    while (b->size) {
+        ssize_t n = b->size;
+        if (b->offset + n > pool->bsize) {
+            n = pool->bsize - b->offset;
+        }
+        ssize_t sn = send(pair->fd, b->data + b->offset, n, 0);
+        if (sn < 0) {
+            if (get_e() == EAGAIN) {
+                pair->ready &= ~POLLOUT;
+                return 0;
+            }
+            uniperror("send");
+            return -1;
+        }
+        b->size -= sn;
+        b->offset = (b->offset + sn) % pool->bsize;
+        
+        if (sn != n) {
+            LOG(LOG_S, "send: %ld != %ld (fd: %d)\n", sn, n, pair->fd);
+            pair->ready &= ~POLLOUT;
+            return 0;
+        }
+    }
+    buff_put(pool, b->data);
+    b->data = 0;
+    b->offset = 0;
+    return 0;
+}
+
+
+static int tunnel_read(struct poolhd *pool, 
+        struct eval *val, char *buffer, size_t bfsize)
+{
+    struct eval *pair = val->pair;
+    struct buffer *b = &val->cold->buff;
+    
+    // keep reading into ring while peer drains it
+    while (b->size < pool->bsize) {
+        char *dst = buffer;
+        ssize_t len = bfsize;
+        
+        if (b->data) {
+            int tail = (b->offset + b->size) % pool->bsize;
+            dst = b->data + tail;
+            len = tail < b->offset ? 
+                b->offset - tail : pool->bsize - tail;
+        }
+        ssize_t n = recv(val->fd, dst, len, 0);
+        if (n < 0 && get_e() == EAGAIN) {
+            val->ready &= ~POLLIN;
+            break;
+        }
+        if (n < 0) {
+            uniperror("recv");
+            return -1;
+        }
+        if (!n) {
+            val->flag |= FLAG_EOF | FLAG_RDHUP;
+            break;
+        }
+        val->cold->recv_count += n;
+        
+        if (b->data) {
+            b->size += n;
+        }
+        else {
+            ssize_t sn = send(pair->fd, buffer, n, 0);
+            if (sn < 0) {
+                if (get_e() != EAGAIN) {
+                    uniperror("send");
+                    return -1;
+                }
+                sn = 0;
+            }
+            if (sn != n) {
+                LOG(LOG_S, "send: %ld != %ld (fd: %d)\n", sn, n, pair->fd);
+                
+                if (!(b->data = buff_get(pool))) {
+                    uniperror("buff_get");
+                    return -1;
+                }
+                memcpy(b->data, buffer + sn, n - sn);
+                b->size = n - sn;
+                b->offset = 0;
+                pair->ready &= ~POLLOUT;
+            }
+        }
+        // FIN may be queued behind data, edge of it is already reported
+        if (n != len && !(val->flag & FLAG_RDHUP)) {
+            val->ready &= ~POLLIN;
+            break;
+        }
+    }
+    return 0;
+}
+
+
+#ifdef IOURING
+static int tunnel_submit(struct poolhd *pool, struct eval *val)
+{
+    struct buffer *b = &val->cold->buff;
+    
+    if (b->size) {
+        return uring_io(pool, val, val->pair->fd, 
+            IORING_OP_SEND, b->offset, b->size);
+    }
+    return uring_io(pool, val, val->fd, IORING_OP_RECV, 0, pool->bsize);
+}
+
+
+static int tunnel_uring_start(struct poolhd *pool, struct eval *val)
+{
+    struct eval *pair = val->pair;
+    
+    if (uring_start(pool, val) || uring_start(pool, pair)) {
+        uniperror("uring_start");
+        return -1;
+    }
+    if (!(val->cold->buff.data = buff_get(pool))
+            || !(pair->cold->buff.data = buff_get(pool))) {
+        uniperror("buff_get");
+        return -1;
+    }
+    if (tunnel_submit(pool, val) || tunnel_submit(pool, pair)) {
+        uniperror("uring_io");
+        return -1;
+    }
+    LOG(LOG_L, "uring io: fds=%d,%d\n", val->fd, pair->fd);
+    return 0;
+}
+
+
+// buffer of val is either received into or sent to pair
+static int on_tunnel_uring(struct poolhd *pool, struct eval *val, int res)
+{
+    struct eval *pair = val->pair;
+    struct buffer *b = &val->cold->buff;
+    
+    if (res < 0) {
+        errno = -res;
+        uniperror(b->size ? "send" : "recv");
+        return -1;
+    }
+    if (b->size) {
+        if (res != b->size) {
+            LOG(LOG_S, "send: %d != %ld (fd: %d)\n", res, b->size, pair->fd);
+        }
+        b->size -= res;
+        b->offset += res;
+    }
+    else if (res) {
+        val->cold->recv_count += res;
+        b->size = res;
+        b->offset = 0;
+    }
+    else {
+        // other direction goes on until its EOF
+        val->flag |= FLAG_EOF | FLAG_RDHUP;
+        if (pair->flag & FLAG_EOF) {
+            return -1;
+        }
+        if (shutdown(pair->fd, SHUT_WR)) {
+            uniperror("shutdown");
+            return -1;
+        }
+        return 0;
+    }
+    if (tunnel_submit(pool, val)) {
+        uniperror("uring_io");
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+
+static int tunnel_events(struct poolhd *pool, struct eval *val)
+{
+    struct eval *pair = val->pair;
+    int e = 0;
+    
+    if (!(val->flag & FLAG_EOF) && val->cold->buff.size < pool->bsize) {
+        e |= POLLIN;
+    }
+    if (pair->cold->buff.size) {
+        e |= POLLOUT;
+    }
+    return mod_etype(pool, val, e);
+}
+
+
+int on_tunnel(struct poolhd *pool, struct eval *val, 
+        char *buffer, size_t bfsize, int etype)
+{
+    struct eval *pair = val->pair;
+    
+    #ifdef IOURING
+    if (etype & POLLCOMPLETE) {
+        return on_tunnel_uring(pool, val, pool->ring.res);
+    }
+    #endif
+    #ifdef SPLICE_SUPPORT
+    if (params.splice) {
+        assert(!val->cold->buff.data && !pair->cold->buff.data);
+        return on_tunnel_splice(pool, val, bfsize, etype);
+    }
+    #endif
+    if (etype & POLLRDHUP) {
+        val->flag |= FLAG_RDHUP;
+    }
+    if ((etype & POLLHUP) && 
+            (pair->cold->buff.size || (val->flag & FLAG_EOF))) {
+        return -1;
+    }
+    if ((etype & POLLOUT) && pair->cold->buff.size) {
+        LOG(LOG_S, "pollout (fd=%d)\n", val->fd);
+        if (tunnel_flush(pool, pair)) {
+            return -1;
+        }
     }
-    do {
-        n = recv(val->fd, buffer, bfsize, 0);
-        if (n < 0 && get_e() == EAGAIN) {
-            break;
-        }
-        if (n < 1) {
-            if (n) uniperror("recv");
+    if ((etype & ~POLLOUT) && !(val->flag & FLAG_EOF)) {
+        if (tunnel_read(pool, val, buffer, bfsize)) {
             return -1;
         }
-        val->recv_count += n;
-        
-        ssize_t sn = send(pair->fd, buffer, n, 0);
-        if (sn != n) {
-            if (sn < 0) {
-                if (get_e() != EAGAIN) {
-                    uniperror("send");
-                    return -1;
-                }
-                sn = 0;
-            }
-            LOG(LOG_S, "send: %ld != %ld (fd: %d)\n", sn, n, pair->fd);
-            assert(!(val->buff.size || val->buff.offset));
-            
-            val->buff.size = n - sn;
-            if (!(val->buff.data = malloc(n - sn))) {
-                uniperror("malloc");
-                return -1;
-            }
-            memcpy(val->buff.data, buffer + sn, n - sn);
-            
-            if (mod_etype(pool, val, 0) ||
-                    mod_etype(pool, pair, POLLOUT)) {
-                uniperror("mod_etype");
-                return -1;
-            }
-            break;
-        }
-    } while (n == bfsize);
+    }
+    // EOF is passed on by closing, after buffered data is sent
+    if ((val->flag & FLAG_EOF) && !val->cold->buff.size) {
+        return offload_drain(pool, val);
+    }
+    if ((pair->flag & FLAG_EOF) && !pair->cold->buff.size) {
+        return offload_drain(pool, pair);
+    }
+    if (tunnel_events(pool, val) || tunnel_events(pool, pair)) {
+        uniperror("mod_etype");
+        return -1;
+    }
+    if (val->cold->buff.data || pair->cold->buff.data) {
+        return 0;
+    }
+    offload_tunnel(pool, val);
+    #ifdef IOURING
+    // sockmap is preferred, it doesn't wake up proxy at all
+    if (pool->ring.io && !(val->flag & FLAG_OFFLOAD)
+            && (!params.offload || (val->flag & FLAG_NOOFFLOAD))
+            && !((val->flag | pair->flag) & FLAG_EOF)) {
+        return tunnel_uring_start(pool, val);
+    }
+    #endif
     return 0;
 }
 
 
-int on_udp_tunnel(struct eval *val, char *buffer, size_t bfsize)
+int on_udp_tunnel(struct poolhd *pool,
+        struct eval *val, char *buffer, size_t bfsize)
 {
     char *data = buffer;
     size_t data_len = bfsize;
@@ -648,41 +1512,49 @@ int on_udp_tunnel(struct eval *val, char *buffer, size_t bfsize)
         data += S_SIZE_I6;
         data_len -= S_SIZE_I6;
     }
-    struct sockaddr_ina addr = {0};
+    struct sockaddr_ina addr = {0}, dst[DST_MAX] = {0};
+    int cnt;
     
     do {
         socklen_t asz = sizeof(addr);
         
         ssize_t n = recvfrom(val->fd, data, data_len, 0, &addr.sa, &asz);
         if (n < 1) {
-            if (n && get_e() == EAGAIN)
+            if (n && get_e() == EAGAIN) {
+                val->ready &= ~POLLIN;
                 break;
+            }
             uniperror("recv udp");
             return -1;
         }
-        val->recv_count += n;
+        val->cold->recv_count += n;
         ssize_t ns;
         
         if (val->flag == FLAG_CONN) {
-            if (!val->in6.sin6_port) {
-                if (!addr_equ(&addr, (struct sockaddr_ina *)&val->in6)) {
+            if (!val->cold->in6.sin6_port) {
+                if (!addr_equ(&addr, (struct sockaddr_ina *)&val->cold->in6)) {
                     return 0;
                 }
                 if (connect(val->fd, &addr.sa, sizeof(addr)) < 0) {
                     uniperror("connect");
                     return -1;
                 }
-                val->in6 = addr.in6;
+                val->cold->in6 = addr.in6;
             }
             if (*(data + 2) != 0) { // frag
                 continue;
             }
-            int offs = s5_get_addr(data, n, &addr, SOCK_DGRAM);
+            int offs = s5_get_addr(pool, 0, data, n, dst, &cnt, SOCK_DGRAM);
             if (offs < 0) {
                 LOG(LOG_E, "udp parse error\n");
                 return -1;
             }
-            if (!val->pair->in6.sin6_port) {
+            // domain is not cached yet, client will resend
+            if (!cnt) {
+                continue;
+            }
+            addr = dst[0];
+            if (!val->pair->cold->in6.sin6_port) {
                 if (params.baddr.sin6_family == AF_INET6) {
                     map_fix(&addr, 6);
                 }
@@ -693,10 +1565,10 @@ int on_udp_tunnel(struct eval *val, char *buffer, size_t bfsize)
                     uniperror("connect");
                     return -1;
                 }
-                val->pair->in6 = addr.in6;
+                val->pair->cold->in6 = addr.in6;
             }
             ns = udp_hook(val->pair, data + offs, bfsize - offs, n - offs, 
-                (struct sockaddr_ina *)&val->pair->in6);
+                (struct sockaddr_ina *)&val->pair->cold->in6);
         }
         else {
             map_fix(&addr, 0);
@@ -717,44 +1589,110 @@ int on_udp_tunnel(struct eval *val, char *buffer, size_t bfsize)
 }
 
 
+// sent along with request, it's first request for on_desync
+static int early_data(struct poolhd *pool, 
+        struct eval *val, char *data, ssize_t n)
+{
+    if (n <= 0) {
+        return 0;
+    }
+    if (!val->cold->buff.data && !(val->cold->buff.data = buff_get(pool))) {
+        uniperror("buff_get");
+        return -1;
+    }
+    memcpy(val->cold->buff.data, data, n);
+    val->cold->buff.size = n;
+    val->cold->recv_count += n;
+    return 0;
+}
+
+
+// client data waits for on_connect, level-triggered poll would spin on it
+static int request_connect(struct poolhd *pool, struct eval *val,
+        struct sockaddr_ina *dst, int n)
+{
+    int error = connect_hook(pool, val, dst, n, EV_CONNECT);
+    if (error) {
+        return error;
+    }
+    if (mod_etype(pool, val, 0)) {
+        uniperror("mod_etype");
+        return -1;
+    }
+    return 0;
+}
+
+
 static inline int on_request(struct poolhd *pool, struct eval *val,
         char *buffer, size_t bfsize)
 {
-    struct sockaddr_ina dst = {0};
+    struct sockaddr_ina dst[DST_MAX] = {0};
+    struct buffer *part = &val->cold->buff;
+    int cnt = 0;
     
-    ssize_t n = recv(val->fd, buffer, bfsize, 0);
+    // start of request, kept from previous recv
+    size_t ps = part->size;
+    if (ps) {
+        memcpy(buffer, part->data, ps);
+    }
+    ssize_t n = recv(val->fd, buffer + ps, bfsize - ps, 0);
     if (n < 1) {
+        if (n && get_e() == EAGAIN) {
+            val->ready &= ~POLLIN;
+            return 0;
+        }
         if (n) uniperror("ss recv");
         return -1;
     }
-    int error = 0;
+    if (n < bfsize - ps) {
+        val->ready &= ~POLLIN;
+    }
+    n += ps;
+    part->size = 0;
+    int error = 0, o;
     
+    if (*buffer == S_VER5 && val->flag != FLAG_S5) {
+        if ((o = auth_socks5(val->fd, buffer, n)) < 0) {
+            return -1;
+        }
+        val->flag = FLAG_S5;
+        // client may not wait for auth reply
+        if (!(n -= o)) {
+            return 0;
+        }
+        buffer += o;
+    }
     if (*buffer == S_VER5) {
-        if (val->flag != FLAG_S5) {
-            if (auth_socks5(val->fd, buffer, n)) {
+        struct s5_req *r = (struct s5_req *)buffer;
+        
+        // greeting and first part of request may come together
+        if (n < S_SIZE_MIN || n < s5_req_size(r)) {
+            if (!part->data && !(part->data = buff_get(pool))) {
+                uniperror("buff_get");
                 return -1;
             }
-            val->flag = FLAG_S5;
+            memcpy(part->data, buffer, n);
+            part->size = n;
             return 0;
         }
-        if (n < S_SIZE_MIN) {
-            LOG(LOG_E, "ss: request to small (%ld)\n", n);
-            return -1;
-        }
-        struct s5_req *r = (struct s5_req *)buffer;
         int s5e = 0;
         switch (r->cmd) {
             case S_CMD_CONN:
-                s5e = s5_get_addr(buffer, n, &dst, SOCK_STREAM);
-                if (s5e >= 0) {
-                    error = connect_hook(pool, val, &dst, EV_CONNECT);
+                s5e = s5_get_addr(pool, val, 
+                    buffer, n, dst, &cnt, SOCK_STREAM);
+                if (s5e > 0 && early_data(pool, val, buffer + s5e, n - s5e)) {
+                    return -1;
+                }
+                if (s5e > 0 && cnt) {
+                    error = request_connect(pool, val, dst, cnt);
                 }
                 break;
             case S_CMD_AUDP:
                 if (params.udp) {
-                    s5e = s5_get_addr(buffer, n, &dst, SOCK_DGRAM);
-                    if (s5e >= 0) {
-                        error = udp_associate(pool, val, &dst);
+                    s5e = s5_get_addr(pool, val, 
+                        buffer, n, dst, &cnt, SOCK_DGRAM);
+                    if (s5e > 0 && cnt) {
+                        error = udp_associate(pool, val, dst);
                     }
                     break;
                 }
@@ -771,13 +1709,19 @@ static inline int on_request(struct poolhd *pool, struct eval *val,
     else if (*buffer == S_VER4) {
         val->flag = FLAG_S4;
         
-        error = s4_get_addr(buffer, n, &dst);
-        if (error) {
-            if (resp_error(val->fd, error, FLAG_S4) < 0)
+        o = s4_get_addr(pool, val, buffer, n, dst, &cnt);
+        if (o < 0) {
+            if (resp_error(val->fd, o, FLAG_S4) < 0)
                 uniperror("send");
             return -1;
         }
-        error = connect_hook(pool, val, &dst, EV_CONNECT);
+        if (early_data(pool, val, buffer + o, n - o)) {
+            return -1;
+        }
+        if (!cnt) {
+            return 0;
+        }
+        error = request_connect(pool, val, dst, cnt);
     }
     else {
         LOG(LOG_E, "ss: invalid version: 0x%x (%lu)\n", *buffer, n);
@@ -794,7 +1738,43 @@ static inline int on_request(struct poolhd *pool, struct eval *val,
 }
 
 
-static inline int on_connect(struct poolhd *pool, struct eval *val, int e)
+int on_resolved(struct poolhd *pool, 
+        struct eval *val, struct sockaddr_ina *dst, int n, int type)
+{
+    int error = 0;
+    
+    if (n <= 0) {
+        if (val->flag == FLAG_S5)
+            error = resp_s5_error(val->fd, S_ER_HOST);
+        else
+            error = resp_error(val->fd, -1, val->flag);
+        if (error < 0)
+            uniperror("send");
+        return -1;
+    }
+    if (mod_etype(pool, val, POLLIN)) {
+        uniperror("mod_etype");
+        return -1;
+    }
+    if (type == SOCK_DGRAM) {
+        error = udp_associate(pool, val, dst);
+    }
+    else {
+        error = request_connect(pool, val, dst, n);
+    }
+    if (error) {
+        int en = get_e();
+        if (resp_error(val->fd, en ? en : error, val->flag) < 0)
+            uniperror("send");
+        LOG(LOG_S, "ss error: %d\n", en);
+        return -1;
+    }
+    return 0;
+}
+
+
+static inline int on_connect(struct poolhd *pool, struct eval *val, int e,
+        char *buffer, size_t bfsize)
 {
     int error = 0;
     socklen_t len = sizeof(error);
@@ -804,27 +1784,131 @@ static inline int on_connect(struct poolhd *pool, struct eval *val, int e)
             uniperror("getsockopt SO_ERROR");
             return -1;
         }
+        if (!race_drop(pool, val)) {
+            LOG(LOG_S, "connect failed: %d, next address\n", error);
+            return 0;
+        }
     }
     else {
+        if (val->pair->cold->race) {
+            val->pair->pair = val;
+            race_end(pool, val->pair);
+            dns_prefer(val->pair->cold->host, val->cold->in6.sin6_family);
+        }
         if (mod_etype(pool, val, POLLIN)) {
             uniperror("mod_etype");
             return -1;
         }
         val->type = EV_TUNNEL;
         val->pair->type = EV_DESYNC;
+        
+        set_timer(pool, val->pair, 0);
+        set_timer(pool, val, params.idle_timeout);
+        
+        // recheck data received while connecting
+        if (mod_etype(pool, val->pair, POLLIN)) {
+            uniperror("mod_etype");
+            return -1;
+        }
     }
     if (resp_error(val->pair->fd,
             error, val->pair->flag) < 0) {
         uniperror("send");
         return -1;
     }
-    return e ? -1 : 0;
+    if (e) {
+        return -1;
+    }
+    // pipelined with request, don't wait for client
+    if (val->pair->cold->buff.size) {
+        return desync_start(pool, val->pair, buffer, bfsize);
+    }
+    return 0;
+}
+
+
+static int on_timeout(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize)
+{
+    switch (val->type) {
+        case EV_ACCEPT:
+            stock_fill(pool);
+            return 0;
+        
+        case EV_REQUEST:
+            if (val->cold->dns) {
+                return dns_retry(pool, val);
+            }
+            // fallthrough
+        case EV_IGNORE:
+            LOG(LOG_S, "connect timeout: fd=%d\n", val->fd);
+            return -1;
+        
+        case EV_CONNECT:
+            if (val->pair->cold->race) {
+                race_next(pool, val->pair);
+            }
+            return 0;
+        
+        case EV_PRE_TUNNEL:
+            trial_switch(val);
+            if (params.dp[val->pair->cold->attempt].timeout) {
+                LOG(LOG_S, "response timeout: fd=%d\n", val->fd);
+                return on_torst(pool, val);
+            }
+            break;
+        
+        case EV_DESYNC:
+            if (val->cold->dwait.pending) {
+                return on_desync(pool, val, buffer, bfsize, POLLTIMEOUT);
+            }
+            break;
+        
+        #ifdef TUN_SUPPORT
+        case EV_TUN_FLOW:
+        case EV_TUN_UDP:
+            return tun_timeout(pool, val);
+        #endif
+        default:;
+    }
+    // activity is not tracked by timer, check on expiration
+    unsigned int idle = idle_time(pool, val);
+    #ifdef SOCKMAP_SUPPORT
+    if (val->flag & FLAG_OFFLOAD) {
+        idle = sockmap_idle(val->fd, val->pair->fd);
+    }
+    #endif
+    if (idle < params.idle_timeout) {
+        set_timer(pool, val, params.idle_timeout - idle);
+        return 0;
+    }
+    LOG(LOG_S, "idle timeout: fd=%d\n", val->fd);
+    return -1;
 }
 
 
 void close_conn(struct poolhd *pool, struct eval *val)
 {
     LOG(LOG_S, "close: fds=%d,%d\n", val->fd, val->pair ? val->pair->fd : -1);
+    if (val->cold->dns) {
+        dns_cancel(pool, val);
+    }
+    if (val->cold->race) {
+        race_end(pool, val);
+    }
+    if (val->cold->trial) {
+        trial_end(pool, val);
+    }
+    // other groups are still raced
+    else if (val->pair && val->pair->cold->trial
+            && !trial_drop(pool, val)) {
+        return;
+    }
+    #ifdef TUN_SUPPORT
+    if (val->cold->tun) {
+        tun_close(pool, val);
+    }
+    #endif
     del_event(pool, val);
 }
 
@@ -833,21 +1917,46 @@ int event_loop(int srvfd)
 {
     size_t bfsize = params.bfsize;
     
-    struct poolhd *pool = init_pool(params.max_open * 2 + 1);
+    // block also holds first request and unsent part of one recv
+    size_t bsize = params.bflimit > bfsize ? params.bflimit : bfsize;
+    
+    // listener, resolver, protect and tun sockets,
+    // tun flow has own socket besides client and server
+    struct poolhd *pool = init_pool(params.max_open * (params.tun ? 3 : 2) + 4,
+        params.edge ? POOL_EDGE : 0, bsize);
     if (!pool) {
         uniperror("init pool");
         close(srvfd);
         return -1;
     }
-    if (!add_event(pool, EV_ACCEPT, srvfd, POLLIN)) {
+    struct stock stock = { 0 };
+    
+    if (!(stock.ev = add_event(pool, EV_ACCEPT, srvfd, POLLIN))) {
         uniperror("add event");
         destroy_pool(pool);
         close(srvfd);
         return -1;
     }
+    pool->stock = &stock;
+    
+    if (params.dns_count && dns_open(pool)) {
+        destroy_pool(pool);
+        return -1;
+    }
+    #ifdef TUN_SUPPORT
+    if (params.tun && tun_open(pool)) {
+        dns_free(pool);
+        destroy_pool(pool);
+        return -1;
+    }
+    #endif
     char *buffer = malloc(params.bfsize);
     if (!buffer) {
         uniperror("malloc");
+        #ifdef TUN_SUPPORT
+        tun_free(pool);
+        #endif
+        dns_free(pool);
         destroy_pool(pool);
         return -1;
     }
@@ -867,10 +1976,15 @@ int event_loop(int srvfd)
             && val->type < sizeof(eid_name)/sizeof(*eid_name));
         LOG(LOG_L, "new event: fd: %d, evt: %s, mod_iter: %d\n", val->fd, eid_name[val->type], val->mod_iter);
         
+        if (etype & POLLTIMEOUT) {
+            if (on_timeout(pool, val, buffer, bfsize))
+                close_conn(pool, val);
+            continue;
+        }
         switch (val->type) {
             case EV_ACCEPT:
                 if ((etype & POLLHUP) ||
-                        on_accept(pool, val))
+                        on_accept(pool, val, buffer, bfsize))
                     NOT_EXIT = 0;
                 continue;
             
@@ -892,12 +2006,43 @@ int event_loop(int srvfd)
                 continue;
         
             case EV_UDP_TUNNEL:
-                if (on_udp_tunnel(val, buffer, bfsize))
+                if (on_udp_tunnel(pool, val, buffer, bfsize))
+                    close_conn(pool, val);
+                continue;
+            
+            case EV_DNS:
+                on_dns(pool, val, buffer, bfsize);
+                continue;
+            
+            #ifdef __linux__
+            case EV_PROTECT:
+                on_protect(pool, val, etype, buffer, bfsize);
+                continue;
+            #endif
+            
+            #ifdef TUN_SUPPORT
+            case EV_TUN:
+                if (etype & (POLLHUP | POLLERR)) {
+                    LOG(LOG_E, "tun closed\n");
+                    NOT_EXIT = 0;
+                    continue;
+                }
+                on_tun(pool, val);
+                continue;
+            
+            case EV_TUN_FLOW:
+                if (on_tun_flow(pool, val, etype))
+                    close_conn(pool, val);
+                continue;
+            
+            case EV_TUN_UDP:
+                if (on_tun_udp(pool, val, buffer, bfsize))
                     close_conn(pool, val);
                 continue;
+            #endif
                 
             case EV_CONNECT:
-                if (on_connect(pool, val, etype & POLLERR))
+                if (on_connect(pool, val, etype & POLLERR, buffer, bfsize))
                     close_conn(pool, val);
                 continue;
                 
@@ -919,6 +2064,14 @@ int event_loop(int srvfd)
     }
     LOG(LOG_S, "exit\n");
     free(buffer);
+    while (stock.count) {
+        close(stock.fds[--stock.count]);
+    }
+    protect_free(pool);
+    #ifdef TUN_SUPPORT
+    tun_free(pool);
+    #endif
+    dns_free(pool);
     destroy_pool(pool);
     return 0;
 }
@@ -938,12 +2091,46 @@ int listen_socket(struct sockaddr_ina *srv)
         close(srvfd);
         return -1;
     }
+    #ifdef WORKERS_SUPPORT
+    if (params.workers != 1 && setsockopt(srvfd, SOL_SOCKET,
+            SO_REUSEPORT, (char *)&opt, sizeof(opt)) == -1) {
+        uniperror("setsockopt SO_REUSEPORT");
+        close(srvfd);
+        return -1;
+    }
+    #endif
+    #ifdef __linux__
+    // needed for TPROXY only, REDIRECT works without it
+    if (params.transparent && (srv->sa.sa_family == AF_INET6 ?
+            setsockopt(srvfd, IPPROTO_IPV6, 
+                IPV6_TRANSPARENT, (char *)&opt, sizeof(opt)) :
+            setsockopt(srvfd, IPPROTO_IP, 
+                IP_TRANSPARENT, (char *)&opt, sizeof(opt)))) {
+        uniperror("setsockopt IP_TRANSPARENT");
+    }
+    #endif
     if (bind(srvfd, &srv->sa, sizeof(*srv)) < 0) {
         uniperror("bind");  
         close(srvfd);
         return -1;
     }
-    if (listen(srvfd, 10)) {
+    #ifdef __linux__
+    // client speaks first, accept is reported with greeting
+    // not so for redirected protocols, server may speak first
+    if (params.defer_accept && !params.transparent 
+            && setsockopt(srvfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 
+                (char *)&params.defer_accept, sizeof(params.defer_accept))) {
+        uniperror("setsockopt TCP_DEFER_ACCEPT");
+    }
+    #endif
+    #ifdef TCP_FASTOPEN
+    if (params.tfo_queue && setsockopt(srvfd, IPPROTO_TCP,
+            TCP_FASTOPEN, (char *)&params.tfo_queue, sizeof(params.tfo_queue))) {
+        uniperror("setsockopt TCP_FASTOPEN");
+    }
+    #endif
+    int backlog = params.backlog ? params.backlog : params.max_open;
+    if (listen(srvfd, backlog)) {
         uniperror("listen");
         close(srvfd);
         return -1;
@@ -952,6 +2139,133 @@ int listen_socket(struct sockaddr_ina *srv)
 }
 
 
+#ifdef WORKERS_SUPPORT
+struct worker {
+    pthread_t thread;
+    int fd;
+    int cpu;
+};
+
+
+static int pin_cpu(int fd, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    
+    int e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (e) {
+        errno = e;
+        uniperror("pthread_setaffinity_np");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET,
+            SO_INCOMING_CPU, (char *)&cpu, sizeof(cpu))) {
+        uniperror("setsockopt SO_INCOMING_CPU");
+        return -1;
+    }
+    return 0;
+}
+
+
+static void *worker_loop(void *arg)
+{
+    struct worker *w = arg;
+    
+    if (params.pin_cpu && pin_cpu(w->fd, w->cpu)) {
+        close(w->fd);
+        return 0;
+    }
+    event_loop(w->fd);
+    return 0;
+}
+
+
+static void stop_worker(struct worker *w)
+{
+    struct timespec ts;
+    do {
+        // loop can be between NOT_EXIT check and (e)poll, so repeat
+        pthread_kill(w->thread, SIGUSR1);
+        
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    } while (pthread_timedjoin_np(w->thread, 0, &ts) == ETIMEDOUT);
+}
+
+
+int run_workers(struct sockaddr_ina *srv)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+    int count = params.workers ? params.workers : ncpu;
+    
+    struct worker *workers = calloc(count, sizeof(*workers));
+    if (!workers) {
+        uniperror("calloc");
+        return -1;
+    }
+    int n = 0;
+    for (; n < count; n++) {
+        workers[n].cpu = n % ncpu;
+        workers[n].fd = listen_socket(srv);
+        if (workers[n].fd < 0) {
+            break;
+        }
+    }
+    if (n < count) {
+        for (int i = 0; i < n; i++) {
+            close(workers[i].fd);
+        }
+        free(workers);
+        return -1;
+    }
+    // SIGINT must wake the main thread, workers are stopped by SIGUSR1
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    signal(SIGUSR1, on_cancel);
+    
+    int started = 1;
+    for (; started < count; started++) {
+        int e = pthread_create(&workers[started].thread,
+            0, worker_loop, &workers[started]);
+        if (e) {
+            errno = e;
+            uniperror("pthread_create");
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    
+    if (started == count) {
+        LOG(LOG_S, "workers: %d\n", count);
+        worker_loop(&workers[0]);
+    }
+    else {
+        close(workers[0].fd);
+        for (int i = started; i < count; i++) {
+            close(workers[i].fd);
+        }
+    }
+    NOT_EXIT = 0;
+    
+    for (int i = 1; i < started; i++) {
+        stop_worker(&workers[i]);
+    }
+    free(workers);
+    return started == count ? 0 : -1;
+}
+#endif
+
+
 int run(struct sockaddr_ina *srv)
 {
     #ifdef SIGPIPE
@@ -960,6 +2274,16 @@ int run(struct sockaddr_ina *srv)
     #endif
     signal(SIGINT, on_cancel);
     
+    #ifdef NFQ_SUPPORT
+    if (params.nfqueue >= 0) {
+        return nfq_run(params.nfqueue);
+    }
+    #endif
+    #ifdef WORKERS_SUPPORT
+    if (params.workers != 1) {
+        return run_workers(srv);
+    }
+    #endif
     int fd = listen_socket(srv);
     if (fd < 0) {
         return -1;
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <signal.h>
 
 #ifdef _WIN32
     #include <ws2tcpip.h>
@@ -16,6 +17,9 @@ struct sockaddr_ina {
     };
 };
 
+// candidates of one destination, see create_conn
+#define DST_MAX 8
+
 #pragma pack(push, 1)
 
 struct s4_req {
@@ -96,15 +100,37 @@ enum s4_rep {
 #define S_SIZE_I6 22
 #define S_SIZE_ID 7
 
+extern volatile sig_atomic_t NOT_EXIT;
+
 void map_fix(struct sockaddr_ina *addr, char f6);
 
+int nb_socket(int domain, int type);
+
 int resp_error(int fd, int e, int flag);
 
 int create_conn(struct poolhd *pool,
+        struct eval *val, struct sockaddr_ina *dst, int n, int next);
+
+struct eval *conn_extra(struct poolhd *pool,
         struct eval *val, struct sockaddr_ina *dst, int next);
 
 int on_tunnel(struct poolhd *pool, struct eval *val, 
         char *buffer, size_t bfsize, int out);
+
+int offload_tunnel(struct poolhd *pool, struct eval *val);
+
+int on_resolved(struct poolhd *pool, 
+        struct eval *val, struct sockaddr_ina *dst, int n, int type);
+
+int direct_connect(struct poolhd *pool,
+        struct eval *val, struct sockaddr_ina *dst);
+
+void close_conn(struct poolhd *pool, struct eval *val);
+
+#ifdef __linux__
+int on_protected(struct poolhd *pool, struct eval *val,
+        int fd, struct sockaddr_ina *dst, int next, int ok);
+#endif
         
 int listen_socket(struct sockaddr_ina *srv);
 
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+
+#include "sockmap.h"
+
+#ifdef SOCKMAP_SUPPORT
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/bpf.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+
+#include "proxy.h"
+#include "params.h"
+#include "error.h"
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), \
+        .src_reg = (s), .off = (o), .imm = (i) })
+
+#define SKB_OFF(field) \
+    offsetof(struct __sk_buff, field)
+
+struct sm_key {
+    uint32_t zero;
+    uint32_t lport;
+    uint32_t rport;
+    uint32_t ip[4];
+};
+
+static int map_fd = -1;
+static int parser_fd = -1;
+static int verdict_fd = -1;
+
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+static int load_prog(struct bpf_insn *insns, int cnt)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = cnt;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+
+static int attach_prog(int prog, int type)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    
+    attr.target_fd = map_fd;
+    attr.attach_bpf_fd = prog;
+    attr.attach_type = type;
+    
+    return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+
+int sockmap_init(int max)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    
+    attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size = sizeof(struct sm_key);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = max;
+    
+    map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0) {
+        uniperror("bpf map create");
+        return -1;
+    }
+    // whole message as one record
+    struct bpf_insn parser[] = {
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, SKB_OFF(len), 0),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+    // key of receiving socket -> peer socket, see sock_key(),
+    // v4 address takes first word of ip, rest is zero
+    struct bpf_insn verdict[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, SKB_OFF(family), 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 6, AF_INET),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip4), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -16, 0),
+        INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -12, 0),
+        INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -8, 0),
+        INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0),
+        INSN(BPF_JMP | BPF_JA, 0, 0, 8, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[0]), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -16, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[1]), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -12, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[2]), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -8, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[3]), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -4, 0),
+    
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, SKB_OFF(remote_port), 0),
+        INSN(BPF_JMP | BPF_JLE | BPF_K, BPF_REG_2, 0, 1, 0xffff),
+        INSN(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_2, 0, 0, 16),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -20, 0),
+    
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, SKB_OFF(local_port), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -24, 0),
+        INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -28, 0),
+    
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -28),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        // not found: pass to own socket, proxy will relay it
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+    parser_fd = load_prog(parser, sizeof(parser) / sizeof(*parser));
+    if (parser_fd < 0) {
+        uniperror("bpf load parser");
+        sockmap_close();
+        return -1;
+    }
+    verdict_fd = load_prog(verdict, sizeof(verdict) / sizeof(*verdict));
+    if (verdict_fd < 0) {
+        uniperror("bpf load verdict");
+        sockmap_close();
+        return -1;
+    }
+    if (attach_prog(parser_fd, BPF_SK_SKB_STREAM_PARSER)
+            || attach_prog(verdict_fd, BPF_SK_SKB_STREAM_VERDICT)) {
+        uniperror("bpf attach");
+        sockmap_close();
+        return -1;
+    }
+    return 0;
+}
+
+
+static int sock_key(int fd, struct sm_key *key)
+{
+    struct sockaddr_ina addr;
+    socklen_t len = sizeof(addr);
+    
+    memset(key, 0, sizeof(*key));
+    if (getpeername(fd, &addr.sa, &len) < 0) {
+        uniperror("getpeername");
+        return -1;
+    }
+    if (addr.sa.sa_family == AF_INET) {
+        memcpy(key->ip, &addr.in.sin_addr, sizeof(addr.in.sin_addr));
+    } else {
+        memcpy(key->ip, &addr.in6.sin6_addr, sizeof(key->ip));
+    }
+    key->rport = (uint16_t)addr.in.sin_port;
+    
+    len = sizeof(addr);
+    if (getsockname(fd, &addr.sa, &len) < 0) {
+        uniperror("getsockname");
+        return -1;
+    }
+    key->lport = ntohs(addr.in.sin_port);
+    return 0;
+}
+
+
+static int map_update(struct sm_key *key, int fd)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    
+    uint32_t value = fd;
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    attr.flags = BPF_ANY;
+    
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+static void map_delete(struct sm_key *key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+
+int sockmap_add(int fd1, int fd2)
+{
+    struct sm_key k1, k2;
+    
+    if (sock_key(fd1, &k1) || sock_key(fd2, &k2)) {
+        return -1;
+    }
+    if (map_update(&k1, fd2)) {
+        uniperror("bpf map update");
+        return -1;
+    }
+    if (map_update(&k2, fd1)) {
+        uniperror("bpf map update");
+        map_delete(&k1);
+        return -1;
+    }
+    // sockets are removed from map by kernel on close
+    return 0;
+}
+
+
+int sockmap_balance(int rfd, int wfd, ssize_t *diff)
+{
+    struct tcp_info ri, wi;
+    socklen_t rl = sizeof(ri), wl = sizeof(wi);
+    int outq = 0;
+    
+    if (getsockopt(rfd, IPPROTO_TCP, TCP_INFO, &ri, &rl)
+            || getsockopt(wfd, IPPROTO_TCP, TCP_INFO, &wi, &wl)
+            || ioctl(wfd, SIOCOUTQ, &outq)) {
+        uniperror("sockmap_balance");
+        return -1;
+    }
+    if (rl < offsetof(struct tcp_info, tcpi_bytes_received) + 8
+            || wl < offsetof(struct tcp_info, tcpi_bytes_acked) + 8) {
+        return -1;
+    }
+    // written to wfd minus received from rfd
+    *diff = (ssize_t )(wi.tcpi_bytes_acked + outq) 
+        - (ssize_t )ri.tcpi_bytes_received;
+    return 0;
+}
+
+
+unsigned int sockmap_idle(int fd1, int fd2)
+{
+    struct tcp_info i1, i2;
+    socklen_t l1 = sizeof(i1), l2 = sizeof(i2);
+    
+    // redirected data doesn't wake proxy, ask kernel
+    if (getsockopt(fd1, IPPROTO_TCP, TCP_INFO, &i1, &l1)
+            || getsockopt(fd2, IPPROTO_TCP, TCP_INFO, &i2, &l2)) {
+        return 0;
+    }
+    return i1.tcpi_last_data_recv < i2.tcpi_last_data_recv ?
+        i1.tcpi_last_data_recv : i2.tcpi_last_data_recv;
+}
+
+
+void sockmap_close(void)
+{
+    if (verdict_fd >= 0) {
+        close(verdict_fd);
+        verdict_fd = -1;
+    }
+    if (parser_fd >= 0) {
+        close(parser_fd);
+        parser_fd = -1;
+    }
+    if (map_fd >= 0) {
+        close(map_fd);
+        map_fd = -1;
+    }
+}
+#endif
@@ -0,0 +1,15 @@
+#ifdef __linux__
+#define SOCKMAP_SUPPORT 1
+
+#include <sys/types.h>
+
+int sockmap_init(int max);
+
+int sockmap_add(int fd1, int fd2);
+
+int sockmap_balance(int rfd, int wfd, ssize_t *diff);
+
+unsigned int sockmap_idle(int fd1, int fd2);
+
+void sockmap_close(void);
+#endif
@@ -0,0 +1,1037 @@
+#define _GNU_SOURCE
+
+#include "tun.h"
+
+#ifdef TUN_SUPPORT
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/if_tun.h>
+
+#include "proxy.h"
+#include "extend.h"
+#include "params.h"
+#include "error.h"
+
+// buffer of one packet, largest one is 0xffff
+#define TUN_PKT 0x10000
+
+// sent data of closed socket is kept in growing buffer, see flow_read
+#define TUN_SNDBUF_MAX (16 * 1024 * 1024)
+
+#define IPLEN(k) ((k)->family == AF_INET ? 20 : 40)
+
+// first member of flow, flows are looked up by it
+struct tun_key {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t family;
+    uint8_t proto;
+};
+
+struct tun_flow {
+    struct tun_key key;
+    struct eval *ev;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint32_t wnd;
+    int mss;
+    int rto;
+    char tries;
+    // SYN-ACK is acked
+    char synced;
+    char fin_in;
+    char fin_out;
+    // socket is read till end
+    char eof;
+    // socket is closed by other side and replaced, see flow_detach
+    char detached;
+    // ring of unacked and unsent data
+    char *sbuf;
+    size_t scap;
+    size_t soff;
+    size_t slen;
+    // ring of received data, which socket did not take, see flow_flush
+    char *rbuf;
+    size_t roff;
+    size_t rlen;
+};
+
+
+static uint32_t sum16(uint32_t sum, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    
+    for (; len > 1; len -= 2, p += 2) {
+        sum += (p[0] << 8) | p[1];
+    }
+    if (len) {
+        sum += p[0] << 8;
+    }
+    return sum;
+}
+
+
+static uint16_t fold16(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons(~sum);
+}
+
+
+static void key_addr(const struct tun_key *k,
+        struct sockaddr_ina *addr, int dst)
+{
+    memset(addr, 0, sizeof(*addr));
+    
+    if (k->family == AF_INET) {
+        addr->in.sin_family = AF_INET;
+        addr->in.sin_port = dst ? k->dport : k->sport;
+        memcpy(&addr->in.sin_addr, dst ? k->dst : k->src, 4);
+    }
+    else {
+        addr->in6.sin6_family = AF_INET6;
+        addr->in6.sin6_port = dst ? k->dport : k->sport;
+        memcpy(&addr->in6.sin6_addr, dst ? k->dst : k->src, 16);
+    }
+}
+
+
+// transport part is already in place, addresses are swapped
+static void tun_emit(struct tun *t, const struct tun_key *k, size_t l4len)
+{
+    char *p = t->pkt + TUN_PKT;
+    size_t iplen = IPLEN(k), alen = iplen == 20 ? 4 : 16;
+    char *l4 = p + iplen;
+    
+    uint16_t *check = (uint16_t *)(l4
+        + (k->proto == IPPROTO_TCP ? 16 : 6));
+    *check = 0;
+    
+    uint32_t sum = sum16(0, k->src, alen);
+    sum = sum16(sum, k->dst, alen);
+    sum += k->proto + l4len;
+    *check = fold16(sum16(sum, l4, l4len));
+    
+    if (!*check && k->proto == IPPROTO_UDP) {
+        *check = 0xffff;
+    }
+    if (k->family == AF_INET) {
+        struct iphdr *ip = (struct iphdr *)p;
+        memset(ip, 0, sizeof(*ip));
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(iplen + l4len);
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = 64;
+        ip->protocol = k->proto;
+        memcpy(&ip->saddr, k->dst, 4);
+        memcpy(&ip->daddr, k->src, 4);
+        ip->check = fold16(sum16(0, ip, sizeof(*ip)));
+    }
+    else {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)p;
+        memset(ip6, 0, sizeof(*ip6));
+        ip6->ip6_flow = htonl(6 << 28);
+        ip6->ip6_plen = htons(l4len);
+        ip6->ip6_nxt = k->proto;
+        ip6->ip6_hlim = 64;
+        memcpy(&ip6->ip6_src, k->dst, 16);
+        memcpy(&ip6->ip6_dst, k->src, 16);
+    }
+    // full queue, lost like on wire
+    if (write(t->ev->fd, p, iplen + l4len) < 0) {
+        LOG(LOG_S, "tun write: %s\n", strerror(errno));
+    }
+}
+
+
+static void tcp_send(struct tun *t, struct tun_flow *f,
+        uint32_t seq, int flags, size_t off, size_t len)
+{
+    struct tcphdr *th = (struct tcphdr *)(t->pkt + TUN_PKT + IPLEN(&f->key));
+    size_t hlen = sizeof(*th) + (flags & TH_SYN ? 4 : 0);
+    memset(th, 0, hlen);
+    
+    th->source = f->key.dport;
+    th->dest = f->key.sport;
+    th->seq = htonl(seq);
+    th->ack_seq = htonl(f->rcv_nxt);
+    th->doff = hlen / 4;
+    th->window = htons(TUN_WND - f->rlen);
+    ((uint8_t *)th)[13] = flags;
+    
+    if (flags & TH_SYN) {
+        uint8_t *opt = (uint8_t *)(th + 1);
+        int mss = t->mtu - IPLEN(&f->key) - sizeof(*th);
+        opt[0] = TCPOPT_MAXSEG;
+        opt[1] = TCPOLEN_MAXSEG;
+        opt[2] = mss >> 8;
+        opt[3] = mss;
+    }
+    if (len) {
+        char *data = (char *)th + hlen;
+        size_t pos = (f->soff + off) % f->scap;
+        size_t n = f->scap - pos < len ? f->scap - pos : len;
+        
+        memcpy(data, f->sbuf + pos, n);
+        memcpy(data + n, f->sbuf, len - n);
+    }
+    tun_emit(t, &f->key, hlen + len);
+}
+
+
+static void tcp_reset(struct tun *t, struct tun_flow *f)
+{
+    tcp_send(t, f, f->snd_nxt, TH_RST | TH_ACK, 0, 0);
+}
+
+
+static void flow_events(struct poolhd *pool, struct tun_flow *f)
+{
+    int e = 0;
+    if (!f->eof && f->slen < f->scap) {
+        e |= POLLIN;
+    }
+    if (f->rlen) {
+        e |= POLLOUT;
+    }
+    if (!f->detached && e != f->ev->events
+            && mod_etype(pool, f->ev, e)) {
+        uniperror("mod_etype");
+    }
+}
+
+
+static void tcp_output(struct poolhd *pool, struct tun *t, struct tun_flow *f)
+{
+    if (!f->synced || f->fin_out) {
+        return;
+    }
+    int idle = f->snd_nxt == f->snd_una;
+    size_t sent = f->snd_nxt - f->snd_una;
+    
+    while (sent < f->slen && sent < f->wnd) {
+        size_t n = f->slen - sent;
+        if (n > f->wnd - sent) {
+            n = f->wnd - sent;
+        }
+        if (n > (size_t )f->mss) {
+            n = f->mss;
+        }
+        tcp_send(t, f, f->snd_una + sent, TH_ACK | TH_PUSH, sent, n);
+        sent += n;
+    }
+    f->snd_nxt = f->snd_una + sent;
+    
+    if (f->eof && sent == f->slen) {
+        tcp_send(t, f, f->snd_nxt, TH_FIN | TH_ACK, 0, 0);
+        f->snd_nxt++;
+        f->fin_out = 1;
+    }
+    // zero window is probed by same timer
+    if (idle && (f->slen || f->fin_out)) {
+        set_timer(pool, f->ev, f->rto);
+    }
+}
+
+
+// socket of flow is closed, but unacked data is still needed
+static int flow_detach(struct poolhd *pool, struct tun_flow *f)
+{
+    // always readable would be reported without end
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        uniperror("eventfd");
+        return -1;
+    }
+    struct eval *ev = add_event(pool, EV_TUN_FLOW, fd, 0);
+    if (!ev) {
+        close(fd);
+        return -1;
+    }
+    struct eval *old = f->ev;
+    old->cold->tun = 0;
+    del_event(pool, old);
+    
+    ev->cold->tun = f;
+    f->ev = ev;
+    f->detached = 1;
+    f->rlen = 0;
+    
+    if (f->slen || f->snd_nxt != f->snd_una) {
+        set_timer(pool, ev, f->rto);
+    }
+    else if (f->fin_out) {
+        set_timer(pool, ev, TUN_FIN_WAIT);
+    }
+    return 0;
+}
+
+
+static int flow_read(struct tun_flow *f, int hup)
+{
+    while (!f->eof) {
+        if (f->slen == f->scap) {
+            if (!hup) {
+                break;
+            }
+            if (f->scap * 2 > TUN_SNDBUF_MAX) {
+                LOG(LOG_E, "tun: send buffer overflow\n");
+                return -1;
+            }
+            char *sbuf = malloc(f->scap * 2);
+            if (!sbuf) {
+                uniperror("malloc");
+                return -1;
+            }
+            size_t n = f->scap - f->soff;
+            memcpy(sbuf, f->sbuf + f->soff, n);
+            memcpy(sbuf + n, f->sbuf, f->soff);
+            free(f->sbuf);
+            
+            f->sbuf = sbuf;
+            f->soff = 0;
+            f->scap *= 2;
+        }
+        size_t end = (f->soff + f->slen) % f->scap;
+        size_t room = f->scap - f->slen;
+        
+        struct iovec iov[2] = {
+            { .iov_base = f->sbuf + end },
+            { .iov_base = f->sbuf }
+        };
+        iov[0].iov_len = f->scap - end < room ? f->scap - end : room;
+        iov[1].iov_len = room - iov[0].iov_len;
+        
+        ssize_t n = readv(f->ev->fd, iov, iov[1].iov_len ? 2 : 1);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                f->ev->ready &= ~POLLIN;
+                break;
+            }
+            uniperror("tun: read");
+            return -1;
+        }
+        if (!n) {
+            f->eof = 1;
+            break;
+        }
+        f->slen += n;
+    }
+    return 0;
+}
+
+
+static int flow_flush(struct tun_flow *f)
+{
+    while (f->rlen) {
+        size_t n = TUN_WND - f->roff < f->rlen ? TUN_WND - f->roff : f->rlen;
+        
+        ssize_t sn = send(f->ev->fd, f->rbuf + f->roff, n, MSG_NOSIGNAL);
+        if (sn < 0) {
+            if (errno == EAGAIN) {
+                f->ev->ready &= ~POLLOUT;
+                return 0;
+            }
+            uniperror("tun: send");
+            return -1;
+        }
+        f->roff = (f->roff + sn) % TUN_WND;
+        f->rlen -= sn;
+    }
+    if (f->fin_in) {
+        shutdown(f->ev->fd, SHUT_WR);
+    }
+    return 0;
+}
+
+
+int on_tun_flow(struct poolhd *pool, struct eval *val, int etype)
+{
+    struct tun *t = pool->tun;
+    struct tun_flow *f = val->cold->tun;
+    
+    if (etype & POLLERR) {
+        tcp_reset(t, f);
+        return -1;
+    }
+    if (etype & POLLOUT) {
+        if (flow_flush(f)) {
+            tcp_reset(t, f);
+            return -1;
+        }
+        // window update
+        tcp_send(t, f, f->snd_nxt, TH_ACK, 0, 0);
+    }
+    if (etype & (POLLIN | POLLHUP)) {
+        if (flow_read(f, etype & POLLHUP)) {
+            tcp_reset(t, f);
+            return -1;
+        }
+    }
+    tcp_output(pool, t, f);
+    
+    if (etype & POLLHUP) {
+        if (f->fin_in && f->fin_out && f->snd_una == f->snd_nxt) {
+            return -1;
+        }
+        if (flow_detach(pool, f)) {
+            tcp_reset(t, f);
+            return -1;
+        }
+        return 0;
+    }
+    flow_events(pool, f);
+    return 0;
+}
+
+
+static int tcp_acked(struct poolhd *pool, struct tun *t,
+        struct tun_flow *f, uint32_t ack, uint16_t wnd)
+{
+    if ((int32_t )(ack - f->snd_nxt) > 0
+            || (int32_t )(ack - f->snd_una) < 0) {
+        return 0;
+    }
+    f->wnd = wnd;
+    uint32_t n = ack - f->snd_una;
+    
+    if (n) {
+        if (!f->synced) {
+            f->synced = 1;
+            f->snd_una++;
+            n--;
+        }
+        // may include FIN
+        if (n > f->slen) {
+            n = f->slen;
+        }
+        f->soff = (f->soff + n) % f->scap;
+        f->slen -= n;
+        f->snd_una = ack;
+        
+        f->tries = 0;
+        f->rto = TUN_RTO;
+        
+        if (f->fin_out && ack == f->snd_nxt) {
+            if (f->fin_in) {
+                return -1;
+            }
+            // peer may never close its side
+            set_timer(pool, f->ev, f->detached ? TUN_FIN_WAIT : 0);
+        }
+        else {
+            set_timer(pool, f->ev,
+                f->slen || f->snd_nxt != f->snd_una ? f->rto : 0);
+        }
+    }
+    tcp_output(pool, t, f);
+    flow_events(pool, f);
+    return 0;
+}
+
+
+static int tcp_data(struct poolhd *pool, struct tun *t,
+        struct tun_flow *f, uint32_t seq, char *data, size_t len, int fin)
+{
+    uint32_t off = f->rcv_nxt - seq;
+    
+    // duplicate or out of order, ack tells what is expected
+    if ((int32_t )off < 0 || off > len + fin || f->fin_in) {
+        tcp_send(t, f, f->snd_nxt, TH_ACK, 0, 0);
+        return 0;
+    }
+    data += off;
+    len -= off < len ? off : len;
+    
+    if (len) {
+        if (f->detached) {
+            LOG(LOG_S, "tun: data after close\n");
+            tcp_reset(t, f);
+            return -1;
+        }
+        ssize_t n = 0;
+        
+        // new data can't overtake kept one
+        if (!f->rlen) {
+            n = send(f->ev->fd, data, len, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    uniperror("tun: send");
+                    tcp_reset(t, f);
+                    return -1;
+                }
+                f->ev->ready &= ~POLLOUT;
+                n = 0;
+            }
+        }
+        // window is shrunk by kept data, so peer doesn't resend it
+        if ((size_t )n < len) {
+            if (!f->rbuf && !(f->rbuf = malloc(TUN_WND))) {
+                uniperror("malloc");
+                tcp_reset(t, f);
+                return -1;
+            }
+            size_t keep = len - n;
+            if (keep > TUN_WND - f->rlen) {
+                keep = TUN_WND - f->rlen;
+            }
+            size_t pos = (f->roff + f->rlen) % TUN_WND;
+            size_t m = TUN_WND - pos < keep ? TUN_WND - pos : keep;
+            
+            memcpy(f->rbuf + pos, data + n, m);
+            memcpy(f->rbuf, data + n + m, keep - m);
+            f->rlen += keep;
+            n += keep;
+            
+            flow_events(pool, f);
+        }
+        f->rcv_nxt += n;
+        
+        if ((size_t )n < len) {
+            fin = 0;
+        }
+    }
+    if (fin) {
+        f->rcv_nxt++;
+        f->fin_in = 1;
+        
+        // after kept data, see flow_flush
+        if (!f->detached && !f->rlen) {
+            shutdown(f->ev->fd, SHUT_WR);
+        }
+    }
+    tcp_send(t, f, f->snd_nxt, TH_ACK, 0, 0);
+    
+    if (f->fin_in && f->fin_out && f->snd_una == f->snd_nxt) {
+        return -1;
+    }
+    return 0;
+}
+
+
+static void tcp_open(struct poolhd *pool, struct tun *t,
+        const struct tun_key *k, struct tcphdr *th)
+{
+    struct sockaddr_ina dst, src;
+    key_addr(k, &dst, 1);
+    key_addr(k, &src, 0);
+    
+    int sv[2];
+    if (socketpair(AF_UNIX,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+        uniperror("socketpair");
+        return;
+    }
+    struct tun_flow *f = calloc(1, sizeof(*f));
+    if (!f || !(f->sbuf = malloc(TUN_SNDBUF))) {
+        uniperror("malloc");
+        free(f);
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    f->key = *k;
+    f->scap = TUN_SNDBUF;
+    
+    if (!(f->ev = add_event(pool, EV_TUN_FLOW, sv[0], POLLIN))) {
+        free(f->sbuf);
+        free(f);
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    f->ev->cold->tun = f;
+    
+    if (!mem_add(t->flows, (char *)&f->key, sizeof(f->key))) {
+        uniperror("mem_add");
+        close_conn(pool, f->ev);
+        close(sv[1]);
+        return;
+    }
+    struct eval *client = add_event(pool, EV_REQUEST, sv[1], 0);
+    if (!client) {
+        close_conn(pool, f->ev);
+        close(sv[1]);
+        return;
+    }
+    client->cold->in6 = src.in6;
+    set_timer(pool, client, params.conn_timeout);
+    
+    if (direct_connect(pool, client, &dst)) {
+        close_conn(pool, client);
+        close_conn(pool, f->ev);
+        return;
+    }
+    uint8_t *opt = (uint8_t *)(th + 1), *end = (uint8_t *)th + th->doff * 4;
+    f->mss = 536;
+    
+    while (opt < end && *opt != TCPOPT_EOL) {
+        if (*opt == TCPOPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+            break;
+        }
+        if (opt[0] == TCPOPT_MAXSEG && opt[1] == TCPOLEN_MAXSEG) {
+            f->mss = (opt[2] << 8) | opt[3];
+        }
+        opt += opt[1];
+    }
+    int mss = t->mtu - IPLEN(k) - sizeof(struct tcphdr);
+    if (f->mss > mss || f->mss < 64) {
+        f->mss = mss;
+    }
+    t->seed = t->seed * 1103515245 + 12345;
+    
+    f->rcv_nxt = ntohl(th->seq) + 1;
+    f->snd_una = t->seed;
+    f->snd_nxt = t->seed + 1;
+    f->wnd = ntohs(th->window);
+    f->rto = TUN_RTO;
+    
+    tcp_send(t, f, f->snd_una, TH_SYN | TH_ACK, 0, 0);
+    set_timer(pool, f->ev, f->rto);
+    
+    LOG(LOG_S, "tun: new tcp flow: fd=%d\n", client->fd);
+}
+
+
+static void tcp_input(struct poolhd *pool, struct tun *t,
+        struct tun_key *k, struct tcphdr *th, char *data, size_t len)
+{
+    struct elem *e = mem_get(t->flows, (char *)k, sizeof(*k));
+    uint32_t seq = ntohl(th->seq);
+    
+    if (!e) {
+        if (th->rst) {
+            return;
+        }
+        if (th->syn && !th->ack) {
+            tcp_open(pool, t, k, th);
+            return;
+        }
+        struct tun_flow f = { .key = *k };
+        if (th->ack) {
+            f.snd_nxt = ntohl(th->ack_seq);
+            tcp_send(t, &f, f.snd_nxt, TH_RST, 0, 0);
+        }
+        else {
+            f.rcv_nxt = seq + len + th->syn + th->fin;
+            tcp_send(t, &f, 0, TH_RST | TH_ACK, 0, 0);
+        }
+        return;
+    }
+    struct tun_flow *f = (struct tun_flow *)e->data;
+    
+    if (th->rst) {
+        LOG(LOG_S, "tun: reset by peer\n");
+        close_conn(pool, f->ev);
+        return;
+    }
+    if (th->syn) {
+        // SYN-ACK is lost
+        if (!f->synced && seq + 1 == f->rcv_nxt) {
+            tcp_send(t, f, f->snd_una, TH_SYN | TH_ACK, 0, 0);
+        }
+        return;
+    }
+    if (!th->ack) {
+        return;
+    }
+    if (tcp_acked(pool, t, f, ntohl(th->ack_seq), ntohs(th->window))) {
+        close_conn(pool, f->ev);
+        return;
+    }
+    if (f->synced && (len || th->fin)
+            && tcp_data(pool, t, f, seq, data, len, th->fin)) {
+        close_conn(pool, f->ev);
+    }
+}
+
+
+static struct tun_flow *udp_open(struct poolhd *pool,
+        struct tun *t, const struct tun_key *k)
+{
+    struct sockaddr_ina dst;
+    key_addr(k, &dst, 1);
+    
+    if (params.baddr.sin6_family == AF_INET6) {
+        map_fix(&dst, 6);
+    }
+    else if (dst.sa.sa_family != AF_INET) {
+        return 0;
+    }
+    int fd = nb_socket(params.baddr.sin6_family, SOCK_DGRAM);
+    if (fd < 0) {
+        uniperror("socket");
+        return 0;
+    }
+    if (params.baddr.sin6_family == AF_INET6) {
+        int no = 0;
+        if (setsockopt(fd, IPPROTO_IPV6,
+                IPV6_V6ONLY, (char *)&no, sizeof(no))) {
+            uniperror("setsockopt IPV6_V6ONLY");
+        }
+    }
+    if (bind(fd, (struct sockaddr *)&params.baddr,
+            sizeof(params.baddr)) < 0) {
+        uniperror("bind");
+        close(fd);
+        return 0;
+    }
+    // one socket per flow, it is rare enough to wait for peer
+    if (params.protect_path
+            && protect(fd, params.protect_path) < 0) {
+        close(fd);
+        return 0;
+    }
+    if (connect(fd, &dst.sa, sizeof(dst)) < 0) {
+        uniperror("connect");
+        close(fd);
+        return 0;
+    }
+    struct tun_flow *f = calloc(1, sizeof(*f));
+    if (!f) {
+        uniperror("calloc");
+        close(fd);
+        return 0;
+    }
+    f->key = *k;
+    
+    if (!(f->ev = add_event(pool, EV_TUN_UDP, fd, POLLIN))) {
+        free(f);
+        close(fd);
+        return 0;
+    }
+    f->ev->cold->tun = f;
+    f->ev->cold->in6 = dst.in6;
+    
+    if (!mem_add(t->flows, (char *)&f->key, sizeof(f->key))) {
+        uniperror("mem_add");
+        close_conn(pool, f->ev);
+        return 0;
+    }
+    LOG(LOG_S, "tun: new udp flow: fd=%d\n", fd);
+    return f;
+}
+
+
+static void udp_input(struct poolhd *pool, struct tun *t,
+        struct tun_key *k, char *data, size_t len)
+{
+    struct elem *e = mem_get(t->flows, (char *)k, sizeof(*k));
+    struct tun_flow *f = e ? (struct tun_flow *)e->data : udp_open(pool, t, k);
+    if (!f) {
+        return;
+    }
+    if (udp_hook(f->ev, data, TUN_PKT - (data - t->pkt), len,
+            (struct sockaddr_ina *)&f->ev->cold->in6) < 0) {
+        // refused by previous ICMP or full buffer, lost like on wire
+        LOG(LOG_S, "tun: send udp: %s\n", strerror(errno));
+    }
+    set_timer(pool, f->ev,
+        params.idle_timeout ? params.idle_timeout : TUN_UDP_IDLE);
+}
+
+
+int on_tun_udp(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize)
+{
+    struct tun *t = pool->tun;
+    struct tun_flow *f = val->cold->tun;
+    
+    size_t hlen = IPLEN(&f->key) + sizeof(struct udphdr);
+    struct udphdr *uh = (struct udphdr *)(t->pkt
+        + TUN_PKT + IPLEN(&f->key));
+    
+    for (;;) {
+        ssize_t n = recv(val->fd, (char *)(uh + 1), 0xffff - hlen, 0);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                val->ready &= ~POLLIN;
+                break;
+            }
+            // ICMP unreachable, next send will be tried
+            if (errno == ECONNREFUSED) {
+                continue;
+            }
+            uniperror("tun: recv udp");
+            return -1;
+        }
+        val->cold->recv_count += n;
+        
+        uh->source = f->key.dport;
+        uh->dest = f->key.sport;
+        uh->len = htons(sizeof(*uh) + n);
+        tun_emit(t, &f->key, sizeof(*uh) + n);
+    }
+    set_timer(pool, val,
+        params.idle_timeout ? params.idle_timeout : TUN_UDP_IDLE);
+    return 0;
+}
+
+
+static void tun_input(struct poolhd *pool, struct tun *t, char *pkt, size_t n)
+{
+    struct tun_key k = { 0 };
+    size_t iplen, len;
+    
+    if (n >= 20 && ((uint8_t )*pkt >> 4) == 4) {
+        struct iphdr *ip = (struct iphdr *)pkt;
+        iplen = ip->ihl * 4;
+        len = ntohs(ip->tot_len);
+        
+        // fragments are not reassembled
+        if (iplen < 20 || len < iplen || len > n
+                || (ntohs(ip->frag_off) & (IP_MF | IP_OFFMASK))) {
+            return;
+        }
+        k.family = AF_INET;
+        k.proto = ip->protocol;
+        memcpy(k.src, &ip->saddr, 4);
+        memcpy(k.dst, &ip->daddr, 4);
+    }
+    else if (n >= 40 && ((uint8_t )*pkt >> 4) == 6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)pkt;
+        iplen = 40;
+        len = iplen + ntohs(ip6->ip6_plen);
+        if (len > n) {
+            return;
+        }
+        k.family = AF_INET6;
+        // extension headers are not followed
+        k.proto = ip6->ip6_nxt;
+        memcpy(k.src, &ip6->ip6_src, 16);
+        memcpy(k.dst, &ip6->ip6_dst, 16);
+    }
+    else {
+        return;
+    }
+    char *l4 = pkt + iplen;
+    len -= iplen;
+    
+    if (k.proto == IPPROTO_TCP && len >= sizeof(struct tcphdr)) {
+        struct tcphdr *th = (struct tcphdr *)l4;
+        size_t hlen = th->doff * 4;
+        if (hlen < sizeof(*th) || hlen > len) {
+            return;
+        }
+        k.sport = th->source;
+        k.dport = th->dest;
+        tcp_input(pool, t, &k, th, l4 + hlen, len - hlen);
+    }
+    else if (k.proto == IPPROTO_UDP && len >= sizeof(struct udphdr)) {
+        struct udphdr *uh = (struct udphdr *)l4;
+        size_t ulen = ntohs(uh->len);
+        if (ulen < sizeof(*uh) || ulen > len) {
+            return;
+        }
+        k.sport = uh->source;
+        k.dport = uh->dest;
+        udp_input(pool, t, &k, l4 + sizeof(*uh), ulen - sizeof(*uh));
+    }
+}
+
+
+void on_tun(struct poolhd *pool, struct eval *val)
+{
+    struct tun *t = pool->tun;
+    
+    for (;;) {
+        ssize_t n = read(val->fd, t->pkt, TUN_PKT);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                val->ready &= ~POLLIN;
+            }
+            else {
+                uniperror("tun: read");
+            }
+            return;
+        }
+        tun_input(pool, t, t->pkt, n);
+    }
+}
+
+
+int tun_timeout(struct poolhd *pool, struct eval *val)
+{
+    struct tun *t = pool->tun;
+    struct tun_flow *f = val->cold->tun;
+    
+    if (f->key.proto == IPPROTO_UDP) {
+        LOG(LOG_S, "tun: udp idle timeout: fd=%d\n", val->fd);
+        return -1;
+    }
+    if (f->fin_out && f->snd_nxt == f->snd_una) {
+        LOG(LOG_S, "tun: fin wait timeout: fd=%d\n", val->fd);
+        tcp_reset(t, f);
+        return -1;
+    }
+    if (!f->synced || f->snd_nxt != f->snd_una) {
+        if (++f->tries > TUN_RETRIES) {
+            LOG(LOG_S, "tun: retransmission timeout: fd=%d\n", val->fd);
+            tcp_reset(t, f);
+            return -1;
+        }
+    }
+    if (f->rto < TUN_RTO_MAX) {
+        f->rto *= 2;
+    }
+    set_timer(pool, val, f->rto);
+    
+    if (!f->synced) {
+        tcp_send(t, f, f->snd_una, TH_SYN | TH_ACK, 0, 0);
+    }
+    else if (f->snd_nxt == f->snd_una) {
+        if (!f->slen) {
+            set_timer(pool, val, 0);
+            return 0;
+        }
+        // zero window probe, ack returns window
+        tcp_send(t, f, f->snd_una - 1, TH_ACK, 0, 0);
+    }
+    else {
+        // go back to first unacked byte
+        f->snd_nxt = f->snd_una;
+        f->fin_out = 0;
+        uint32_t wnd = f->wnd;
+        
+        // unacked FIN without data, or shrunk window
+        if (!wnd) {
+            f->wnd = 1;
+        }
+        tcp_output(pool, t, f);
+        f->wnd = wnd;
+    }
+    return 0;
+}
+
+
+void tun_close(struct poolhd *pool, struct eval *val)
+{
+    struct tun_flow *f = val->cold->tun;
+    
+    mem_delete(pool->tun->flows, (char *)&f->key, sizeof(f->key));
+    val->cold->tun = 0;
+    free(f->sbuf);
+    free(f->rbuf);
+    free(f);
+}
+
+
+int tun_open(struct poolhd *pool)
+{
+    struct tun *t = calloc(1, sizeof(*t));
+    if (!t) {
+        uniperror("calloc");
+        return -1;
+    }
+    // received packet and one being built
+    if (!(t->pkt = malloc(TUN_PKT * 2))
+            || !(t->flows = mem_pool(1))) {
+        uniperror("malloc");
+        free(t->pkt);
+        free(t);
+        return -1;
+    }
+    char *end;
+    int fd = strtol(params.tun, &end, 10);
+    struct ifreq ifr = { 0 };
+    
+    // descriptor passed by parent, e.g. VpnService
+    if (!*end) {
+        fd = dup(fd);
+        if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            uniperror("fcntl");
+        }
+    }
+    else {
+        fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        
+        // queue per worker, flow is always hashed to same queue
+        ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+        strncpy(ifr.ifr_name, params.tun, IFNAMSIZ - 1);
+        
+        if (fd >= 0 && ioctl(fd, TUNSETIFF, &ifr) < 0) {
+            uniperror("ioctl TUNSETIFF");
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        uniperror("tun open");
+        mem_destroy(t->flows);
+        free(t->pkt);
+        free(t);
+        return -1;
+    }
+    t->mtu = 1500;
+    
+    if (ifr.ifr_name[0]) {
+        int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (s >= 0 && !ioctl(s, SIOCGIFMTU, &ifr)) {
+            t->mtu = ifr.ifr_mtu;
+        }
+        if (s >= 0) {
+            close(s);
+        }
+    }
+    if (t->mtu < 576 || t->mtu > 0xffff) {
+        t->mtu = t->mtu < 576 ? 576 : 0xffff;
+    }
+    if (!(t->ev = add_event(pool, EV_TUN, fd, POLLIN))) {
+        close(fd);
+        mem_destroy(t->flows);
+        free(t->pkt);
+        free(t);
+        return -1;
+    }
+    t->seed = time(0) ^ (uintptr_t )t;
+    pool->tun = t;
+    return 0;
+}
+
+
+void tun_free(struct poolhd *pool)
+{
+    struct tun *t = pool->tun;
+    if (!t) {
+        return;
+    }
+    // evals are closed by destroy_pool
+    while (t->flows->root) {
+        struct tun_flow *f = (struct tun_flow *)t->flows->root->data;
+        mem_delete(t->flows, (char *)&f->key, sizeof(f->key));
+        free(f->sbuf);
+        free(f->rbuf);
+        free(f);
+    }
+    mem_destroy(t->flows);
+    free(t->pkt);
+    free(t);
+    pool->tun = 0;
+}
+#endif
@@ -0,0 +1,49 @@
+#include <stdint.h>
+
+#include "conev.h"
+
+#ifdef __linux__
+#define TUN_SUPPORT 1
+
+// unacked and unsent data of one tcp flow, also limit of peer window
+#define TUN_SNDBUF 65535
+
+// window announced to peer, data, which socketpair did not take, is kept
+#define TUN_WND 65535
+
+// retransmission timeout, ms, doubled on every try
+#define TUN_RTO 200
+#define TUN_RTO_MAX 6400
+#define TUN_RETRIES 8
+
+// closed socket and acked FIN, but peer does not close, ms
+#define TUN_FIN_WAIT 60000
+
+// udp flow without replies is closed after, ms, if idle timeout is not set
+#define TUN_UDP_IDLE 60000
+
+struct tun_flow;
+
+struct tun {
+    struct eval *ev;
+    int mtu;
+    uint32_t seed;
+    struct mphdr *flows;
+    char *pkt;
+};
+
+int tun_open(struct poolhd *pool);
+
+void on_tun(struct poolhd *pool, struct eval *val);
+
+int on_tun_flow(struct poolhd *pool, struct eval *val, int etype);
+
+int on_tun_udp(struct poolhd *pool, struct eval *val,
+        char *buffer, size_t bfsize);
+
+int tun_timeout(struct poolhd *pool, struct eval *val);
+
+void tun_close(struct poolhd *pool, struct eval *val);
+
+void tun_free(struct poolhd *pool);
+#endif